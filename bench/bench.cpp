@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+/*
+	Runs every integrator (post1, post2, ... as many as there are next to us) on a fixed set of scenes, resolutions
+	and sample counts with fixed seeds, plus a thread scaling run of the last one. Each run is a separate process
+	that writes a JSON report (-json); they are collected in one JSON file.
+
+	With -references dir the images are compared against dir/<scene>_<width>x<height>.pfm. -make_references renders
+	those with the last integrator at -reference_spp samples first.
+
+	With -baseline file the Mrays/s of each run is compared against the run with the same name in an earlier report.
+	Runs that are more than -tolerance percent slower are listed and the exit code is 1.
+
+	Usage: pathtracer_bench [-bin dir] [-output bench.json] [-references dir] [-make_references] [-reference_spp N]
+	                        [-baseline old.json] [-tolerance percent] [-scene file]... [-quick]
+*/
+
+namespace {
+#if defined(_WIN32)
+	const char *EXE_SUFFIX = ".exe";
+#else
+	const char *EXE_SUFFIX = "";
+#endif
+
+	const uint32_t SEED = 1;
+	const uint32_t SPP = 16;
+
+	struct BenchScene {
+		std::string name; // Used in run and reference names
+		std::string args;
+	};
+
+	struct Resolution {
+		uint32_t width, height;
+	};
+
+	struct Run {
+		std::string name; // integrator/scene/resolution/threads, unique in a report
+		std::string report; // JSON object written by the integrator
+	};
+
+	bool file_exists(const std::string &path) {
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+		fclose(f);
+		return true;
+	}
+
+	bool read_file(const std::string &path, std::string &out_text) {
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+		out_text.clear();
+		char buffer[4096];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) != 0)
+			out_text.append(buffer, n);
+		fclose(f);
+		return true;
+	}
+
+	std::string directory_of(const char *path) {
+		const std::string p = path;
+		const size_t slash = p.find_last_of("/\\");
+		return slash == std::string::npos ? std::string(".") : p.substr(0, slash);
+	}
+
+	// Installed, everything is in one directory. In the build tree postN is in ../postN/.
+	std::string find_integrator(const std::string &bin, const std::string &name) {
+		const std::string installed = bin + "/" + name + EXE_SUFFIX;
+		if (file_exists(installed))
+			return installed;
+		const std::string built = bin + "/../" + name + "/" + name + EXE_SUFFIX;
+		if (file_exists(built))
+			return built;
+		return std::string();
+	}
+
+	// The value after "key": in a report, NaN if there is none
+	double json_number(const std::string &json, const char *key, size_t start = 0) {
+		const std::string quoted = std::string("\"") + key + "\":";
+		const size_t at = json.find(quoted, start);
+		if (at == std::string::npos)
+			return strtod("nan", nullptr);
+		const char *value = json.c_str() + at + quoted.size();
+		char *end = nullptr;
+		const double d = strtod(value, &end);
+		return end != value ? d : strtod("nan", nullptr);
+	}
+
+	bool run_command(const std::string &command, const std::string &log) {
+		std::string line = command + " >> \"" + log + "\" 2>&1";
+#if defined(_WIN32)
+		line = "\"" + line + "\""; // cmd strips the outer quotes
+#endif
+		return system(line.c_str()) == 0;
+	}
+
+	// Runs one integrator and returns its report
+	bool run_integrator(const std::string &exe, const std::string &args, const std::string &output, Run &out_run) {
+		const std::string json = output + ".run.json";
+		const std::string image = output + ".png";
+		remove(json.c_str());
+		const std::string command = "\"" + exe + "\" " + args + " -output \"" + image + "\" -json \"" + json + "\"";
+		if (!run_command(command, output + ".log") || !read_file(json, out_run.report)) {
+			printf("Failed: %s (see %s.log)\n", command.c_str(), output.c_str());
+			return false;
+		}
+		while (!out_run.report.empty() && (out_run.report.back() == '\n' || out_run.report.back() == '\r'))
+			out_run.report.pop_back();
+		remove(json.c_str());
+		return true;
+	}
+
+	void print_run(const Run &run) {
+		const double rmse = json_number(run.report, "rmse");
+		printf("%-40s %9.2f %9.2f %9.3f %9.3f", run.name.c_str(),
+			json_number(run.report, "mrays_per_second"), json_number(run.report, "msamples_per_second"),
+			json_number(run.report, "build_seconds"), json_number(run.report, "trace_seconds"));
+		if (rmse == rmse)
+			printf(" %10.6f\n", rmse);
+		else
+			printf(" %10s\n", "-");
+	}
+
+	void write_runs(FILE *f, const char *key, const std::vector<Run> &runs) {
+		fprintf(f, "\t\"%s\": [", key);
+		for (size_t i = 0; i < runs.size(); i++) {
+			// Indent the report one level so it nests
+			std::string report;
+			for (char c : runs[i].report) {
+				report += c;
+				if (c == '\n')
+					report += "\t\t\t";
+			}
+			fprintf(f, "%s\n\t\t{\n\t\t\t\"name\": \"%s\",\n\t\t\t\"report\": %s\n\t\t}", i ? "," : "", runs[i].name.c_str(), report.c_str());
+		}
+		fprintf(f, "\n\t]");
+	}
+
+	// Returns the number of runs that got slower than tolerance percent
+	uint32_t compare_with_baseline(const std::string &baseline, const std::vector<Run> &runs, double tolerance) {
+		uint32_t num_regressions = 0;
+		printf("\n%-40s %9s %9s %8s\n", "compared with baseline", "before", "after", "change");
+		for (const Run &run : runs) {
+			const size_t at = baseline.find("\"name\": \"" + run.name + "\"");
+			if (at == std::string::npos)
+				continue;
+			const double before = json_number(baseline, "mrays_per_second", at);
+			const double after = json_number(run.report, "mrays_per_second");
+			const double change = 100.0 * (after - before) / before;
+			const bool regression = change < -tolerance;
+			printf("%-40s %9.2f %9.2f %+7.1f%%%s\n", run.name.c_str(), before, after, change, regression ? "  SLOWER" : "");
+			if (regression)
+				num_regressions++;
+		}
+		return num_regressions;
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string bin = directory_of(argv[0]);
+	const char *output = "bench.json";
+	const char *references = nullptr;
+	const char *baseline = nullptr;
+	bool make_references = false;
+	bool quick = false;
+	uint32_t reference_spp = 1024;
+	double tolerance = 5.0;
+
+	std::vector<BenchScene> scenes;
+	scenes.push_back(BenchScene{"builtin", ""});
+	scenes.push_back(BenchScene{"pillars", "-pillars 40"}); // Mostly instances
+
+	for (int i = 1; i<argc; ++i) {
+		     if (strcmp(argv[i], "-bin")==0 && i+1<argc) { bin = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-output")==0 && i+1<argc) { output = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-references")==0 && i+1<argc) { references = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-make_references")==0) { make_references = true; }
+		else if (strcmp(argv[i], "-reference_spp")==0 && i+1<argc) { reference_spp = std::max(atoi(argv[i+1]), 1); i++; }
+		else if (strcmp(argv[i], "-baseline")==0 && i+1<argc) { baseline = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-tolerance")==0 && i+1<argc) { tolerance = atof(argv[i+1]); i++; }
+		else if (strcmp(argv[i], "-quick")==0) { quick = true; }
+		else if (strcmp(argv[i], "-scene")==0 && i+1<argc) {
+			// Named after the file without directory and extension
+			std::string name = argv[i+1];
+			name = name.substr(name.find_last_of("/\\") == std::string::npos ? 0 : name.find_last_of("/\\") + 1);
+			name = name.substr(0, name.find('.'));
+			scenes.push_back(BenchScene{name, std::string("-scene \"") + argv[i+1] + "\""});
+			i++;
+		}
+		else {
+			printf("Invalid command line option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+	if (make_references && !references) {
+		printf("-make_references needs -references\n");
+		return 1;
+	}
+
+	std::vector<std::string> integrators, integrator_paths;
+	for (uint32_t n = 1;; n++) {
+		const std::string name = "post" + std::to_string(n);
+		const std::string path = find_integrator(bin, name);
+		if (path.empty())
+			break;
+		integrators.push_back(name);
+		integrator_paths.push_back(path);
+	}
+	if (integrators.empty()) {
+		printf("No integrators (post1, post2, ...) found in '%s', see -bin\n", bin.c_str());
+		return 1;
+	}
+
+	std::vector<Resolution> resolutions;
+	resolutions.push_back(Resolution{160, 128});
+	if (!quick)
+		resolutions.push_back(Resolution{320, 240});
+
+	const uint32_t hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	remove((std::string(output) + ".log").c_str());
+
+	auto reference_path = [&](const BenchScene &scene, const Resolution &resolution) {
+		return std::string(references) + "/" + scene.name + "_" + std::to_string(resolution.width) + "x" + std::to_string(resolution.height) + ".pfm";
+	};
+
+	if (make_references) {
+		// The last integrator is the one we trust the most
+		for (const BenchScene &scene : scenes) {
+			for (const Resolution &resolution : resolutions) {
+				const std::string path = reference_path(scene, resolution);
+				printf("Rendering reference '%s' with %s at %d spp\n", path.c_str(), integrators.back().c_str(), reference_spp);
+				const std::string command = "\"" + integrator_paths.back() + "\" " + scene.args + " -width " + std::to_string(resolution.width) + " -height " + std::to_string(resolution.height) +
+					" -samples " + std::to_string(reference_spp) + " -seed " + std::to_string(SEED + 1) + " -output \"" + path + "\"";
+				if (!run_command(command, std::string(output) + ".log")) {
+					printf("Failed: %s\n", command.c_str());
+					return 1;
+				}
+			}
+		}
+	}
+
+	printf("%-40s %9s %9s %9s %9s %10s\n", "", "Mrays/s", "Msmp/s", "build s", "trace s", "rmse");
+
+	std::vector<Run> runs;
+	for (const BenchScene &scene : scenes) {
+		for (const Resolution &resolution : resolutions) {
+			std::string args = scene.args + " -width " + std::to_string(resolution.width) + " -height " + std::to_string(resolution.height) +
+				" -samples " + std::to_string(SPP) + " -seed " + std::to_string(SEED) + " -threads " + std::to_string(hardware_threads);
+			if (references && file_exists(reference_path(scene, resolution)))
+				args += " -reference \"" + reference_path(scene, resolution) + "\"";
+			for (size_t i = 0; i < integrators.size(); i++) {
+				Run run;
+				run.name = integrators[i] + "/" + scene.name + "/" + std::to_string(resolution.width) + "x" + std::to_string(resolution.height) + "/t" + std::to_string(hardware_threads);
+				if (!run_integrator(integrator_paths[i], args, output, run))
+					return 1;
+				print_run(run);
+				runs.push_back(run);
+			}
+		}
+	}
+
+	// 1, 2, 4... threads and all of them
+	std::vector<Run> scaling;
+	const Resolution &scaling_resolution = resolutions.back();
+	for (uint32_t threads = 1;; threads = std::min(threads * 2, hardware_threads)) {
+		Run run;
+		run.name = integrators.back() + "/builtin/" + std::to_string(scaling_resolution.width) + "x" + std::to_string(scaling_resolution.height) + "/scaling/t" + std::to_string(threads);
+		const std::string args = "-width " + std::to_string(scaling_resolution.width) + " -height " + std::to_string(scaling_resolution.height) +
+			" -samples " + std::to_string(SPP) + " -seed " + std::to_string(SEED) + " -threads " + std::to_string(threads);
+		if (!run_integrator(integrator_paths.back(), args, output, run))
+			return 1;
+		print_run(run);
+		scaling.push_back(run);
+		if (threads == hardware_threads)
+			break;
+	}
+	remove((std::string(output) + ".png").c_str());
+
+	FILE *f = fopen(output, "w");
+	if (!f) {
+		printf("Could not write '%s'\n", output);
+		return 1;
+	}
+	fprintf(f, "{\n\t\"version\": 1,\n\t\"hardware_threads\": %u,\n", hardware_threads);
+	write_runs(f, "runs", runs);
+	fprintf(f, ",\n");
+	write_runs(f, "thread_scaling", scaling);
+	fprintf(f, "\n}\n");
+	fclose(f);
+	printf("Wrote '%s'\n", output);
+
+	if (baseline) {
+		std::string text;
+		if (!read_file(baseline, text)) {
+			printf("Could not read baseline '%s'\n", baseline);
+			return 1;
+		}
+		std::vector<Run> all = runs;
+		all.insert(all.end(), scaling.begin(), scaling.end());
+		const uint32_t num_regressions = compare_with_baseline(text, all, tolerance);
+		if (num_regressions != 0) {
+			printf("%d runs are more than %.1f%% slower than the baseline\n", num_regressions, tolerance);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include "framebuffer.h"
+#include "checkpoint.h"
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+/*
+	Merges the checkpoints written by the shards of a render (-shard i/N -checkpoint file) into the final image.
+	Pixels hold sums, so adding them up weights each shard by the number of samples it has for the pixel. The shards
+	can be rendered anywhere, this only needs the files.
+
+	Usage: pathtracer_merge [-output image.png] [-threads N] shard0 shard1 ...
+*/
+
+namespace {
+	// Everything but the shard index must match
+	bool same_render(const CheckpointDescription &a, const CheckpointDescription &b) {
+		CheckpointDescription c = b;
+		c.shard_index = a.shard_index;
+		return memcmp(&a, &c, sizeof(CheckpointDescription)) == 0;
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *output = "image.png";
+	uint32_t num_threads = std::thread::hardware_concurrency();
+	std::vector<const char*> inputs;
+	for (int i = 1; i<argc; ++i) {
+		     if (strcmp(argv[i], "-output")==0 && i+1<argc) { output = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-threads")==0 && i+1<argc) { num_threads = std::max((uint32_t)atoi(argv[i+1]), 1u); i++; }
+		else if (argv[i][0] == '-') {
+			printf("Invalid command line option '%s'\n", argv[i]);
+			return 1;
+		}
+		else inputs.push_back(argv[i]);
+	}
+	if (inputs.empty()) {
+		printf("Usage: pathtracer_merge [-output image.png] [-threads N] shard0 shard1 ...\n");
+		return 1;
+	}
+
+	CheckpointDescription description;
+	std::vector<Pixel> framebuffer;
+	std::vector<bool> have_shard;
+	for (const char *input : inputs) {
+		Checkpoint checkpoint;
+		if (!checkpoint.open_existing(input)) {
+			printf("Could not read '%s'\n", input);
+			return 1;
+		}
+		const CheckpointDescription &d = checkpoint.description();
+		if (framebuffer.empty()) {
+			if (d.tile_size == 0 || d.tile_size > MAX_TILE_SIZE) {
+				printf("'%s' has %dx%d tiles, which is not supported\n", input, d.tile_size, d.tile_size);
+				return 1;
+			}
+			description = d;
+			framebuffer.assign(d.width * d.height, Pixel());
+			have_shard.assign(d.num_shards, false);
+		} else if (!same_render(description, d)) {
+			printf("'%s' is not a shard of the same render as '%s'\n", input, inputs[0]);
+			return 1;
+		}
+		if (d.shard_index >= d.num_shards || have_shard[d.shard_index]) {
+			printf("'%s' has shard %d/%d, which is invalid or already merged\n", input, d.shard_index, d.num_shards);
+			return 1;
+		}
+		if (!checkpoint.has_pixels()) {
+			printf("'%s' has no complete checkpoint\n", input);
+			return 1;
+		}
+		have_shard[d.shard_index] = true;
+
+		const Pixel *pixels = checkpoint.pixels();
+		for (uint32_t i = 0; i < (uint32_t)framebuffer.size(); i++)
+			add_pixel(framebuffer[i], pixels[i]);
+	}
+
+	uint32_t num_merged = 0;
+	for (bool b : have_shard)
+		num_merged += b ? 1 : 0;
+	if (num_merged != description.num_shards)
+		printf("Warning: only %d of %d shards, the image is incomplete\n", num_merged, description.num_shards);
+
+	double num_samples = 0.0;
+	for (const Pixel &pixel : framebuffer)
+		num_samples += pixel.N;
+	printf("Merged %d shards of image %d in %dx%d (%s, by %s): %.1f samples per pixel\n", num_merged, description.image_index, description.width, description.height,
+		sampler_name((SamplerType)description.sampler), description.shard_mode == SHARD_SAMPLES ? "samples" : "tiles", num_samples / framebuffer.size());
+
+	if (!write_image(output, framebuffer, tile_layout(description.width, description.height, description.tile_size), description.seed, num_threads)) {
+		printf("Failed to write '%s'\n", output);
+		return 1;
+	}
+	printf("Wrote '%s'\n", output);
+	return 0;
+}
@@ -6,12 +6,9 @@ Float3 pathtrace_sample(ThreadContext &thread_context, const Scene &scene, const
 {
 	const uint32_t image_index = thread_context.image_index;
 
-	const float camera_x = (x + uniform(thread_context)) * one_over_width;
-	const float camera_y = (y + uniform(thread_context)) * one_over_height;
-	const Float3 camera_direction = generate_camera_direction(camera, camera_x, camera_y);
-
+	Float3 camera_direction;
 	IntersectResult intersect;
-	if (!intersect_closest(scene, camera.position, camera_direction, intersect)) {
+	if (!trace_camera_ray(thread_context, scene, camera, x, y, sample_index, one_over_width, one_over_height, camera_direction, intersect)) {
 		if (image_index == 1)	return sky_color_in_direction(scene, camera_direction);
 		return float3(0,0,0);
 	}
@@ -4,24 +4,19 @@ Float3 pathtrace_sample(ThreadContext &thread_context, const Scene &scene, const
 	uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t sample_index,
 	float one_over_width, float one_over_height)
 {
-	const float camera_x = (x + uniform(thread_context)) * one_over_width;
-	const float camera_y = (y + uniform(thread_context)) * one_over_height;
-	const Float3 camera_direction = generate_camera_direction(camera, camera_x, camera_y);
-
-	Float3 pos = camera.position;
-	Float3 dir = camera_direction;
-
 	// Shoot camera ray
+	Float3 dir;
 	IntersectResult intersect;
-	if (!intersect_closest(scene, pos, dir, intersect)) {
+	if (!trace_camera_ray(thread_context, scene, camera, x, y, sample_index, one_over_width, one_over_height, dir, intersect)) {
 		return sky_color_in_direction(scene, dir);
 	}
 
 	Float3 accumulated_color = float3(0,0,0);
 	accumulated_color += intersect.emissive;
 
-	pos = intersect.pos + intersect.face_normal * 1E-6f; // Bias outward to avoid self-intersection
-	dir = random_hemisphere(intersect.face_normal, uniform(thread_context), uniform(thread_context));
+	const Float3 pos = bounce_origin(camera.position, intersect); // Moved off the surface to avoid hitting it again
+	const Float2 u = sample2d(thread_context);
+	dir = random_hemisphere(intersect.face_normal, u.x, u.y);
 
 	float area_hemisphere = float(2.0*M_PI);
 	float probability_choosing_dir = 1.0f/area_hemisphere;
@@ -4,34 +4,42 @@ Float3 pathtrace_sample(ThreadContext &thread_context, const Scene &scene, const
 	uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t sample_index,
 	float one_over_width, float one_over_height)
 {
-	const float camera_x = (x + uniform(thread_context)) * one_over_width;
-	const float camera_y = (y + uniform(thread_context)) * one_over_height;
-	const Float3 camera_direction = generate_camera_direction(camera, camera_x, camera_y);
+	const MaterialTable &materials = scene_materials(scene);
 
 	Float3 pos = camera.position;
-	Float3 dir = camera_direction;
+	Float3 dir;
+	Hit intersect;
+	bool hit = trace_camera_ray(thread_context, scene, camera, x, y, sample_index, one_over_width, one_over_height, dir, intersect);
 
 	Float3 accumulated_color = float3(0,0,0);
 	Float3 accumulated_importance = float3(1,1,1);
 
-	for (uint32_t bounces = 0; bounces<100; bounces++) {
-		IntersectResult intersect;
-		if (!intersect_closest(scene, pos, dir, intersect)) {
+	uint32_t bounces = 0;
+	for (; bounces<100; bounces++) {
+		if (!hit) {
 			accumulated_color += accumulated_importance * sky_color_in_direction(scene, dir);
 			break;
 		}
 
-		accumulated_color += intersect.emissive * accumulated_importance;
-		dir = random_hemisphere(intersect.face_normal, uniform(thread_context), uniform(thread_context));
+		accumulated_color += materials.emissive(intersect.material) * accumulated_importance;
+		const Float3 normal = hit_normal(intersect);
+		pos = bounce_origin(pos, dir, intersect, normal); // Moved off the surface to avoid hitting it again
+		const Float2 u = sample2d(thread_context);
+		dir = random_hemisphere(normal, u.x, u.y);
 		
 		float area_hemisphere = float(2.0*M_PI);
 		float probability_choosing_dir = 1.0f/area_hemisphere;
-		float brdf_without_color = dot(dir, intersect.face_normal) * float(1.0/M_PI);
+		float brdf_without_color = dot(dir, normal) * float(1.0/M_PI);
 
-		accumulated_importance *= intersect.diffuse * (brdf_without_color / probability_choosing_dir);
+		accumulated_importance *= materials.diffuse(intersect.material) * (brdf_without_color / probability_choosing_dir);
 
-		pos = intersect.pos + intersect.face_normal * 1E-6f; // Bias outward to avoid self-intersection
+#if PATHTRACER_STATS
+		const Hit from = intersect;
+#endif
+		hit = intersect_closest(scene, pos, dir, intersect);
+		STAT_ADD(STAT_SELF_HITS, hit && is_self_hit(pos, from, intersect));
 	}
+	STAT_PATH_LENGTH(bounces); // Paths that reach the bounce limit as well
 
 	return accumulated_color;
 }
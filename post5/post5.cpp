@@ -6,34 +6,168 @@ Float3 pathtrace_sample(ThreadContext &thread_context, const Scene &scene, const
 {
 	const uint32_t image_index = thread_context.image_index;
 
-	const float camera_x = (x + uniform(thread_context)) * one_over_width;
-	const float camera_y = (y + uniform(thread_context)) * one_over_height;
-	const Float3 camera_direction = generate_camera_direction(camera, camera_x, camera_y);
+	const MaterialTable &materials = scene_materials(scene);
 
 	Float3 pos = camera.position;
-	Float3 dir = camera_direction;
+	Float3 dir;
+	Hit intersect;
+	bool hit = trace_camera_ray(thread_context, scene, camera, x, y, sample_index, one_over_width, one_over_height, dir, intersect);
 
 	Float3 accumulated_color = float3(0,0,0);
 	Float3 accumulated_importance = float3(1,1,1);
 
 	for (uint32_t bounces = 0;; bounces++) {
-		IntersectResult intersect;
-		if (!intersect_closest(scene, pos, dir, intersect)) {
+		if (!hit) {
 			accumulated_color += accumulated_importance * sky_color_in_direction(scene, dir);
+			STAT_PATH_LENGTH(bounces);
 			break;
 		}
 
-		accumulated_color += intersect.emissive * accumulated_importance;
-		accumulated_importance *= intersect.diffuse;
+		accumulated_color += materials.emissive(intersect.material) * accumulated_importance;
+		accumulated_importance *= materials.diffuse(intersect.material);
 
 		float probability_continue = clamp(mean(accumulated_importance), 0.05f, 0.98f);
-		if (probability_continue < uniform(thread_context))
+		if (probability_continue < sample1d(thread_context)) {
+			STAT_INC(STAT_RUSSIAN_ROULETTE_TERMINATIONS);
+			STAT_PATH_LENGTH(bounces);
 			break;
+		}
 		accumulated_importance /= probability_continue;
 
-		pos = intersect.pos + intersect.face_normal * 1E-6f;
-		dir = random_cosine_hemisphere(intersect.face_normal, uniform(thread_context), uniform(thread_context));
+		const Float3 normal = hit_normal(intersect); // Not needed by paths that end here
+		pos = bounce_origin(pos, dir, intersect, normal);
+		const Float2 u = sample2d(thread_context);
+		dir = random_cosine_hemisphere(normal, u.x, u.y);
+#if PATHTRACER_STATS
+		const Hit from = intersect;
+#endif
+		hit = intersect_closest(scene, pos, dir, intersect);
+		STAT_ADD(STAT_SELF_HITS, hit && is_self_hit(pos, from, intersect));
 	}
 
 	return accumulated_color;
 }
+
+namespace {
+	// Wavefront version of the loop above. All paths of a tile are advanced one bounce at a time.
+
+	const uint32_t MAX_PATHS_PER_WAVE = 4096;
+
+	// Kept per thread so we don't allocate for every tile
+	struct Wavefront {
+		Array<Float3> accumulated_color, accumulated_importance; // Per path
+		Array<RandomContext> random; // Per path, so we get the same random numbers as when tracing one path at a time
+		Array<uint32_t> live_paths; // Path index for each ray in the stream. Compacted as paths terminate.
+		RayStream rays;
+		Array<bool> hit;
+		Array<Hit> intersect;
+#if PATHTRACER_STATS
+		Array<Hit> from; // The hit each ray in the stream left from, for STAT_SELF_HITS
+#endif
+
+		void resize(uint32_t n) {
+			if (accumulated_color.size() >= n)
+				return;
+			accumulated_color.resize(n);
+			accumulated_importance.resize(n);
+			random.resize(n);
+			live_paths.resize(n);
+			rays.resize(n);
+			hit.resize(n);
+			intersect.resize(n);
+#if PATHTRACER_STATS
+			from.resize(n);
+#endif
+		}
+	};
+	thread_local Wavefront wavefront;
+
+	void pathtrace_tile_wavefront(ThreadContext &thread_context, const Scene &scene, const Camera &camera,
+		uint32_t tile_start_x, uint32_t tile_start_y, uint32_t tile_width, uint32_t tile_height, uint32_t width, uint32_t height, uint32_t sample_start, uint32_t num_samples,
+		Pixel *tile_pixels)
+	{
+		const float one_over_width = 1.0f/width;
+		const float one_over_height = 1.0f/height;
+		const MaterialTable &materials = scene_materials(scene);
+
+		const uint32_t num_pixels = tile_width * tile_height;
+		const uint32_t samples_per_wave = std::max(MAX_PATHS_PER_WAVE / num_pixels, 1u);
+		Wavefront &w = wavefront;
+		w.resize(num_pixels * samples_per_wave);
+
+		for (uint32_t wave_start = 0; wave_start < num_samples; wave_start += samples_per_wave) {
+			const uint32_t wave_samples = std::min(samples_per_wave, num_samples - wave_start);
+			const uint32_t num_paths = num_pixels * wave_samples;
+
+			// Path p is sample p/num_pixels of pixel p%num_pixels
+			for (uint32_t p = 0; p < num_paths; p++) {
+				const uint32_t pixel = p % num_pixels;
+				const uint32_t x = tile_start_x + pixel % tile_width;
+				const uint32_t y = tile_start_y + pixel / tile_width;
+				RandomContext &random = w.random[p];
+				random.seed = thread_context.seed;
+				random.sampler = thread_context.sampler;
+				start_sample(random, x, y, sample_start + wave_start + p / num_pixels);
+				const Float2 jitter = sample2d(random);
+				w.rays.set(p, camera.position, generate_camera_direction(camera, (x + jitter.x) * one_over_width, (y + jitter.y) * one_over_height));
+				w.accumulated_color[p] = float3(0,0,0);
+				w.accumulated_importance[p] = float3(1,1,1);
+				w.live_paths[p] = p;
+			}
+
+			uint32_t num_live = num_paths;
+			for (uint32_t bounces = 0; num_live != 0; bounces++) {
+				intersect_closest_stream(scene, w.rays, num_live, &w.hit[0], &w.intersect[0]);
+#if PATHTRACER_STATS
+				for (uint32_t i = 0; i < num_live && bounces != 0; i++)
+					STAT_ADD(STAT_SELF_HITS, w.hit[i] && is_self_hit(w.rays.org(i), w.from[i], w.intersect[i]));
+#endif
+
+				// Rays of paths that continue are compacted to the front of the stream
+				uint32_t num_continued = 0;
+				for (uint32_t i = 0; i < num_live; i++) {
+					const uint32_t p = w.live_paths[i];
+					Float3 &accumulated_color = w.accumulated_color[p];
+					Float3 &accumulated_importance = w.accumulated_importance[p];
+					RandomContext &random = w.random[p];
+
+					if (!w.hit[i]) {
+						accumulated_color += accumulated_importance * sky_color_in_direction(scene, w.rays.dir(i));
+						STAT_PATH_LENGTH(bounces);
+						continue;
+					}
+
+					const Hit &intersect = w.intersect[i];
+					accumulated_color += materials.emissive(intersect.material) * accumulated_importance;
+					accumulated_importance *= materials.diffuse(intersect.material);
+
+					float probability_continue = clamp(mean(accumulated_importance), 0.05f, 0.98f);
+					if (probability_continue < sample1d(random)) {
+						STAT_INC(STAT_RUSSIAN_ROULETTE_TERMINATIONS);
+						STAT_PATH_LENGTH(bounces);
+						continue;
+					}
+					accumulated_importance /= probability_continue;
+
+					const Float3 normal = hit_normal(intersect);
+					const Float3 pos = bounce_origin(w.rays.org(i), w.rays.dir(i), intersect, normal);
+					const Float2 u = sample2d(random);
+					const Float3 dir = random_cosine_hemisphere(normal, u.x, u.y);
+					w.live_paths[num_continued] = p;
+#if PATHTRACER_STATS
+					w.from[num_continued] = intersect;
+#endif
+					w.rays.set(num_continued, pos, dir);
+					num_continued++;
+				}
+				num_live = num_continued;
+			}
+
+			for (uint32_t p = 0; p < num_paths; p++) {
+				add_sample(tile_pixels[p % num_pixels], w.accumulated_color[p]);
+			}
+		}
+	}
+
+	const bool wavefront_registered = register_wavefront(pathtrace_tile_wavefront);
+}
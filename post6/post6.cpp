@@ -0,0 +1,80 @@
+#include "shared.h"
+
+namespace {
+	// Veach's power heuristic (beta=2) for two sampling techniques
+	inline float power_heuristic(float pdf, float other_pdf) {
+		return (pdf*pdf) / (pdf*pdf + other_pdf*other_pdf);
+	}
+}
+
+Float3 pathtrace_sample(ThreadContext &thread_context, const Scene &scene, const Camera &camera,
+	uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t sample_index,
+	float one_over_width, float one_over_height)
+{
+	Float3 dir;
+	IntersectResult intersect;
+	bool hit = trace_camera_ray(thread_context, scene, camera, x, y, sample_index, one_over_width, one_over_height, dir, intersect);
+
+	Float3 accumulated_color = float3(0,0,0);
+	Float3 accumulated_importance = float3(1,1,1);
+
+	// Solid angle density of the direction we came from. Zero for the camera ray since it can't be found by light sampling.
+	float bsdf_pdf = 0.0f;
+	Float3 previous_pos = camera.position;
+
+	for (uint32_t bounces = 0;; bounces++) {
+		if (!hit) {
+			// The sky is not sampled as a light so it only gets here
+			accumulated_color += accumulated_importance * sky_color_in_direction(scene, dir);
+			break;
+		}
+
+		if (max(intersect.emissive) > 0.0f) {
+			// We might have sampled this point with the light sampling at the previous bounce as well
+			float weight = 1.0f;
+			if (bsdf_pdf > 0.0f) {
+				const Float3 to_light = intersect.pos - previous_pos;
+				const float cos_light = fabsf(dot(intersect.face_normal, dir));
+				const float light_pdf = light_pdf_area(scene, intersect.emissive) * dot(to_light, to_light) / cos_light;
+				weight = power_heuristic(bsdf_pdf, light_pdf);
+			}
+			accumulated_color += intersect.emissive * accumulated_importance * weight;
+		}
+
+		const Float3 pos = bounce_origin(previous_pos, intersect);
+
+		// Next event estimation. Emitters are two sided, just like when we hit them.
+		const float u_light = sample1d(thread_context);
+		const Float2 u_light_pos = sample2d(thread_context);
+		LightSample light;
+		if (max(intersect.diffuse) > 0.0f && sample_light(scene, u_light, u_light_pos, light)) {
+			const Float3 to_light = light.pos - pos;
+			const float distance_squared = dot(to_light, to_light);
+			const float distance = sqrtf(distance_squared);
+			const Float3 light_dir = to_light / distance;
+			const float cos_surface = dot(intersect.face_normal, light_dir);
+			const float cos_light = fabsf(dot(light.normal, light_dir));
+			if (cos_surface > 0.0f && cos_light > 0.0f && !occluded(scene, pos, light_dir, distance * (1.0f - 1E-4f))) {
+				const float light_pdf = light.pdf_area * distance_squared / cos_light;
+				const float weight = power_heuristic(light_pdf, cos_surface * float(M_1_PI));
+				const Float3 brdf = intersect.diffuse * float(M_1_PI);
+				accumulated_color += accumulated_importance * brdf * light.emissive * (cos_surface * weight / light_pdf);
+			}
+		}
+
+		accumulated_importance *= intersect.diffuse;
+
+		float probability_continue = clamp(mean(accumulated_importance), 0.05f, 0.98f);
+		if (probability_continue < sample1d(thread_context))
+			break;
+		accumulated_importance /= probability_continue;
+
+		const Float2 u = sample2d(thread_context);
+		dir = random_cosine_hemisphere(intersect.face_normal, u.x, u.y);
+		bsdf_pdf = std::max(dot(intersect.face_normal, dir), 0.0f) * float(M_1_PI);
+		previous_pos = pos;
+		hit = intersect_closest(scene, pos, dir, intersect);
+	}
+
+	return accumulated_color;
+}
@@ -0,0 +1,739 @@
+#include "bvh.h"
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+/*
+	TODO:
+	* Spatial splits
+	* Wider nodes (4 or 8 children) to make better use of SIMD
+*/
+
+namespace {
+	const uint32_t NUM_BINS = 16;
+	const uint32_t MAX_LEAF_SIZE = 4;
+	const uint32_t MAX_STACK_SIZE = 64;
+	const float TRAVERSAL_COST = 1.0f; // Relative to the cost of intersecting one quad
+
+	// Bump the version when the builder or the node layout changes, so old cache files are rebuilt
+	struct BvhCacheHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t input_hash;
+		uint32_t num_nodes, num_quads;
+		uint64_t nodes_offset, quads_offset, file_size;
+	};
+	const uint32_t BVH_CACHE_MAGIC = 0x56425450; // PTBV
+	const uint32_t BVH_CACHE_VERSION = 1;
+	const uint64_t BVH_CACHE_ALIGNMENT = 64;
+
+	BvhCacheHeader cache_layout(uint64_t input_hash, uint32_t num_nodes, uint32_t num_quads) {
+		auto align = [](uint64_t v) { return (v + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT; };
+		BvhCacheHeader h;
+		memset(&h, 0, sizeof(h));
+		h.magic = BVH_CACHE_MAGIC;
+		h.version = BVH_CACHE_VERSION;
+		h.input_hash = input_hash;
+		h.num_nodes = num_nodes;
+		h.num_quads = num_quads;
+		h.nodes_offset = align(sizeof(BvhCacheHeader));
+		h.quads_offset = align(h.nodes_offset + sizeof(BvhNode) * (uint64_t)num_nodes);
+		h.file_size = h.quads_offset + sizeof(BvhQuad) * (uint64_t)num_quads;
+		return h;
+	}
+
+	struct Aabb {
+		Float3 mn, mx;
+	};
+
+	inline Aabb empty_aabb() {
+		const float m = std::numeric_limits<float>::max();
+		Aabb r;
+		r.mn = float3( m, m, m);
+		r.mx = float3(-m,-m,-m);
+		return r;
+	}
+
+	inline void grow(Aabb &a, const Float3 p) {
+		a.mn = float3(std::min(a.mn.x, p.x), std::min(a.mn.y, p.y), std::min(a.mn.z, p.z));
+		a.mx = float3(std::max(a.mx.x, p.x), std::max(a.mx.y, p.y), std::max(a.mx.z, p.z));
+	}
+
+	inline void grow(Aabb &a, const Aabb &b) {
+		grow(a, b.mn);
+		grow(a, b.mx);
+	}
+
+	// The root of a BVH without primitives. An inverted box like empty_aabb() would make a slab test pass for every
+	// ray, one at infinity is missed by all of them.
+	inline void set_empty(BvhNode &root) {
+		const float inf = std::numeric_limits<float>::infinity();
+		root.bounds_min = float3(inf, inf, inf);
+		root.bounds_max = float3(inf, inf, inf);
+		root.first = root.count = 0;
+	}
+
+	inline bool is_empty(const BvhNode &root) {
+		return root.bounds_min.x == std::numeric_limits<float>::infinity();
+	}
+
+	inline float half_area(const Aabb &a) {
+		const Float3 d = a.mx - a.mn;
+		if (d.x < 0.0f) return 0.0f; // Empty
+		return d.x*d.y + d.y*d.z + d.z*d.x;
+	}
+
+	inline float component(const Float3 v, uint32_t axis) {
+		return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+	}
+
+	struct BuildPrim {
+		Aabb bounds;
+		Float3 centroid;
+	};
+
+	struct Builder {
+		Array<BvhNode> &nodes;
+		std::vector<BuildPrim> prims;
+		std::vector<uint32_t> order; // Indices into prims, partitioned in place during the build
+
+		Builder(Array<BvhNode> &nodes) : nodes(nodes) {}
+
+		void set_node(uint32_t node_index, uint32_t begin, uint32_t end) {
+			Aabb bounds = empty_aabb();
+			for (uint32_t i = begin; i < end; i++)
+				grow(bounds, prims[order[i]].bounds);
+			BvhNode &node = nodes[node_index];
+			node.bounds_min = bounds.mn;
+			node.bounds_max = bounds.mx;
+			node.first = begin;
+			node.count = end - begin;
+		}
+
+		// Binned SAH. Returns false if the centroids could not be separated.
+		bool find_split(uint32_t begin, uint32_t end, float node_half_area, uint32_t &out_axis, float &out_position, float &out_cost) {
+			Aabb centroid_bounds = empty_aabb();
+			for (uint32_t i = begin; i < end; i++)
+				grow(centroid_bounds, prims[order[i]].centroid);
+
+			const uint32_t count = end - begin;
+			float best_cost = std::numeric_limits<float>::max();
+			bool found = false;
+
+			for (uint32_t axis = 0; axis < 3; axis++) {
+				const float cmin = component(centroid_bounds.mn, axis);
+				const float cmax = component(centroid_bounds.mx, axis);
+				if (cmax <= cmin)
+					continue;
+
+				Aabb bin_bounds[NUM_BINS];
+				uint32_t bin_count[NUM_BINS];
+				for (uint32_t b = 0; b < NUM_BINS; b++) {
+					bin_bounds[b] = empty_aabb();
+					bin_count[b] = 0;
+				}
+
+				const float scale = NUM_BINS / (cmax - cmin);
+				for (uint32_t i = begin; i < end; i++) {
+					const BuildPrim &p = prims[order[i]];
+					uint32_t b = std::min((uint32_t)((component(p.centroid, axis) - cmin) * scale), NUM_BINS-1);
+					bin_count[b]++;
+					grow(bin_bounds[b], p.bounds);
+				}
+
+				// Sweep from the right to get the cost of everything to the right of each plane
+				float right_cost[NUM_BINS];
+				Aabb right_bounds = empty_aabb();
+				uint32_t right_count = 0;
+				for (uint32_t b = NUM_BINS-1; b > 0; b--) {
+					grow(right_bounds, bin_bounds[b]);
+					right_count += bin_count[b];
+					right_cost[b] = half_area(right_bounds) * right_count;
+				}
+
+				Aabb left_bounds = empty_aabb();
+				uint32_t left_count = 0;
+				for (uint32_t b = 1; b < NUM_BINS; b++) {
+					grow(left_bounds, bin_bounds[b-1]);
+					left_count += bin_count[b-1];
+					if (left_count == 0 || left_count == count)
+						continue;
+					const float cost = TRAVERSAL_COST + (half_area(left_bounds) * left_count + right_cost[b]) / node_half_area;
+					if (cost < best_cost) {
+						best_cost = cost;
+						out_axis = axis;
+						out_position = cmin + b / scale;
+						found = true;
+					}
+				}
+			}
+			out_cost = best_cost;
+			return found;
+		}
+
+		void build(uint32_t node_index, uint32_t begin, uint32_t end, uint32_t depth) {
+			set_node(node_index, begin, end);
+			const uint32_t count = end - begin;
+			if (count <= 1 || depth == MAX_STACK_SIZE-1)
+				return;
+
+			Aabb bounds;
+			bounds.mn = nodes[node_index].bounds_min;
+			bounds.mx = nodes[node_index].bounds_max;
+
+			uint32_t axis = 0;
+			float position = 0.0f, cost = 0.0f;
+			const bool found = find_split(begin, end, half_area(bounds), axis, position, cost);
+			if (found && cost >= count && count <= MAX_LEAF_SIZE)
+				return; // Cheaper to make a leaf
+
+			uint32_t mid = begin;
+			if (found) {
+				const std::vector<BuildPrim> &p = prims;
+				mid = (uint32_t)(std::partition(order.begin() + begin, order.begin() + end, [&p, axis, position](uint32_t i) {
+					return component(p[i].centroid, axis) < position;
+				}) - order.begin());
+			}
+
+			if (mid == begin || mid == end) {
+				// Could not separate the centroids
+				if (count <= MAX_LEAF_SIZE)
+					return;
+				mid = begin + count/2;
+			}
+
+			// Children are allocated next to each other
+			const uint32_t left = nodes.size();
+			nodes.resize(left + 2);
+			nodes[node_index].first = left;
+			nodes[node_index].count = 0;
+
+			build(left,   begin, mid, depth+1);
+			build(left+1, mid,   end, depth+1);
+		}
+	};
+
+	inline bool intersect_aabb(const BvhNode &node, const Float3 org, const Float3 inv_dir, float tnear, float tfar, float &out_t) {
+		const float tx0 = (node.bounds_min.x - org.x) * inv_dir.x;
+		const float tx1 = (node.bounds_max.x - org.x) * inv_dir.x;
+		const float ty0 = (node.bounds_min.y - org.y) * inv_dir.y;
+		const float ty1 = (node.bounds_max.y - org.y) * inv_dir.y;
+		const float tz0 = (node.bounds_min.z - org.z) * inv_dir.z;
+		const float tz1 = (node.bounds_max.z - org.z) * inv_dir.z;
+
+		const float t_enter = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), tnear));
+		const float t_exit  = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tfar));
+		out_t = t_enter;
+		return t_enter <= t_exit;
+	}
+
+	// Möller-Trumbore. Updates t and Ng if we found a closer hit.
+	inline bool intersect_triangle(const Float3 org, const Float3 dir, const Float3 v0, const Float3 v1, const Float3 v2, float tnear, float &t, Float3 &Ng) {
+		const Float3 e1 = v1 - v0;
+		const Float3 e2 = v2 - v0;
+		const Float3 p = cross(dir, e2);
+		const float det = dot(e1, p);
+		if (det == 0.0f)
+			return false;
+		const float inv_det = 1.0f/det;
+
+		const Float3 s = org - v0;
+		const float u = dot(s, p) * inv_det;
+		if (u < 0.0f || u > 1.0f)
+			return false;
+
+		const Float3 q = cross(s, e1);
+		const float v = dot(dir, q) * inv_det;
+		if (v < 0.0f || u + v > 1.0f)
+			return false;
+
+		const float tt = dot(e2, q) * inv_det;
+		if (tt < tnear || tt >= t)
+			return false;
+
+		t = tt;
+		Ng = cross(e1, e2);
+		return true;
+	}
+
+	/*
+		The traversal loop of all the queries. intersect_box(node, out_t) tells if the ray (or packet) reaches the box
+		of a node and from which distance. The closest child is visited first. leaf(first, count) is called for the
+		leaves that are reached, can make the distances that intersect_box tests against smaller, and returns true to
+		stop.
+	*/
+	template<typename BOX, typename LEAF>
+	void traverse_nodes(const BvhNode *nodes, BOX intersect_box, LEAF leaf) {
+		float t_root;
+		if (!intersect_box(nodes[0], t_root))
+			return;
+
+		uint32_t stack[MAX_STACK_SIZE];
+		uint32_t stack_size = 0;
+		uint32_t node_index = 0;
+
+		while (true) {
+			const BvhNode &node = nodes[node_index];
+			if (node.count != 0) {
+				if (leaf(node.first, node.count))
+					return;
+			} else {
+				float t0, t1;
+				const bool hit0 = intersect_box(nodes[node.first],   t0);
+				const bool hit1 = intersect_box(nodes[node.first+1], t1);
+				if (hit0 && hit1) {
+					const uint32_t near_child = t0 <= t1 ? node.first : node.first+1;
+					assert(stack_size < MAX_STACK_SIZE);
+					stack[stack_size++] = near_child == node.first ? node.first+1 : node.first;
+					node_index = near_child;
+					continue;
+				} else if (hit0) {
+					node_index = node.first;
+					continue;
+				} else if (hit1) {
+					node_index = node.first+1;
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+				break;
+			node_index = stack[--stack_size];
+		}
+	}
+
+	// Visits the leaves that the ray passes through in [tnear, t]. leaf can make t smaller, see traverse_nodes.
+	template<typename LEAF>
+	void traverse(const BvhNode *nodes, const Float3 org, const Float3 dir, float tnear, const float &t, LEAF leaf) {
+		const Float3 inv_dir = float3(1.0f/dir.x, 1.0f/dir.y, 1.0f/dir.z);
+		traverse_nodes(nodes, [&](const BvhNode &node, float &out_t) {
+			return intersect_aabb(node, org, inv_dir, tnear, t, out_t);
+		}, leaf);
+	}
+}
+
+void bvh_build(Bvh &bvh) {
+	const uint32_t num_quads = bvh.quads.size();
+
+	bvh.nodes.clear();
+	bvh.nodes.resize(1);
+	if (num_quads == 0) {
+		set_empty(bvh.nodes[0]);
+		bvh.node_data = &bvh.nodes[0];
+		bvh.quad_data = nullptr;
+		return;
+	}
+	bvh.nodes.reserve(2*num_quads); // A binary tree with N leaves has 2N-1 nodes
+
+	Builder builder(bvh.nodes);
+	builder.prims.resize(num_quads);
+	builder.order.resize(num_quads);
+	for (uint32_t i = 0; i < num_quads; i++) {
+		const BvhQuad &q = bvh.quads[i];
+		BuildPrim &p = builder.prims[i];
+		p.bounds = empty_aabb();
+		grow(p.bounds, q.v0);
+		grow(p.bounds, q.v1);
+		grow(p.bounds, q.v2);
+		grow(p.bounds, q.v3);
+		p.centroid = (p.bounds.mn + p.bounds.mx) * 0.5f;
+		builder.order[i] = i;
+	}
+
+	builder.build(0, 0, num_quads, 0);
+
+	// Reorder quads so each leaf references a contiguous range
+	Array<BvhQuad> reordered(num_quads);
+	for (uint32_t i = 0; i < num_quads; i++)
+		reordered[i] = bvh.quads[builder.order[i]];
+	for (uint32_t i = 0; i < num_quads; i++)
+		bvh.quads[i] = reordered[i];
+
+	bvh.node_data = &bvh.nodes[0];
+	bvh.quad_data = &bvh.quads[0];
+}
+
+uint64_t bvh_input_hash(const Bvh &bvh) {
+	// Word at a time, a byte at a time is too slow for millions of quads
+	const uint32_t num_quads = bvh.quads.size();
+	const uint64_t num_words = sizeof(BvhQuad) * (uint64_t)num_quads / sizeof(uint64_t);
+	static_assert(sizeof(BvhQuad) % sizeof(uint64_t) == 0, "Hash reads quads as 64 bit words");
+	const uint64_t *words = num_quads ? (const uint64_t*)&bvh.quads[0] : nullptr;
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ num_quads;
+	for (uint64_t i = 0; i < num_words; i++) {
+		h = (h ^ words[i]) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	return h;
+}
+
+bool bvh_load_cache(Bvh &bvh, const char *filename, uint64_t input_hash) {
+	MappedFile &file = bvh.cache_file;
+	if (!file.open_read(filename))
+		return false;
+	if (file.size < sizeof(BvhCacheHeader)) {
+		file.close();
+		return false;
+	}
+	const BvhCacheHeader &h = *(const BvhCacheHeader*)file.data;
+	if (h.magic != BVH_CACHE_MAGIC || h.version != BVH_CACHE_VERSION || h.input_hash != input_hash ||
+		h.num_quads != bvh.quads.size() || h.num_nodes == 0) {
+		file.close();
+		return false;
+	}
+	const BvhCacheHeader expected = cache_layout(input_hash, h.num_nodes, h.num_quads);
+	if (memcmp(&h, &expected, sizeof(BvhCacheHeader)) != 0 || file.size != h.file_size) {
+		file.close();
+		return false;
+	}
+
+	bvh.nodes.clear();
+	bvh.quads.clear();
+	bvh.node_data = (const BvhNode*)(file.data + h.nodes_offset);
+	bvh.quad_data = (const BvhQuad*)(file.data + h.quads_offset);
+	return true;
+}
+
+bool bvh_write_cache(const Bvh &bvh, const char *filename, uint64_t input_hash) {
+	const BvhCacheHeader h = cache_layout(input_hash, bvh.nodes.size(), bvh.quads.size());
+	const std::string temp = std::string(filename) + "." + std::to_string(std::chrono::high_resolution_clock::now().time_since_epoch().count()) + ".tmp";
+	FILE *f = fopen(temp.c_str(), "wb");
+	if (!f)
+		return false;
+
+	std::vector<uint8_t> padding((size_t)BVH_CACHE_ALIGNMENT, 0);
+	const size_t nodes_bytes = sizeof(BvhNode) * bvh.nodes.size();
+	const size_t quads_bytes = sizeof(BvhQuad) * bvh.quads.size();
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	ok = ok && fwrite(&padding[0], 1, (size_t)(h.nodes_offset - sizeof(h)), f) == h.nodes_offset - sizeof(h);
+	ok = ok && fwrite(&bvh.nodes[0], 1, nodes_bytes, f) == nodes_bytes;
+	ok = ok && fwrite(&padding[0], 1, (size_t)(h.quads_offset - h.nodes_offset - nodes_bytes), f) == h.quads_offset - h.nodes_offset - nodes_bytes;
+	ok = ok && (quads_bytes == 0 || fwrite(&bvh.quads[0], 1, quads_bytes, f) == quads_bytes);
+	ok = fclose(f) == 0 && ok;
+
+	// Someone else might have written the same cache file in the meantime, which is fine
+	if (!ok || (rename(temp.c_str(), filename) != 0 && !file_exists(filename))) {
+		remove(temp.c_str());
+		return false;
+	}
+	remove(temp.c_str());
+	return true;
+}
+
+bool bvh_intersect(const Bvh &bvh, const Float3 org, const Float3 dir, float tnear, float tfar, BvhHit &out_hit) {
+	const BvhQuad *quads = bvh.quad_data;
+	float t = tfar;
+	bool hit = false;
+	traverse(bvh.node_data, org, dir, tnear, t, [&](uint32_t first, uint32_t count) {
+		for (uint32_t i = first, e = first + count; i < e; i++) {
+			const BvhQuad &q = quads[i];
+			if (intersect_triangle(org, dir, q.v0, q.v1, q.v3, tnear, t, out_hit.Ng) ||
+				intersect_triangle(org, dir, q.v2, q.v3, q.v1, tnear, t, out_hit.Ng)) {
+				out_hit.geom_id = q.geom_id;
+				out_hit.prim_id = q.prim_id;
+				out_hit.inst_id = BVH_NO_INSTANCE;
+				hit = true;
+			}
+		}
+		return false;
+	});
+	out_hit.t = t;
+	return hit;
+}
+
+bool bvh_occluded(const Bvh &bvh, const Float3 org, const Float3 dir, float tnear, float tfar) {
+	const BvhQuad *quads = bvh.quad_data;
+	bool occluded = false;
+	traverse(bvh.node_data, org, dir, tnear, tfar, [&](uint32_t first, uint32_t count) {
+		for (uint32_t i = first, e = first + count; i < e && !occluded; i++) {
+			const BvhQuad &q = quads[i];
+			float t = tfar;
+			Float3 Ng;
+			occluded = intersect_triangle(org, dir, q.v0, q.v1, q.v3, tnear, t, Ng) ||
+				intersect_triangle(org, dir, q.v2, q.v3, q.v1, tnear, t, Ng);
+		}
+		return occluded;
+	});
+	return occluded;
+}
+
+namespace {
+	/*
+		Up to BVH_PACKET_SIZE rays, one per lane. The lane arrays are laid out so that the loops over them can be
+		turned into SSE/AVX instructions by the compiler. Lanes that are not in use get a copy of the first ray and t at
+		negative infinity, so they never hit anything. Same for lanes that are done, such as occluded ones.
+	*/
+	struct Packet {
+		uint32_t count;
+		Float3 org[BVH_PACKET_SIZE], dir[BVH_PACKET_SIZE];
+		float org_x[BVH_PACKET_SIZE], org_y[BVH_PACKET_SIZE], org_z[BVH_PACKET_SIZE];
+		float inv_x[BVH_PACKET_SIZE], inv_y[BVH_PACKET_SIZE], inv_z[BVH_PACKET_SIZE];
+		float t[BVH_PACKET_SIZE]; // Closest hit so far, or tfar
+	};
+
+	void init_packet(Packet &packet, const Float3 *orgs, const Float3 *dirs, uint32_t count, const float *tfar) {
+		assert(count != 0 && count <= BVH_PACKET_SIZE);
+		packet.count = count;
+		for (uint32_t i = 0; i < BVH_PACKET_SIZE; i++) {
+			const uint32_t ray = i < count ? i : 0;
+			packet.org[i] = orgs[ray];
+			packet.dir[i] = dirs[ray];
+			packet.t[i] = i < count ? tfar[i] : -std::numeric_limits<float>::infinity();
+		}
+		for (uint32_t i = 0; i < BVH_PACKET_SIZE; i++) {
+			packet.org_x[i] = packet.org[i].x;
+			packet.org_y[i] = packet.org[i].y;
+			packet.org_z[i] = packet.org[i].z;
+			packet.inv_x[i] = 1.0f/packet.dir[i].x;
+			packet.inv_y[i] = 1.0f/packet.dir[i].y;
+			packet.inv_z[i] = 1.0f/packet.dir[i].z;
+		}
+	}
+
+	// The packet in the space of an instance, with the same t
+	void transform_packet(const Transform &m, const Packet &packet, Packet &out_packet) {
+		Float3 orgs[BVH_PACKET_SIZE], dirs[BVH_PACKET_SIZE];
+		for (uint32_t i = 0; i < BVH_PACKET_SIZE; i++) {
+			orgs[i] = transform_point(m, packet.org[i]);
+			dirs[i] = transform_vector(m, packet.dir[i]);
+		}
+		init_packet(out_packet, orgs, dirs, packet.count, packet.t);
+	}
+
+	/*
+		All rays in the packet visit a node if any of them hits its box, the node closest to any of them first.
+		leaf(first, count) can make the t of the lanes smaller, and returns true to stop.
+	*/
+	template<typename LEAF>
+	void traverse_packet(const BvhNode *nodes, const Packet &packet, float tnear, LEAF leaf) {
+		// Returns true if any ray hits the box. out_t is the closest entry distance of those rays.
+		auto intersect_packet_aabb = [&](const BvhNode &node, float &out_t) {
+			float t_enter[BVH_PACKET_SIZE], t_exit[BVH_PACKET_SIZE];
+			for (uint32_t i = 0; i < BVH_PACKET_SIZE; i++) {
+				const float tx0 = (node.bounds_min.x - packet.org_x[i]) * packet.inv_x[i], tx1 = (node.bounds_max.x - packet.org_x[i]) * packet.inv_x[i];
+				const float ty0 = (node.bounds_min.y - packet.org_y[i]) * packet.inv_y[i], ty1 = (node.bounds_max.y - packet.org_y[i]) * packet.inv_y[i];
+				const float tz0 = (node.bounds_min.z - packet.org_z[i]) * packet.inv_z[i], tz1 = (node.bounds_max.z - packet.org_z[i]) * packet.inv_z[i];
+				t_enter[i] = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), tnear));
+				t_exit[i]  = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), packet.t[i]));
+			}
+			float closest = std::numeric_limits<float>::infinity();
+			for (uint32_t i = 0; i < BVH_PACKET_SIZE; i++)
+				closest = std::min(closest, t_enter[i] <= t_exit[i] ? t_enter[i] : std::numeric_limits<float>::infinity());
+			out_t = closest;
+			return closest != std::numeric_limits<float>::infinity();
+		};
+
+		traverse_nodes(nodes, intersect_packet_aabb, leaf);
+	}
+
+	// Lanes that hit something closer than their t get t, out_lane_hit and geom_id, prim_id and Ng of out_hits set
+	void intersect_packet(const Bvh &bvh, Packet &packet, float tnear, bool *out_lane_hit, BvhHit *out_hits) {
+		const BvhQuad *quads = bvh.quad_data;
+		traverse_packet(bvh.node_data, packet, tnear, [&](uint32_t first, uint32_t num_quads) {
+			for (uint32_t q = first, e = first + num_quads; q < e; q++) {
+				const BvhQuad &quad = quads[q];
+				for (uint32_t i = 0; i < packet.count; i++) {
+					if (intersect_triangle(packet.org[i], packet.dir[i], quad.v0, quad.v1, quad.v3, tnear, packet.t[i], out_hits[i].Ng) ||
+						intersect_triangle(packet.org[i], packet.dir[i], quad.v2, quad.v3, quad.v1, tnear, packet.t[i], out_hits[i].Ng)) {
+						out_hits[i].geom_id = quad.geom_id;
+						out_hits[i].prim_id = quad.prim_id;
+						out_lane_hit[i] = true;
+					}
+				}
+			}
+			return false;
+		});
+	}
+
+	// Sets out_occluded for the lanes that hit anything in [tnear, t) and takes them out of the packet.
+	// Returns true when no lane is left.
+	bool occluded_packet(const Bvh &bvh, Packet &packet, float tnear, bool *out_occluded) {
+		const BvhQuad *quads = bvh.quad_data;
+		uint32_t num_left = 0;
+		for (uint32_t i = 0; i < packet.count; i++)
+			num_left += out_occluded[i] ? 0 : 1;
+		traverse_packet(bvh.node_data, packet, tnear, [&](uint32_t first, uint32_t num_quads) {
+			for (uint32_t q = first, e = first + num_quads; q < e; q++) {
+				const BvhQuad &quad = quads[q];
+				for (uint32_t i = 0; i < packet.count; i++) {
+					float t = packet.t[i];
+					Float3 Ng;
+					if (!out_occluded[i] && (intersect_triangle(packet.org[i], packet.dir[i], quad.v0, quad.v1, quad.v3, tnear, t, Ng) ||
+						intersect_triangle(packet.org[i], packet.dir[i], quad.v2, quad.v3, quad.v1, tnear, t, Ng))) {
+						out_occluded[i] = true;
+						packet.t[i] = -std::numeric_limits<float>::infinity();
+						num_left--;
+					}
+				}
+			}
+			return num_left == 0;
+		});
+		return num_left == 0;
+	}
+}
+
+void bvh_intersect_packet(const Bvh &bvh, const Float3 *orgs, const Float3 *dirs, uint32_t count, float tnear, const float *tfar, bool *out_hit, BvhHit *out_hits) {
+	Packet packet;
+	init_packet(packet, orgs, dirs, count, tfar);
+	for (uint32_t i = 0; i < count; i++)
+		out_hit[i] = false;
+
+	intersect_packet(bvh, packet, tnear, out_hit, out_hits);
+	for (uint32_t i = 0; i < count; i++) {
+		out_hits[i].t = packet.t[i];
+		out_hits[i].inst_id = BVH_NO_INSTANCE;
+	}
+}
+
+void bvh_occluded_packet(const Bvh &bvh, const Float3 *orgs, const Float3 *dirs, uint32_t count, float tnear, const float *tfar, bool *out_occluded) {
+	Packet packet;
+	init_packet(packet, orgs, dirs, count, tfar);
+	for (uint32_t i = 0; i < count; i++)
+		out_occluded[i] = false;
+	occluded_packet(bvh, packet, tnear, out_occluded);
+}
+
+void bvh_add_instance(BvhTopLevel &top_level, uint32_t prototype, const Transform &world_from_object, uint32_t inst_id) {
+	const BvhNode &root = top_level.prototypes[prototype]->node_data[0];
+
+	BvhInstance instance;
+	instance.object_from_world = inverse(world_from_object);
+	Aabb bounds = empty_aabb();
+	if (!is_empty(root)) {
+		for (uint32_t c = 0; c < 8; c++) {
+			const Float3 corner = float3((c & 1) ? root.bounds_max.x : root.bounds_min.x, (c & 2) ? root.bounds_max.y : root.bounds_min.y, (c & 4) ? root.bounds_max.z : root.bounds_min.z);
+			grow(bounds, transform_point(world_from_object, corner));
+		}
+	}
+	instance.bounds_min = bounds.mn;
+	instance.bounds_max = bounds.mx;
+	instance.prototype = prototype;
+	instance.inst_id = inst_id;
+	top_level.instances.push_back(instance);
+}
+
+void bvh_build_top_level(BvhTopLevel &top_level) {
+	const uint32_t num_instances = top_level.instances.size();
+
+	top_level.nodes.clear();
+	top_level.nodes.resize(1);
+	if (num_instances == 0) {
+		set_empty(top_level.nodes[0]);
+		return;
+	}
+	top_level.nodes.reserve(2*num_instances);
+
+	Builder builder(top_level.nodes);
+	builder.prims.resize(num_instances);
+	builder.order.resize(num_instances);
+	for (uint32_t i = 0; i < num_instances; i++) {
+		const BvhInstance &instance = top_level.instances[i];
+		BuildPrim &p = builder.prims[i];
+		p.bounds.mn = instance.bounds_min;
+		p.bounds.mx = instance.bounds_max;
+		p.centroid = (p.bounds.mn + p.bounds.mx) * 0.5f;
+		builder.order[i] = i;
+	}
+
+	builder.build(0, 0, num_instances, 0);
+
+	Array<BvhInstance> reordered(num_instances);
+	for (uint32_t i = 0; i < num_instances; i++)
+		reordered[i] = top_level.instances[builder.order[i]];
+	for (uint32_t i = 0; i < num_instances; i++)
+		top_level.instances[i] = reordered[i];
+}
+
+bool bvh_intersect_instances(const BvhTopLevel &top_level, const Float3 org, const Float3 dir, float tnear, float tfar, BvhHit &out_hit) {
+	const BvhInstance *instances = top_level.instances.size() ? &top_level.instances[0] : nullptr;
+	float t = tfar;
+	bool hit = false;
+	traverse(&top_level.nodes[0], org, dir, tnear, t, [&](uint32_t first, uint32_t count) {
+		for (uint32_t i = first; i < first + count; i++) {
+			const BvhInstance &instance = instances[i];
+			const Transform &m = instance.object_from_world;
+			BvhHit h;
+			if (bvh_intersect(*top_level.prototypes[instance.prototype], transform_point(m, org), transform_vector(m, dir), tnear, t, h)) {
+				out_hit = h;
+				out_hit.Ng = transform_normal(m, h.Ng);
+				out_hit.inst_id = instance.inst_id;
+				t = h.t;
+				hit = true;
+			}
+		}
+		return false;
+	});
+	return hit;
+}
+
+/*
+	The packet goes down the top level together. At each instance it is transformed into the space of the prototype
+	and traced there with the packet traversal.
+*/
+void bvh_intersect_instances_packet(const BvhTopLevel &top_level, const Float3 *orgs, const Float3 *dirs, uint32_t count, float tnear, const float *tfar, bool *out_hit, BvhHit *out_hits) {
+	const BvhInstance *instances = top_level.instances.size() ? &top_level.instances[0] : nullptr;
+	Packet packet;
+	init_packet(packet, orgs, dirs, count, tfar);
+	for (uint32_t i = 0; i < count; i++)
+		out_hit[i] = false;
+
+	traverse_packet(&top_level.nodes[0], packet, tnear, [&](uint32_t first, uint32_t num_instances) {
+		for (uint32_t n = first; n < first + num_instances; n++) {
+			const BvhInstance &instance = instances[n];
+			const Transform &m = instance.object_from_world;
+			Packet object_packet;
+			transform_packet(m, packet, object_packet);
+			bool lane_hit[BVH_PACKET_SIZE] = {};
+			BvhHit hits[BVH_PACKET_SIZE];
+			intersect_packet(*top_level.prototypes[instance.prototype], object_packet, tnear, lane_hit, hits);
+			for (uint32_t i = 0; i < count; i++) {
+				if (!lane_hit[i])
+					continue;
+				packet.t[i] = object_packet.t[i];
+				out_hits[i] = hits[i];
+				out_hits[i].t = object_packet.t[i];
+				out_hits[i].Ng = transform_normal(m, hits[i].Ng);
+				out_hits[i].inst_id = instance.inst_id;
+				out_hit[i] = true;
+			}
+		}
+		return false;
+	});
+}
+
+void bvh_occluded_instances_packet(const BvhTopLevel &top_level, const Float3 *orgs, const Float3 *dirs, uint32_t count, float tnear, const float *tfar, bool *out_occluded) {
+	const BvhInstance *instances = top_level.instances.size() ? &top_level.instances[0] : nullptr;
+	Packet packet;
+	init_packet(packet, orgs, dirs, count, tfar);
+	for (uint32_t i = 0; i < count; i++)
+		out_occluded[i] = false;
+
+	traverse_packet(&top_level.nodes[0], packet, tnear, [&](uint32_t first, uint32_t num_instances) {
+		for (uint32_t n = first; n < first + num_instances; n++) {
+			Packet object_packet;
+			transform_packet(instances[n].object_from_world, packet, object_packet);
+			const bool done = occluded_packet(*top_level.prototypes[instances[n].prototype], object_packet, tnear, out_occluded);
+			for (uint32_t i = 0; i < count; i++)
+				packet.t[i] = object_packet.t[i]; // Occluded lanes are out
+			if (done)
+				return true;
+		}
+		return false;
+	});
+}
+
+bool bvh_occluded_instances(const BvhTopLevel &top_level, const Float3 org, const Float3 dir, float tnear, float tfar) {
+	const BvhInstance *instances = top_level.instances.size() ? &top_level.instances[0] : nullptr;
+	bool occluded = false;
+	traverse(&top_level.nodes[0], org, dir, tnear, tfar, [&](uint32_t first, uint32_t count) {
+		for (uint32_t i = first; i < first + count && !occluded; i++) {
+			const Transform &m = instances[i].object_from_world;
+			occluded = bvh_occluded(*top_level.prototypes[instances[i].prototype], transform_point(m, org), transform_vector(m, dir), tnear, tfar);
+		}
+		return occluded;
+	});
+	return occluded;
+}
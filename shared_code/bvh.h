@@ -0,0 +1,107 @@
+#pragma once
+
+#include "shared.h"
+#include "mapped_file.h"
+
+/*
+	Native bounding volume hierarchy over quads. Used when we are not building with Embree.
+
+	Nodes are stored depth first in a flat array. The two children of an inner node are always stored next
+	to each other so we only need one index per node. Quads are reordered during the build so that each leaf
+	references a contiguous range of quads.
+
+	Building takes a while for big scenes, so a built BVH can be saved to a cache file and mapped back in by later runs
+	with the same quads.
+*/
+
+struct BvhNode {
+	Float3 bounds_min;
+	uint32_t first; // Index of left child (right child is first+1) or first quad if this is a leaf
+	Float3 bounds_max;
+	uint32_t count; // Number of quads in leaf, 0 for inner nodes
+};
+
+// A quad is intersected as the two triangles (v0,v1,v3) and (v2,v3,v1), same as Embree does it
+struct BvhQuad {
+	Float3 v0, v1, v2, v3;
+	uint32_t geom_id, prim_id;
+};
+
+const uint32_t BVH_NO_INSTANCE = 0xFFFFFFFF;
+
+struct BvhHit {
+	float t;
+	uint32_t geom_id, prim_id;
+	uint32_t inst_id; // BVH_NO_INSTANCE if the hit is not in an instance
+	Float3 Ng; // Not normalized, in world space
+};
+
+struct Bvh {
+	Array<BvhNode> nodes;
+	Array<BvhQuad> quads;
+
+	// Traversal only looks at these. They point into nodes and quads, or into cache_file.
+	const BvhNode *node_data = nullptr;
+	const BvhQuad *quad_data = nullptr;
+	MappedFile cache_file;
+};
+
+// Takes ownership of the quads in bvh.quads and reorders them
+void bvh_build(Bvh &bvh);
+
+// Identifies the quads in bvh.quads before they are built, used as the key of the cache
+uint64_t bvh_input_hash(const Bvh &bvh);
+
+// Maps a BVH from a file written by bvh_write_cache. Fails if the file is missing, from another version of the builder
+// or for other quads. The quads in bvh.quads are dropped if it succeeds.
+bool bvh_load_cache(Bvh &bvh, const char *filename, uint64_t input_hash);
+
+// Writes a built BVH. Goes through a temporary file, so other processes never see half a cache file.
+bool bvh_write_cache(const Bvh &bvh, const char *filename, uint64_t input_hash);
+
+/*
+	Two levels for instancing. The top level is a BVH over instances, which are BVHs (prototypes) placed with a
+	transform. A ray that reaches an instance is transformed into the space of the prototype and traced there. The
+	direction is not normalized, so t is the same in both spaces. Memory and build time only grow with the number of
+	instances, not with the size of what they instance.
+*/
+struct BvhInstance {
+	Transform object_from_world;
+	Float3 bounds_min, bounds_max; // In world space
+	uint32_t prototype; // Index into BvhTopLevel::prototypes
+	uint32_t inst_id; // Reported in BvhHit
+};
+
+struct BvhTopLevel {
+	Array<BvhNode> nodes; // Leaves reference ranges of instances
+	Array<BvhInstance> instances;
+	Array<Bvh*> prototypes; // Built with bvh_build, not owned
+};
+
+void bvh_add_instance(BvhTopLevel &top_level, uint32_t prototype, const Transform &world_from_object, uint32_t inst_id);
+
+// Call when all instances have been added. Reorders the instances.
+void bvh_build_top_level(BvhTopLevel &top_level);
+
+// Same as bvh_intersect and bvh_occluded but for the instances
+bool bvh_intersect_instances(const BvhTopLevel &top_level, const Float3 org, const Float3 dir, float tnear, float tfar, BvhHit &out_hit);
+bool bvh_occluded_instances(const BvhTopLevel &top_level, const Float3 org, const Float3 dir, float tnear, float tfar);
+
+// Returns closest hit in [tnear, tfar]
+bool bvh_intersect(const Bvh &bvh, const Float3 org, const Float3 dir, float tnear, float tfar, BvhHit &out_hit);
+
+// Returns true if there is any hit in [tnear, tfar). Stops at the first one found.
+bool bvh_occluded(const Bvh &bvh, const Float3 org, const Float3 dir, float tnear, float tfar);
+
+const uint32_t BVH_PACKET_SIZE = 8;
+
+// Traverses up to BVH_PACKET_SIZE rays together, ray i in [tnear, tfar[i]]. out_hit[i] tells if ray i hit anything.
+// Rays that start close together and go the same way share most of the nodes they visit.
+void bvh_intersect_packet(const Bvh &bvh, const Float3 *orgs, const Float3 *dirs, uint32_t count, float tnear, const float *tfar, bool *out_hit, BvhHit *out_hits);
+
+// Any hit version of the above, ray i is tested in [tnear, tfar[i])
+void bvh_occluded_packet(const Bvh &bvh, const Float3 *orgs, const Float3 *dirs, uint32_t count, float tnear, const float *tfar, bool *out_occluded);
+
+// Same for the instances. out_hits[i] is only written if out_hit[i] is set. Pass the hits in the meshes as tfar.
+void bvh_intersect_instances_packet(const BvhTopLevel &top_level, const Float3 *orgs, const Float3 *dirs, uint32_t count, float tnear, const float *tfar, bool *out_hit, BvhHit *out_hits);
+void bvh_occluded_instances_packet(const BvhTopLevel &top_level, const Float3 *orgs, const Float3 *dirs, uint32_t count, float tnear, const float *tfar, bool *out_occluded);
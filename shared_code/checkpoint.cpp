@@ -0,0 +1,113 @@
+#include "checkpoint.h"
+#include <stdio.h>
+
+struct Checkpoint::Header {
+	uint32_t magic;
+	uint32_t version;
+	CheckpointDescription description;
+	uint32_t complete_slot; // Slot with the last complete checkpoint, or NO_SLOT
+	uint32_t padding;
+	uint64_t num_checkpoints;
+};
+
+namespace {
+	const uint32_t CHECKPOINT_MAGIC = 0x50435450; // PTCP
+	const uint32_t CHECKPOINT_VERSION = 2;
+	const uint32_t NO_SLOT = 0xFFFFFFFF;
+	const size_t SLOT_ALIGNMENT = 4096;
+
+	inline size_t align(size_t v) {
+		return (v + SLOT_ALIGNMENT - 1) / SLOT_ALIGNMENT * SLOT_ALIGNMENT;
+	}
+}
+
+bool Checkpoint::open(const char *filename, const CheckpointDescription &description, bool resume, bool &out_resumed) {
+	out_resumed = false;
+	const size_t file_size = layout(description);
+
+	if (resume && file_exists(filename)) {
+		if (!file.open(filename, 0))
+			return false;
+		const Header &h = header();
+		if (file.size != file_size || h.magic != CHECKPOINT_MAGIC || h.version != CHECKPOINT_VERSION) {
+			printf("'%s' is not a checkpoint for this render\n", filename);
+			return false;
+		}
+		if (memcmp(&h.description, &description, sizeof(description)) != 0) {
+			printf("Checkpoint '%s' was rendered with other settings (size, image, seed, sampler or shard)\n", filename);
+			return false;
+		}
+		out_resumed = h.complete_slot != NO_SLOT;
+		return true;
+	}
+
+	if (!file.open(filename, file_size))
+		return false;
+	Header &h = header();
+	memset(&h, 0, sizeof(Header));
+	h.magic = CHECKPOINT_MAGIC;
+	h.version = CHECKPOINT_VERSION;
+	h.description = description;
+	h.complete_slot = NO_SLOT;
+	return file.flush(0, sizeof(Header));
+}
+
+bool Checkpoint::open_existing(const char *filename) {
+	if (!file.open(filename, 0))
+		return false;
+	if (file.size < sizeof(Header) || header().magic != CHECKPOINT_MAGIC || header().version != CHECKPOINT_VERSION) {
+		printf("'%s' is not a checkpoint\n", filename);
+		return false;
+	}
+	if (file.size != layout(header().description)) {
+		printf("Checkpoint '%s' is truncated\n", filename);
+		return false;
+	}
+	return true;
+}
+
+const CheckpointDescription &Checkpoint::description() const {
+	return header().description;
+}
+
+bool Checkpoint::has_pixels() const {
+	return header().complete_slot != NO_SLOT;
+}
+
+const Pixel *Checkpoint::pixels() const {
+	assert(header().complete_slot != NO_SLOT);
+	return slot(header().complete_slot);
+}
+
+Pixel *Checkpoint::begin_write() {
+	return slot(header().complete_slot == 0 ? 1 : 0);
+}
+
+bool Checkpoint::commit() {
+	Header &h = header();
+	const uint32_t written = h.complete_slot == 0 ? 1 : 0;
+	if (!file.flush(slot_offset[written], slot_size))
+		return false;
+	h.complete_slot = written;
+	h.num_checkpoints++;
+	return file.flush(0, sizeof(Header));
+}
+
+void Checkpoint::close() {
+	file.close();
+}
+
+Checkpoint::Header &Checkpoint::header() const {
+	return *(Header*)file.data;
+}
+
+Pixel *Checkpoint::slot(uint32_t index) const {
+	return (Pixel*)(file.data + slot_offset[index]);
+}
+
+size_t Checkpoint::layout(const CheckpointDescription &description) {
+	slot_size = sizeof(Pixel) * description.width * description.height;
+	slot_offset[0] = align(sizeof(Header));
+	slot_offset[1] = slot_offset[0] + align(slot_size);
+	return slot_offset[1] + slot_size;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "shared.h"
+#include "mapped_file.h"
+
+/*
+	Memory mapped checkpoint of the tile by tile framebuffer, so that a render can be resumed or extended with more
+	samples. The random numbers only depend on the seed, the sampler, the pixel and the sample index. That together
+	with N of each pixel is all the state we need.
+
+	The file has a header and two framebuffer slots. A new checkpoint goes to the slot that is not the last complete
+	one. It is flushed to disk before the header starts pointing at it. A render that is killed while writing a
+	checkpoint can still be resumed from the one before.
+*/
+
+// How a render is split over processes with -shard
+enum ShardMode {
+	SHARD_TILES,   // Every num_shards:th tile along the tile order
+	SHARD_SAMPLES, // A range of the sample indices of every pixel
+};
+
+// Must match between the render that wrote a checkpoint and the one that resumes it
+struct CheckpointDescription {
+	uint32_t width, height, tile_size;
+	uint32_t image_index, seed, sampler;
+	uint32_t shard_mode, shard_index, num_shards; // One shard of one is the whole image
+};
+
+struct Checkpoint {
+	// Creates a new checkpoint file, or continues from an existing one if resume is set and there is one
+	bool open(const char *filename, const CheckpointDescription &description, bool resume, bool &out_resumed);
+
+	// Opens an existing checkpoint without knowing what it was rendered with, for the merge tool
+	bool open_existing(const char *filename);
+
+	const CheckpointDescription &description() const;
+
+	// False if the render was killed before the first checkpoint was written
+	bool has_pixels() const;
+
+	// Framebuffer of the last complete checkpoint
+	const Pixel *pixels() const;
+
+	// Fill in the returned framebuffer and call commit to make it the last complete checkpoint
+	Pixel *begin_write();
+	bool commit();
+
+	void close();
+
+private:
+	struct Header;
+	Header &header() const;
+	Pixel *slot(uint32_t index) const;
+	size_t layout(const CheckpointDescription &description); // Returns the file size
+
+	MappedFile file;
+	size_t slot_offset[2];
+	size_t slot_size = 0;
+};
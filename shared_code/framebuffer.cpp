@@ -0,0 +1,118 @@
+#include "framebuffer.h"
+#include "image_io.h"
+#include "tonemap.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+std::vector<Float3> detile(const std::vector<Pixel> &framebuffer, const TileLayout &layout) {
+	std::vector<Float3> image(layout.width*layout.height);
+	for (uint32_t y=0, ofs=0; y<layout.height; y++) {
+		for (uint32_t x=0; x<layout.width; x++, ofs++) {
+			image[ofs] = pixel_mean(framebuffer[framebuffer_offset(layout, x, y)]);
+		}
+	}
+	return image;
+}
+
+double image_rmse(const std::vector<Float3> &image, const std::vector<Float3> &reference) {
+	assert(image.size() == reference.size());
+	double sum = 0.0;
+	for (uint32_t i = 0; i < (uint32_t)image.size(); i++) {
+		const Float3 d = image[i] - reference[i];
+		sum += d.x*d.x + d.y*d.y + d.z*d.z;
+	}
+	return sqrt(sum / (3.0 * image.size()));
+}
+
+bool tiles_have_uniform_samples(const std::vector<Pixel> &framebuffer, const TileLayout &layout) {
+	for (uint32_t tile = 0; tile < num_tiles(layout); tile++) {
+		const TileRect rect = tile_rect(layout, tile);
+		for (uint32_t i = 1; i < rect.width*rect.height; i++) {
+			if (framebuffer[rect.offset + i].N != framebuffer[rect.offset].N)
+				return false;
+		}
+	}
+	return true;
+}
+
+void write_sample_heatmap(const char *filename, const std::vector<Pixel> &framebuffer, const TileLayout &layout, uint32_t num_samples) {
+	const uint32_t width = layout.width;
+	const uint32_t height = layout.height;
+	std::vector<uint32_t> byte_data(width*height);
+	for (uint32_t y=0, ofs=0; y<height; y++) {
+		for (uint32_t x=0; x<width; x++, ofs++) {
+			const float f = 3.0f * framebuffer[framebuffer_offset(layout, x, y)].N / num_samples;
+			uint8_t r8 = (uint8_t)(255.0f * clamp(f,      0.0f, 1.0f));
+			uint8_t g8 = (uint8_t)(255.0f * clamp(f-1.0f, 0.0f, 1.0f));
+			uint8_t b8 = (uint8_t)(255.0f * clamp(f-2.0f, 0.0f, 1.0f));
+			byte_data[ofs] = r8|(g8<<8)|(b8<<16)|(0xFFu<<24);
+		}
+	}
+	stbi_write_png(filename, width, height, 4, (const void*)&byte_data[0], 0);
+}
+
+bool write_image(const char *filename, const std::vector<Pixel> &framebuffer, const TileLayout &layout, uint32_t seed, uint32_t num_threads, ImageWriteTimes *out_times) {
+	const auto resolve_start = std::chrono::high_resolution_clock::now();
+	const uint32_t width = layout.width;
+	const uint32_t height = layout.height;
+	const uint32_t num_bands = layout.num_tiles_y;
+	const ImageFormat format = image_format_from_filename(filename);
+
+	std::vector<uint32_t> byte_data;
+	HdrImageWriter writer;
+	if (format == IMAGE_FORMAT_PNG)
+		byte_data.resize(width*height);
+	else if (!writer.open(filename, format, width, height))
+		return false;
+
+	std::atomic<uint32_t> next_band(0);
+	auto thread_func = [&]() {
+		std::vector<Float3> rows(width * layout.tile_size);
+		std::vector<float> dither_uniforms(width);
+		RandomContext random_context = {};
+		random_context.seed = seed;
+
+		for (uint32_t band = next_band++; band < num_bands; band = next_band++) {
+			const uint32_t y0 = band * layout.tile_size;
+			uint32_t band_height = 0;
+			for (uint32_t tx = 0; tx < layout.num_tiles_x; tx++) {
+				const TileRect rect = tile_rect(layout, band * layout.num_tiles_x + tx);
+				const Pixel *tile_pixels = &framebuffer[rect.offset];
+				for (uint32_t ly = 0; ly < rect.height; ly++) {
+					for (uint32_t lx = 0; lx < rect.width; lx++)
+						rows[ly * width + rect.x + lx] = pixel_mean(tile_pixels[ly * rect.width + lx]);
+				}
+				band_height = rect.height;
+			}
+
+			if (format != IMAGE_FORMAT_PNG) {
+				writer.write_rows(y0, band_height, &rows[0]);
+				continue;
+			}
+			for (uint32_t ly = 0; ly < band_height; ly++) {
+				for (uint32_t x = 0; x < width; x++) {
+					start_sample(random_context, x, y0 + ly, 0xFFFFFFFF); // Dither gets a stream of its own
+					dither_uniforms[x] = uniform(random_context);
+				}
+				tonemap_row(&rows[ly * width], &dither_uniforms[0], width, &byte_data[(y0 + ly) * width]);
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (uint32_t i = 0; i < num_threads; ++i)
+		threads.push_back(std::thread(thread_func));
+	for (auto &t : threads)
+		t.join();
+
+	const auto encode_start = std::chrono::high_resolution_clock::now();
+	const bool ok = format == IMAGE_FORMAT_PNG ? stbi_write_png(filename, width, height, 4, (const void*)&byte_data[0], 0) != 0 : writer.close();
+	if (out_times) {
+		out_times->resolve_seconds = std::chrono::duration<double>(encode_start - resolve_start).count();
+		out_times->encode_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - encode_start).count();
+	}
+	return ok;
+}
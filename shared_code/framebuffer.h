@@ -0,0 +1,79 @@
+#pragma once
+
+#include "shared.h"
+#include <vector>
+
+/*
+	The framebuffer is stored tile by tile, the tiles in row order and the pixels of each tile row by row. Tiles are
+	tile_size*tile_size pixels, except at the right and bottom edges where the image cuts them off. There is no padding,
+	so the framebuffer has width*height pixels and each row of tiles starts at y*width. Pixels hold sums, so
+	framebuffers with samples of the same image (passes, checkpoints, shards) are merged by adding them.
+*/
+
+const uint32_t DEFAULT_TILE_SIZE = 16;
+const uint32_t MAX_TILE_SIZE = 64; // render_tile keeps a tile worth of pixel indices on the stack
+
+struct TileLayout {
+	uint32_t width, height;
+	uint32_t tile_size;
+	uint32_t num_tiles_x, num_tiles_y;
+};
+
+inline TileLayout tile_layout(uint32_t width, uint32_t height, uint32_t tile_size) {
+	assert(tile_size > 0);
+	TileLayout layout;
+	layout.width = width;
+	layout.height = height;
+	layout.tile_size = tile_size;
+	layout.num_tiles_x = (width  + tile_size-1)/tile_size;
+	layout.num_tiles_y = (height + tile_size-1)/tile_size;
+	return layout;
+}
+
+inline uint32_t num_tiles(const TileLayout &layout) { return layout.num_tiles_x * layout.num_tiles_y; }
+
+// Where a tile is in the image, its pixels are framebuffer[offset, offset + width*height)
+struct TileRect {
+	uint32_t x, y, width, height;
+	uint32_t offset;
+};
+
+inline TileRect tile_rect(const TileLayout &layout, uint32_t tile) {
+	TileRect rect;
+	rect.x = (tile % layout.num_tiles_x) * layout.tile_size;
+	rect.y = (tile / layout.num_tiles_x) * layout.tile_size;
+	rect.width  = std::min(layout.tile_size, layout.width  - rect.x);
+	rect.height = std::min(layout.tile_size, layout.height - rect.y);
+	rect.offset = rect.y * layout.width + rect.x * rect.height; // The tiles to the left have the same height
+	return rect;
+}
+
+inline uint32_t framebuffer_offset(const TileLayout &layout, uint32_t x, uint32_t y) {
+	const TileRect rect = tile_rect(layout, (y / layout.tile_size) * layout.num_tiles_x + x / layout.tile_size);
+	return rect.offset + (y - rect.y) * rect.width + (x - rect.x);
+}
+
+// Linear image in scanline order
+std::vector<Float3> detile(const std::vector<Pixel> &framebuffer, const TileLayout &layout);
+
+// Root mean square difference over all channels of two images of the same size
+double image_rmse(const std::vector<Float3> &image, const std::vector<Float3> &reference);
+
+// True if all pixels of each tile have the same number of samples
+bool tiles_have_uniform_samples(const std::vector<Pixel> &framebuffer, const TileLayout &layout);
+
+// Number of samples per pixel as black-red-yellow-white
+void write_sample_heatmap(const char *filename, const std::vector<Pixel> &framebuffer, const TileLayout &layout, uint32_t num_samples);
+
+/*
+	Resolves the framebuffer and writes it to filename. .pfm and .exr get the linear image, anything else a png. Rows
+	of tiles are resolved in parallel on num_threads threads. Png rows are tonemapped straight into the buffer
+	that goes to the encoder, pfm/exr rows are written to the file as soon as their row of tiles is done. The png dither
+	depends on seed.
+*/
+struct ImageWriteTimes {
+	double resolve_seconds = 0.0; // For pfm/exr this includes writing the rows
+	double encode_seconds = 0.0; // Png encoding, or closing the pfm/exr file
+};
+
+bool write_image(const char *filename, const std::vector<Pixel> &framebuffer, const TileLayout &layout, uint32_t seed, uint32_t num_threads, ImageWriteTimes *out_times = nullptr);
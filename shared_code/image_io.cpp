@@ -0,0 +1,181 @@
+#include "image_io.h"
+#include <string.h>
+
+bool has_extension(const char *filename, const char *extension) {
+	const size_t n = strlen(filename), e = strlen(extension);
+	return n >= e && strcmp(filename + n - e, extension) == 0;
+}
+
+namespace {
+	// https://www.openexr.com/documentation/openexrfilelayout.pdf
+	struct ExrHeader {
+		std::vector<uint8_t> bytes;
+
+		void add(const void *data, size_t size) {
+			bytes.insert(bytes.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+		}
+		void add_string(const char *s) { add(s, strlen(s) + 1); }
+		void add_int(int32_t v) { add(&v, 4); }
+		void add_float(float v) { add(&v, 4); }
+		void add_attribute(const char *name, const char *type, uint32_t size) {
+			add_string(name);
+			add_string(type);
+			add_int((int32_t)size);
+		}
+	};
+
+	const uint32_t EXR_PIXEL_TYPE_FLOAT = 2;
+	const char * const exr_channels[3] = {"B", "G", "R"}; // Must be in alphabetical order
+
+	std::vector<uint8_t> exr_header(uint32_t width, uint32_t height) {
+		ExrHeader h;
+		const uint8_t magic[4] = {0x76, 0x2f, 0x31, 0x01};
+		h.add(magic, 4);
+		h.add_int(2); // Version 2, single part scanline file
+
+		h.add_attribute("channels", "chlist", 3 * (2 + 16) + 1);
+		for (uint32_t c = 0; c < 3; c++) {
+			h.add_string(exr_channels[c]);
+			h.add_int(EXR_PIXEL_TYPE_FLOAT);
+			const uint8_t linear_and_reserved[4] = {0, 0, 0, 0};
+			h.add(linear_and_reserved, 4);
+			h.add_int(1); // x sampling
+			h.add_int(1); // y sampling
+		}
+		h.bytes.push_back(0);
+
+		h.add_attribute("compression", "compression", 1);
+		h.bytes.push_back(0); // None
+
+		for (const char *window : {"dataWindow", "displayWindow"}) {
+			h.add_attribute(window, "box2i", 16);
+			h.add_int(0);
+			h.add_int(0);
+			h.add_int((int32_t)width - 1);
+			h.add_int((int32_t)height - 1);
+		}
+
+		h.add_attribute("lineOrder", "lineOrder", 1);
+		h.bytes.push_back(0); // Increasing y
+
+		h.add_attribute("pixelAspectRatio", "float", 4);
+		h.add_float(1.0f);
+
+		h.add_attribute("screenWindowCenter", "v2f", 8);
+		h.add_float(0.0f);
+		h.add_float(0.0f);
+
+		h.add_attribute("screenWindowWidth", "float", 4);
+		h.add_float(1.0f);
+
+		h.bytes.push_back(0); // End of header
+		return h.bytes;
+	}
+}
+
+ImageFormat image_format_from_filename(const char *filename) {
+	if (has_extension(filename, ".pfm"))
+		return IMAGE_FORMAT_PFM;
+	if (has_extension(filename, ".exr"))
+		return IMAGE_FORMAT_EXR;
+	return IMAGE_FORMAT_PNG;
+}
+
+HdrImageWriter::~HdrImageWriter() {
+	if (file)
+		close();
+}
+
+bool HdrImageWriter::open(const char *filename, ImageFormat format, uint32_t width, uint32_t height) {
+	assert(format == IMAGE_FORMAT_PFM || format == IMAGE_FORMAT_EXR);
+	this->format = format;
+	this->width = width;
+	this->height = height;
+
+	file = fopen(filename, "wb");
+	if (!file)
+		return false;
+
+	ok = true;
+	if (format == IMAGE_FORMAT_PFM) {
+		// Negative scale means little endian. Rows are stored bottom to top.
+		ok = fprintf(file, "PF\n%u %u\n-1.0\n", width, height) > 0;
+		data_offset = ftell(file);
+	} else {
+		// Header, then a table with the file offset of each scanline block. Each block is one scanline: y, data size
+		// and then the scanline one channel at a time.
+		const std::vector<uint8_t> header = exr_header(width, height);
+		ok = fwrite(&header[0], 1, header.size(), file) == header.size();
+		data_offset = (long)(header.size() + height * sizeof(uint64_t));
+		const uint64_t block_size = 8 + width * 3 * sizeof(float);
+		for (uint32_t y = 0; y < height; y++) {
+			const uint64_t offset = data_offset + y * block_size;
+			ok = ok && fwrite(&offset, sizeof(offset), 1, file) == 1;
+		}
+	}
+	scratch.resize(width * 3 + 2);
+	return ok;
+}
+
+void HdrImageWriter::write_rows(uint32_t y, uint32_t num_rows, const Float3 *rgb) {
+	assert(y + num_rows <= height);
+	std::lock_guard<std::mutex> lock(mutex);
+	for (uint32_t r = 0; r < num_rows; r++) {
+		const Float3 *row = rgb + r * width;
+		if (format == IMAGE_FORMAT_PFM) {
+			const long offset = data_offset + (long)(height - 1 - (y + r)) * width * sizeof(Float3);
+			ok = ok && fseek(file, offset, SEEK_SET) == 0;
+			ok = ok && fwrite(row, sizeof(Float3), width, file) == width;
+		} else {
+			int32_t *block_start = (int32_t*)&scratch[0];
+			block_start[0] = (int32_t)(y + r);
+			block_start[1] = (int32_t)(width * 3 * sizeof(float));
+			float *channels = &scratch[2];
+			for (uint32_t x = 0; x < width; x++) {
+				channels[x] = row[x].z;
+				channels[width + x] = row[x].y;
+				channels[2*width + x] = row[x].x;
+			}
+			const long offset = data_offset + (long)(y + r) * (long)(scratch.size() * sizeof(float));
+			ok = ok && fseek(file, offset, SEEK_SET) == 0;
+			ok = ok && fwrite(&scratch[0], sizeof(float), scratch.size(), file) == scratch.size();
+		}
+	}
+}
+
+bool HdrImageWriter::close() {
+	ok = fclose(file) == 0 && ok;
+	file = nullptr;
+	return ok;
+}
+
+bool write_pfm(const char *filename, uint32_t width, uint32_t height, const Float3 *rgb) {
+	HdrImageWriter writer;
+	if (!writer.open(filename, IMAGE_FORMAT_PFM, width, height))
+		return false;
+	writer.write_rows(0, height, rgb);
+	return writer.close();
+}
+
+bool read_pfm(const char *filename, uint32_t &out_width, uint32_t &out_height, std::vector<Float3> &out_rgb) {
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	char type[3] = {0};
+	float scale = 0.0f;
+	if (fscanf(f, "%2s %u %u %f", type, &out_width, &out_height, &scale) != 4 || strcmp(type, "PF") != 0 || scale >= 0.0f) {
+		// Only color little endian images for now
+		fclose(f);
+		return false;
+	}
+	fgetc(f); // Single whitespace before the data
+
+	out_rgb.resize(out_width * out_height);
+	bool ok = true;
+	for (uint32_t y = out_height; y-- > 0;) {
+		ok = ok && fread(&out_rgb[y * out_width], sizeof(Float3), out_width, f) == out_width;
+	}
+	fclose(f);
+	return ok;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "vector_math.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <mutex>
+
+/*
+	Reading and writing of linear (not tonemapped) images. rgb is row by row, top row first.
+*/
+
+enum ImageFormat {
+	IMAGE_FORMAT_PNG,
+	IMAGE_FORMAT_PFM,
+	IMAGE_FORMAT_EXR,
+};
+
+// True if filename ends with extension, such as ".pfm"
+bool has_extension(const char *filename, const char *extension);
+
+// From the file extension, png if unknown
+ImageFormat image_format_from_filename(const char *filename);
+
+/*
+	Writes a pfm or exr file a band of rows at a time, so that writing overlaps producing the rest of the image.
+	Every row has a fixed place in the file so bands can be written in any order and from any thread.
+	The exr file is uncompressed scanlines with 32-bit float channels. Both formats assume a little endian machine.
+*/
+struct HdrImageWriter {
+	~HdrImageWriter();
+	bool open(const char *filename, ImageFormat format, uint32_t width, uint32_t height);
+	void write_rows(uint32_t y, uint32_t num_rows, const Float3 *rgb);
+	bool close(); // Returns false if anything failed since open
+
+private:
+	std::mutex mutex;
+	FILE *file = nullptr;
+	ImageFormat format = IMAGE_FORMAT_PFM;
+	uint32_t width = 0, height = 0;
+	long data_offset = 0; // Where the first row starts
+	std::vector<float> scratch; // Row in file layout
+	bool ok = false;
+};
+
+// Portable float map, http://www.pauldebevec.com/Research/HDR/PFM/
+bool write_pfm(const char *filename, uint32_t width, uint32_t height, const Float3 *rgb);
+bool read_pfm(const char *filename, uint32_t &out_width, uint32_t &out_height, std::vector<Float3> &out_rgb);
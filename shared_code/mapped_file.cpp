@@ -0,0 +1,168 @@
+#include "mapped_file.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const char *filename, size_t size) {
+	file_handle = CreateFileA(filename, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		file_handle = nullptr;
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size)) {
+		close();
+		return false;
+	}
+	if (size == 0)
+		size = (size_t)file_size.QuadPart;
+	if (size == 0) {
+		close();
+		return false;
+	}
+
+	// Grows the file if needed
+	const uint64_t mapping_size = (uint64_t)size;
+	mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READWRITE, (DWORD)(mapping_size >> 32), (DWORD)mapping_size, nullptr);
+	if (!mapping_handle) {
+		close();
+		return false;
+	}
+	data = (uint8_t*)MapViewOfFile(mapping_handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!data) {
+		close();
+		return false;
+	}
+	this->size = size;
+	return true;
+}
+
+bool MappedFile::open_read(const char *filename) {
+	file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		file_handle = nullptr;
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) {
+		close();
+		return false;
+	}
+	mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping_handle) {
+		close();
+		return false;
+	}
+	data = (uint8_t*)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		close();
+		return false;
+	}
+	size = (size_t)file_size.QuadPart;
+	return true;
+}
+
+bool MappedFile::flush(size_t offset, size_t size) {
+	return FlushViewOfFile(data + offset, size) && FlushFileBuffers(file_handle);
+}
+
+void MappedFile::close() {
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+	data = nullptr;
+	mapping_handle = file_handle = nullptr;
+	size = 0;
+}
+#else
+bool MappedFile::open(const char *filename, size_t size) {
+	fd = ::open(filename, O_RDWR|O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close();
+		return false;
+	}
+	if (size == 0)
+		size = (size_t)st.st_size;
+	if (size == 0 || ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) != 0)) {
+		close();
+		return false;
+	}
+
+	void *p = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close();
+		return false;
+	}
+	data = (uint8_t*)p;
+	this->size = size;
+	return true;
+}
+
+bool MappedFile::open_read(const char *filename) {
+	fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close();
+		return false;
+	}
+	void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close();
+		return false;
+	}
+	data = (uint8_t*)p;
+	size = (size_t)st.st_size;
+	return true;
+}
+
+bool MappedFile::flush(size_t offset, size_t size) {
+	// msync wants a page aligned address
+	const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t aligned_offset = offset - offset % page_size;
+	return msync(data + aligned_offset, size + (offset - aligned_offset), MS_SYNC) == 0;
+}
+
+void MappedFile::close() {
+	if (data)
+		munmap(data, size);
+	if (fd >= 0)
+		::close(fd);
+	data = nullptr;
+	fd = -1;
+	size = 0;
+}
+#endif
+
+bool file_exists(const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	fclose(f);
+	return true;
+}
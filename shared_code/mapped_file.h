@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	A file mapped into memory for reading and writing. Writes to data end up in the file.
+*/
+struct MappedFile {
+	~MappedFile();
+
+	// Opens the file, creating it if needed, and maps size bytes of it. The file grows if it is smaller than size.
+	// A size of 0 maps the whole existing file.
+	bool open(const char *filename, size_t size);
+
+	// Maps the whole existing file read only. Writing to data crashes.
+	bool open_read(const char *filename);
+
+	// Returns when the byte range has been written to disk
+	bool flush(size_t offset, size_t size);
+
+	void close();
+
+	uint8_t *data = nullptr;
+	size_t size = 0;
+
+private:
+#ifdef _WIN32
+	void *file_handle = nullptr;
+	void *mapping_handle = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+bool file_exists(const char *filename);
@@ -0,0 +1,134 @@
+#include "shared.h"
+
+/*
+	Samplers that hand out dimension indexed samples for the current (pixel, sample_index).
+
+	Sobol is the "shuffled and scrambled" Sobol sequence from Brent Burley, Practical Hash-based Owen Scrambling,
+	JCGT 2020. We only use the first two Sobol dimensions and pad them, so every pair of dimensions is a 2D Sobol
+	sequence with its own scramble and shuffle.
+*/
+
+namespace {
+	const float ONE_MINUS_EPSILON = 0.99999994f;
+
+	inline uint32_t reverse_bits(uint32_t x) {
+		x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+		x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+		x = ((x >> 4) & 0x0F0F0F0FU) | ((x & 0x0F0F0F0FU) << 4);
+		x = ((x >> 8) & 0x00FF00FFU) | ((x & 0x00FF00FFU) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+		x += seed;
+		x ^= x * 0x6c50b47cU;
+		x ^= x * 0xb82f1e52U;
+		x ^= x * 0xc7afe638U;
+		x ^= x * 0x8d22f6e6U;
+		return x;
+	}
+
+	inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+		return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+	}
+
+	// Generator matrix of Sobol dimension 1 (primitive polynomial x+1). Dimension 0 is bit reversal.
+	struct SobolMatrix {
+		uint32_t v[32];
+		SobolMatrix() {
+			v[0] = 1U << 31;
+			for (uint32_t i = 1; i < 32; i++)
+				v[i] = v[i-1] ^ (v[i-1] >> 1);
+		}
+	};
+	const SobolMatrix sobol_dimension1;
+
+	inline uint32_t sobol(uint32_t index, uint32_t dimension) {
+		if (dimension == 0)
+			return reverse_bits(index);
+		uint32_t r = 0;
+		for (uint32_t i = 0; index != 0; index >>= 1, i++) {
+			if (index & 1)
+				r ^= sobol_dimension1.v[i];
+		}
+		return r;
+	}
+
+	// Scrambled and shuffled 2D Sobol point for a pair of dimensions. Returns component 0 or 1.
+	inline float scrambled_sobol(uint32_t sample_index, uint32_t component, uint32_t seed) {
+		const uint32_t index = nested_uniform_scramble(sample_index, seed);
+		return uniform_from_bits(nested_uniform_scramble(sobol(index, component), hash32(seed + component + 1)));
+	}
+
+	const uint32_t primes[] = {
+		2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+		59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+	};
+	const uint32_t NUM_PRIMES = sizeof(primes)/sizeof(primes[0]);
+
+	inline float radical_inverse(uint32_t base, uint32_t index) {
+		const double inv_base = 1.0 / base;
+		double f = inv_base, r = 0.0;
+		while (index != 0) {
+			r += (index % base) * f;
+			index /= base;
+			f *= inv_base;
+		}
+		return (float)r;
+	}
+
+	inline float wrap(float v) {
+		if (v >= 1.0f)
+			v -= 1.0f;
+		return std::min(v, ONE_MINUS_EPSILON);
+	}
+
+	// Salted so it differs from the random_bits stream of sample 0
+	inline uint32_t pixel_seed(const RandomContext &random_context) {
+		return hash32(random_context.seed ^ hash32(random_context.x + hash32(random_context.y + 0x68E31DA4U)));
+	}
+}
+
+float sample1d(RandomContext &random_context) {
+	const uint32_t dimension = random_context.dimension++;
+
+	switch (random_context.sampler) {
+	case SAMPLER_SOBOL: {
+		const uint32_t seed = hash32(pixel_seed(random_context) + (dimension/2) * 0x9E3779B9U);
+		return scrambled_sobol(random_context.sample_index, dimension & 1, seed);
+	}
+	case SAMPLER_HALTON: {
+		if (dimension >= NUM_PRIMES)
+			break; // The higher bases are badly correlated anyway
+		const float offset = uniform_from_bits(hash32(pixel_seed(random_context) + dimension * 0x9E3779B9U));
+		return wrap(radical_inverse(primes[dimension], random_context.sample_index) + offset);
+	}
+	case SAMPLER_BLUE_NOISE: {
+		// Same sequence in all pixels...
+		const uint32_t seed = hash32(random_context.seed + (dimension/2) * 0x9E3779B9U);
+		const float v = scrambled_sobol(random_context.sample_index, dimension & 1, seed);
+
+		// ...offset by a dither mask so the error between neighbouring pixels is decorrelated. We use the R2 dither
+		// (http://extremelearning.com.au/unreasonable-effectiveness-of-quasirandom-sequences/) as a cheap stand-in
+		// for a blue noise texture, shifted by a different amount for each dimension.
+		const uint32_t shift = hash32(random_context.seed ^ hash32(dimension + 1));
+		const double px = random_context.x + (shift & 0xFFFF);
+		const double py = random_context.y + (shift >> 16);
+		const double dither = 0.5 + px * 0.7548776662466927 + py * 0.5698402909980532;
+		return wrap(v + (float)(dither - floor(dither)));
+	}
+	default:
+		break;
+	}
+	return uniform_from_bits(random_bits(random_context, dimension));
+}
+
+const char *sampler_name(SamplerType sampler) {
+	switch (sampler) {
+	case SAMPLER_RANDOM: return "random";
+	case SAMPLER_SOBOL: return "sobol";
+	case SAMPLER_HALTON: return "halton";
+	case SAMPLER_BLUE_NOISE: return "bluenoise";
+	default: return "unknown";
+	}
+}
@@ -0,0 +1,464 @@
+#include "scene_file.h"
+#include "image_io.h"
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+	// .ptscene layout: header, materials, meshes, vertices, indices. Sections start at offsets aligned to
+	// SECTION_ALIGNMENT and there is always room after the vertices to read 16 bytes from the last one.
+	struct SceneFileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t num_materials, num_meshes;
+		uint32_t num_vertices, num_triangles;
+		uint64_t materials_offset, meshes_offset, vertices_offset, indices_offset;
+		uint64_t file_size;
+	};
+
+	const uint32_t SCENE_FILE_MAGIC = 0x43535450; // PTSC
+	const uint32_t SCENE_FILE_VERSION = 1;
+	const uint64_t SECTION_ALIGNMENT = 64;
+
+	inline uint64_t align(uint64_t v) {
+		return (v + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+	}
+
+	SceneFileHeader binary_layout(uint32_t num_materials, uint32_t num_meshes, uint32_t num_vertices, uint32_t num_triangles) {
+		SceneFileHeader h;
+		memset(&h, 0, sizeof(h));
+		h.magic = SCENE_FILE_MAGIC;
+		h.version = SCENE_FILE_VERSION;
+		h.num_materials = num_materials;
+		h.num_meshes = num_meshes;
+		h.num_vertices = num_vertices;
+		h.num_triangles = num_triangles;
+		h.materials_offset = align(sizeof(SceneFileHeader));
+		h.meshes_offset    = align(h.materials_offset + sizeof(SceneFileMaterial) * (uint64_t)num_materials);
+		h.vertices_offset  = align(h.meshes_offset    + sizeof(SceneFileMesh) * (uint64_t)num_meshes);
+		h.indices_offset   = align(h.vertices_offset  + sizeof(Float3) * (uint64_t)num_vertices + 16);
+		h.file_size        = h.indices_offset + 3 * sizeof(uint32_t) * (uint64_t)num_triangles;
+		return h;
+	}
+
+	// Calls func(i) for i in [0, count) on num_threads threads
+	template<typename FUNC>
+	void parallel_for(uint32_t num_threads, uint32_t count, FUNC func) {
+		std::atomic<uint32_t> next(0);
+		auto thread_func = [&]() {
+			for (uint32_t i = next++; i < count; i = next++)
+				func(i);
+		};
+		std::vector<std::thread> threads;
+		for (uint32_t i = 1; i < std::min(num_threads, count); i++)
+			threads.push_back(std::thread(thread_func));
+		thread_func();
+		for (auto &t : threads)
+			t.join();
+	}
+
+	void compute_bounds(SceneFile &scene) {
+		scene.bounds_min = float3( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+		scene.bounds_max = float3(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+		for (uint32_t i = 0; i < scene.num_vertices; i++) {
+			const Float3 v = scene.vertices[i];
+			scene.bounds_min = float3(std::min(scene.bounds_min.x, v.x), std::min(scene.bounds_min.y, v.y), std::min(scene.bounds_min.z, v.z));
+			scene.bounds_max = float3(std::max(scene.bounds_max.x, v.x), std::max(scene.bounds_max.y, v.y), std::max(scene.bounds_max.z, v.z));
+		}
+	}
+
+	bool load_scene_binary(const char *filename, SceneFile &out_scene) {
+		if (!out_scene.file.open_read(filename))
+			return false;
+		const uint8_t *data = out_scene.file.data;
+		const uint64_t size = out_scene.file.size;
+
+		if (size < sizeof(SceneFileHeader)) {
+			printf("'%s' is not a scene file\n", filename);
+			return false;
+		}
+		const SceneFileHeader &h = *(const SceneFileHeader*)data;
+		if (h.magic != SCENE_FILE_MAGIC || h.version != SCENE_FILE_VERSION) {
+			printf("'%s' is not a scene file of version %d\n", filename, SCENE_FILE_VERSION);
+			return false;
+		}
+		const SceneFileHeader expected = binary_layout(h.num_materials, h.num_meshes, h.num_vertices, h.num_triangles);
+		if (memcmp(&h, &expected, sizeof(SceneFileHeader)) != 0 || size != h.file_size) {
+			printf("Scene file '%s' is damaged\n", filename);
+			return false;
+		}
+
+		const SceneFileMaterial *materials = (const SceneFileMaterial*)(data + h.materials_offset);
+		const SceneFileMesh *meshes = (const SceneFileMesh*)(data + h.meshes_offset);
+		out_scene.materials.resize(h.num_materials);
+		for (uint32_t i = 0; i < h.num_materials; i++)
+			out_scene.materials[i] = materials[i];
+		out_scene.meshes.resize(h.num_meshes);
+		for (uint32_t i = 0; i < h.num_meshes; i++) {
+			const SceneFileMesh &mesh = meshes[i];
+			if (mesh.material >= h.num_materials || mesh.first_triangle > h.num_triangles || mesh.num_triangles > h.num_triangles - mesh.first_triangle) {
+				printf("Scene file '%s' has an invalid mesh\n", filename);
+				return false;
+			}
+			out_scene.meshes[i] = mesh;
+		}
+
+		// No copies, this is what the intersector gets
+		out_scene.vertices = (const Float3*)(data + h.vertices_offset);
+		out_scene.indices = (const uint32_t*)(data + h.indices_offset);
+		out_scene.num_vertices = h.num_vertices;
+		out_scene.num_triangles = h.num_triangles;
+
+		// Out of range indices would have the intersector read anywhere
+		for (uint32_t i = 0; i < 3 * h.num_triangles; i++) {
+			if (out_scene.indices[i] >= h.num_vertices) {
+				printf("Scene file '%s' has an invalid vertex index\n", filename);
+				return false;
+			}
+		}
+		compute_bounds(out_scene);
+		return true;
+	}
+
+	/*
+		.obj parsing. The file is split into chunks at line breaks, and the chunks are parsed in parallel. Faces refer
+		to vertices by a global index or relative to the last vertex, and to the material by the last usemtl before
+		them. Both depend on what came before in the file, so they are resolved after all chunks are parsed.
+	*/
+
+	const uint32_t INHERIT_MATERIAL = 0xFFFFFFFF; // Material of the last face of the chunks before
+
+	struct ObjTriangle {
+		int64_t v[3]; // Zero based. Relative to the first vertex of the chunk if the bit in relative is set.
+		uint32_t material; // Index into ObjChunk::material_names or INHERIT_MATERIAL
+		uint32_t relative;
+	};
+
+	struct ObjChunk {
+		const char *begin, *end;
+		std::vector<Float3> vertices;
+		std::vector<ObjTriangle> triangles;
+		std::vector<std::string> material_names; // From usemtl
+		std::string mtllib;
+		std::string error;
+
+		// Filled in when resolving
+		uint64_t first_vertex = 0;
+		std::vector<uint32_t> triangle_material; // Global material index per triangle
+	};
+
+	inline bool is_space(char c) {
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	inline void skip_spaces(const char *&p, const char *end) {
+		while (p < end && is_space(*p))
+			p++;
+	}
+
+	// The rest of the line without surrounding spaces
+	inline std::string rest_of_line(const char *p, const char *end) {
+		skip_spaces(p, end);
+		const char *e = p;
+		while (e < end && *e != '\n')
+			e++;
+		while (e > p && is_space(e[-1]))
+			e--;
+		return std::string(p, e);
+	}
+
+	// strtod wants a terminated string, which a mapped file is not
+	bool parse_float(const char *&p, const char *end, float &out) {
+		skip_spaces(p, end);
+		const char *start = p;
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+		double v = 0.0;
+		while (p < end && *p >= '0' && *p <= '9')
+			v = v * 10.0 + (*p++ - '0');
+		if (p < end && *p == '.') {
+			p++;
+			double scale = 0.1;
+			while (p < end && *p >= '0' && *p <= '9') {
+				v += (*p++ - '0') * scale;
+				scale *= 0.1;
+			}
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			p++;
+			bool negative_exponent = false;
+			if (p < end && (*p == '-' || *p == '+'))
+				negative_exponent = *p++ == '-';
+			int exponent = 0;
+			while (p < end && *p >= '0' && *p <= '9')
+				exponent = std::min(exponent * 10 + (*p++ - '0'), 1000);
+			v *= pow(10.0, negative_exponent ? -exponent : exponent);
+		}
+		out = (float)(negative ? -v : v);
+		return p != start;
+	}
+
+	bool parse_int(const char *&p, const char *end, int64_t &out) {
+		const char *start = p;
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+		int64_t v = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+			v = std::min(v * 10 + (*p++ - '0'), (int64_t)1 << 40);
+		out = negative ? -v : v;
+		return p != start;
+	}
+
+	void parse_obj_chunk(ObjChunk &chunk) {
+		uint32_t material = INHERIT_MATERIAL;
+		std::vector<int64_t> face;
+		std::vector<bool> face_relative;
+
+		for (const char *p = chunk.begin, *line_end; p < chunk.end; p = line_end + 1) {
+			line_end = p;
+			while (line_end < chunk.end && *line_end != '\n')
+				line_end++;
+			skip_spaces(p, line_end);
+
+			if (line_end - p >= 2 && p[0] == 'v' && is_space(p[1])) {
+				p += 2;
+				Float3 v;
+				if (!parse_float(p, line_end, v.x) || !parse_float(p, line_end, v.y) || !parse_float(p, line_end, v.z)) {
+					chunk.error = "invalid vertex";
+					return;
+				}
+				chunk.vertices.push_back(v);
+			} else if (line_end - p >= 2 && p[0] == 'f' && is_space(p[1])) {
+				p += 2;
+				face.clear();
+				face_relative.clear();
+				for (;;) {
+					skip_spaces(p, line_end);
+					if (p == line_end)
+						break;
+					int64_t index = 0;
+					if (!parse_int(p, line_end, index) || index == 0) {
+						chunk.error = "invalid face";
+						return;
+					}
+					// Negative indices count back from the last vertex so far
+					face_relative.push_back(index < 0);
+					face.push_back(index < 0 ? (int64_t)chunk.vertices.size() + index : index - 1);
+					while (p < line_end && !is_space(*p)) // Skip texture coordinate and normal indices
+						p++;
+				}
+				if (face.size() < 3) {
+					chunk.error = "face with less than three vertices";
+					return;
+				}
+				// Polygons become triangle fans
+				for (size_t i = 2; i < face.size(); i++) {
+					ObjTriangle t;
+					t.v[0] = face[0];
+					t.v[1] = face[i-1];
+					t.v[2] = face[i];
+					t.relative = (face_relative[0] ? 1 : 0) | (face_relative[i-1] ? 2 : 0) | (face_relative[i] ? 4 : 0);
+					t.material = material;
+					chunk.triangles.push_back(t);
+				}
+			} else if (line_end - p >= 7 && strncmp(p, "usemtl", 6) == 0 && is_space(p[6])) {
+				material = (uint32_t)chunk.material_names.size();
+				chunk.material_names.push_back(rest_of_line(p + 6, line_end));
+			} else if (line_end - p >= 7 && strncmp(p, "mtllib", 6) == 0 && is_space(p[6])) {
+				if (chunk.mtllib.empty())
+					chunk.mtllib = rest_of_line(p + 6, line_end);
+			}
+			// Everything else (normals, texture coordinates, groups, comments) is ignored
+		}
+	}
+
+	// Diffuse and emissive colors of the materials in a .mtl file
+	bool load_mtl(const char *filename, std::unordered_map<std::string, uint32_t> &material_index, SceneFile &out_scene) {
+		FILE *f = fopen(filename, "rb");
+		if (!f)
+			return false;
+		char line[1024];
+		uint32_t current = INHERIT_MATERIAL;
+		while (fgets(line, sizeof(line), f)) {
+			const char *p = line, *end = line + strlen(line);
+			skip_spaces(p, end);
+			if (strncmp(p, "newmtl", 6) == 0 && is_space(p[6])) {
+				const std::string name = rest_of_line(p + 6, end);
+				current = out_scene.materials.size();
+				out_scene.materials.push_back(SceneFileMaterial{float3(0.8f, 0.8f, 0.8f), float3(0, 0, 0)});
+				material_index[name] = current;
+			} else if (current != INHERIT_MATERIAL && (strncmp(p, "Kd", 2) == 0 || strncmp(p, "Ke", 2) == 0) && is_space(p[2])) {
+				Float3 &c = p[1] == 'd' ? out_scene.materials[current].diffuse : out_scene.materials[current].emissive;
+				p += 2;
+				parse_float(p, end, c.x);
+				parse_float(p, end, c.y);
+				parse_float(p, end, c.z);
+			}
+		}
+		fclose(f);
+		return true;
+	}
+
+	bool load_obj(const char *filename, uint32_t num_threads, SceneFile &out_scene) {
+		MappedFile file;
+		if (!file.open_read(filename))
+			return false;
+		const char *data = (const char*)file.data;
+		const char *data_end = data + file.size;
+
+		// A few chunks per thread to even out the work, each at least a few MB
+		const size_t MIN_CHUNK_SIZE = 4 << 20;
+		const size_t num_chunks = std::max(std::min((size_t)num_threads * 4, file.size / MIN_CHUNK_SIZE), (size_t)1);
+		std::vector<ObjChunk> chunks(num_chunks);
+		const char *p = data;
+		for (size_t i = 0; i < num_chunks; i++) {
+			const char *end = i+1 == num_chunks ? data_end : data + file.size * (i+1) / num_chunks;
+			while (end < data_end && end[-1] != '\n')
+				end++;
+			chunks[i].begin = p;
+			chunks[i].end = std::max(end, p);
+			p = chunks[i].end;
+		}
+		parallel_for(num_threads, (uint32_t)num_chunks, [&](uint32_t i) { parse_obj_chunk(chunks[i]); });
+
+		for (const ObjChunk &chunk : chunks) {
+			if (!chunk.error.empty()) {
+				printf("'%s': %s\n", filename, chunk.error.c_str());
+				return false;
+			}
+		}
+
+		// Material 0 is for faces without a known usemtl
+		std::unordered_map<std::string, uint32_t> material_index;
+		out_scene.materials.push_back(SceneFileMaterial{float3(0.8f, 0.8f, 0.8f), float3(0, 0, 0)});
+		for (const ObjChunk &chunk : chunks) {
+			if (chunk.mtllib.empty())
+				continue;
+			const std::string obj = filename;
+			const size_t slash = obj.find_last_of("/\\");
+			const std::string mtl = (slash == std::string::npos ? std::string() : obj.substr(0, slash+1)) + chunk.mtllib;
+			if (!load_mtl(mtl.c_str(), material_index, out_scene))
+				printf("Could not read '%s', using the default material\n", mtl.c_str());
+			break;
+		}
+
+		// Resolve vertex indices and materials in file order and count the triangles of each material
+		uint64_t num_vertices = 0, num_triangles = 0;
+		uint32_t material = 0;
+		std::vector<uint64_t> material_triangles(out_scene.materials.size(), 0);
+		for (ObjChunk &chunk : chunks) {
+			chunk.first_vertex = num_vertices;
+			num_vertices += chunk.vertices.size();
+			num_triangles += chunk.triangles.size();
+
+			std::vector<uint32_t> names(chunk.material_names.size());
+			for (size_t i = 0; i < names.size(); i++) {
+				auto it = material_index.find(chunk.material_names[i]);
+				names[i] = it != material_index.end() ? it->second : 0;
+			}
+			chunk.triangle_material.resize(chunk.triangles.size());
+			for (size_t i = 0; i < chunk.triangles.size(); i++) {
+				if (chunk.triangles[i].material != INHERIT_MATERIAL)
+					material = names[chunk.triangles[i].material];
+				chunk.triangle_material[i] = material;
+				material_triangles[material]++;
+			}
+		}
+		if (num_vertices > 0xFFFFFFFFu || num_triangles > 0xFFFFFFFFu / 3) {
+			printf("'%s' is too big\n", filename);
+			return false;
+		}
+
+		// One mesh per material with triangles
+		std::vector<uint64_t> material_first(out_scene.materials.size(), 0);
+		for (uint32_t m = 0, first = 0; m < out_scene.materials.size(); m++) {
+			material_first[m] = first;
+			if (material_triangles[m] != 0)
+				out_scene.meshes.push_back(SceneFileMesh{m, first, (uint32_t)material_triangles[m]});
+			first += (uint32_t)material_triangles[m];
+		}
+
+		// Where each chunk writes the triangles of each material
+		std::vector<std::vector<uint64_t>> chunk_material_first(num_chunks);
+		for (size_t c = 0; c < num_chunks; c++) {
+			chunk_material_first[c] = material_first;
+			for (uint32_t m : chunks[c].triangle_material)
+				material_first[m]++;
+		}
+
+		out_scene.vertex_storage.resize(num_vertices + 1); // One extra so the last vertex can be read as 16 bytes
+		out_scene.index_storage.resize(3 * num_triangles);
+		std::atomic<bool> invalid_index(false);
+		parallel_for(num_threads, (uint32_t)num_chunks, [&](uint32_t c) {
+			ObjChunk &chunk = chunks[c];
+			if (!chunk.vertices.empty())
+				memcpy(&out_scene.vertex_storage[chunk.first_vertex], &chunk.vertices[0], sizeof(Float3) * chunk.vertices.size());
+			std::vector<uint64_t> &next = chunk_material_first[c];
+			for (size_t i = 0; i < chunk.triangles.size(); i++) {
+				const ObjTriangle &t = chunk.triangles[i];
+				uint32_t *out = &out_scene.index_storage[3 * next[chunk.triangle_material[i]]++];
+				for (uint32_t k = 0; k < 3; k++) {
+					const int64_t v = (t.relative & (1 << k)) ? (int64_t)chunk.first_vertex + t.v[k] : t.v[k];
+					if (v < 0 || v >= (int64_t)num_vertices) {
+						invalid_index = true;
+						out[k] = 0;
+					} else {
+						out[k] = (uint32_t)v;
+					}
+				}
+			}
+			chunk.vertices = std::vector<Float3>();
+			chunk.triangles = std::vector<ObjTriangle>();
+		});
+		if (invalid_index) {
+			printf("'%s' has faces with invalid vertex indices\n", filename);
+			return false;
+		}
+
+		out_scene.vertices = &out_scene.vertex_storage[0];
+		out_scene.indices = num_triangles ? &out_scene.index_storage[0] : nullptr;
+		out_scene.num_vertices = (uint32_t)num_vertices;
+		out_scene.num_triangles = (uint32_t)num_triangles;
+		compute_bounds(out_scene);
+		return true;
+	}
+}
+
+bool load_scene_file(const char *filename, uint32_t num_threads, SceneFile &out_scene) {
+	const bool ok = has_extension(filename, ".obj") ? load_obj(filename, num_threads, out_scene) : load_scene_binary(filename, out_scene);
+	if (ok && out_scene.num_triangles == 0) {
+		printf("'%s' has no triangles\n", filename);
+		return false;
+	}
+	return ok;
+}
+
+bool write_scene_binary(const char *filename, const SceneFile &scene) {
+	const SceneFileHeader h = binary_layout(scene.materials.size(), scene.meshes.size(), scene.num_vertices, scene.num_triangles);
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	// The gaps between the sections are zeroes
+	std::vector<uint8_t> bytes((size_t)h.vertices_offset, 0);
+	memcpy(&bytes[0], &h, sizeof(h));
+	for (uint32_t i = 0; i < h.num_materials; i++)
+		memcpy(&bytes[(size_t)h.materials_offset + i * sizeof(SceneFileMaterial)], &scene.materials[i], sizeof(SceneFileMaterial));
+	for (uint32_t i = 0; i < h.num_meshes; i++)
+		memcpy(&bytes[(size_t)h.meshes_offset + i * sizeof(SceneFileMesh)], &scene.meshes[i], sizeof(SceneFileMesh));
+	bool ok = fwrite(&bytes[0], 1, bytes.size(), f) == bytes.size();
+
+	const size_t vertex_bytes = sizeof(Float3) * (size_t)h.num_vertices;
+	ok = ok && fwrite(scene.vertices, 1, vertex_bytes, f) == vertex_bytes;
+	bytes.assign((size_t)(h.indices_offset - h.vertices_offset - vertex_bytes), 0);
+	ok = ok && fwrite(&bytes[0], 1, bytes.size(), f) == bytes.size();
+
+	const size_t index_bytes = 3 * sizeof(uint32_t) * (size_t)h.num_triangles;
+	ok = ok && fwrite(scene.indices, 1, index_bytes, f) == index_bytes;
+	return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "shared.h"
+#include "mapped_file.h"
+#include <vector>
+
+/*
+	Triangle meshes from a scene file (-scene). Wavefront .obj files, with diffuse (Kd) and emissive (Ke) colors from
+	their .mtl, are parsed on all threads. Big scenes are better kept in our own binary format (.ptscene, see
+	-write_scene). That one is memory mapped and the vertex and index arrays are used straight from the file.
+
+	All meshes share one vertex array. A mesh is a range of triangles with the same material.
+*/
+
+struct SceneFileMaterial {
+	Float3 diffuse, emissive;
+};
+
+struct SceneFileMesh {
+	uint32_t material;
+	uint32_t first_triangle, num_triangles;
+};
+
+struct SceneFile {
+	const Float3 *vertices = nullptr; // Can be read 16 bytes past the last vertex, which Embree wants
+	const uint32_t *indices = nullptr; // Three per triangle
+	uint32_t num_vertices = 0, num_triangles = 0;
+	Float3 bounds_min, bounds_max;
+	Array<SceneFileMaterial> materials;
+	Array<SceneFileMesh> meshes;
+
+	// What vertices and indices point into
+	MappedFile file;
+	std::vector<Float3> vertex_storage;
+	std::vector<uint32_t> index_storage;
+};
+
+// Loads a .obj or a .ptscene depending on the extension
+bool load_scene_file(const char *filename, uint32_t num_threads, SceneFile &out_scene);
+
+bool write_scene_binary(const char *filename, const SceneFile &scene);
@@ -0,0 +1,148 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <assert.h>
+
+namespace {
+	// https://en.wikipedia.org/wiki/Hilbert_curve
+	void hilbert_d2xy(uint32_t n, uint32_t d, uint32_t &x, uint32_t &y) {
+		x = y = 0;
+		for (uint32_t s = 1, t = d; s < n; s *= 2, t /= 4) {
+			const uint32_t rx = 1 & (t/2);
+			const uint32_t ry = 1 & (t ^ rx);
+			if (ry == 0) {
+				if (rx == 1) {
+					x = s-1-x;
+					y = s-1-y;
+				}
+				std::swap(x, y);
+			}
+			x += s*rx;
+			y += s*ry;
+		}
+	}
+
+	void morton_d2xy(uint32_t d, uint32_t &x, uint32_t &y) {
+		x = y = 0;
+		for (uint32_t b = 0; b < 16; b++) {
+			x |= ((d >> (2*b  )) & 1) << b;
+			y |= ((d >> (2*b+1)) & 1) << b;
+		}
+	}
+}
+
+std::vector<uint32_t> tile_order(uint32_t num_tiles_x, uint32_t num_tiles_y, TileOrder order) {
+	std::vector<uint32_t> tiles;
+	tiles.reserve(num_tiles_x * num_tiles_y);
+
+	if (order == TILE_ORDER_ROW) {
+		for (uint32_t i = 0; i < num_tiles_x * num_tiles_y; i++)
+			tiles.push_back(i);
+		return tiles;
+	}
+
+	// Walk the curve over the smallest power of two square covering all tiles and skip what is outside
+	uint32_t n = 1;
+	while (n < num_tiles_x || n < num_tiles_y)
+		n *= 2;
+
+	for (uint32_t d = 0; d < n*n; d++) {
+		uint32_t x, y;
+		if (order == TILE_ORDER_HILBERT)
+			hilbert_d2xy(n, d, x, y);
+		else
+			morton_d2xy(d, x, y);
+		if (x < num_tiles_x && y < num_tiles_y)
+			tiles.push_back(y * num_tiles_x + x);
+	}
+	assert(tiles.size() == num_tiles_x * num_tiles_y);
+	return tiles;
+}
+
+TileScheduler::TileScheduler(uint32_t num_threads) : queues(num_threads), num_outstanding(0) {
+}
+
+void TileScheduler::add_initial_tasks(const std::vector<TileTask> &tasks) {
+	const uint32_t num_threads = (uint32_t)queues.size();
+	const size_t num_tasks = tasks.size();
+	for (uint32_t t = 0; t < num_threads; t++) {
+		const size_t begin = num_tasks * t / num_threads;
+		const size_t end = num_tasks * (t+1) / num_threads;
+		queues[t].tasks.insert(queues[t].tasks.end(), tasks.begin() + begin, tasks.begin() + end);
+	}
+	num_outstanding += (uint32_t)num_tasks;
+}
+
+void TileScheduler::set_thread_nodes(const std::vector<uint32_t> &thread_nodes) {
+	assert(thread_nodes.size() == queues.size());
+	nodes = thread_nodes;
+}
+
+std::vector<TileTask> TileScheduler::queued_tasks(uint32_t thread_index) {
+	Queue &queue = queues[thread_index];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	return std::vector<TileTask>(queue.tasks.begin(), queue.tasks.end());
+}
+
+bool TileScheduler::pop(uint32_t thread_index, TileTask &out_task) {
+	Queue &queue = queues[thread_index];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty())
+		return false;
+	out_task = queue.tasks.front();
+	queue.tasks.pop_front();
+	return true;
+}
+
+bool TileScheduler::steal(uint32_t thread_index, TileTask &out_task) {
+	const uint32_t num_threads = (uint32_t)queues.size();
+	// The first round only looks at threads on the same node, the second at the rest
+	const uint32_t num_rounds = nodes.empty() ? 1 : 2;
+	for (uint32_t round = 0; round < num_rounds; round++) {
+		for (uint32_t i = 1; i < num_threads; i++) {
+			const uint32_t victim_index = (thread_index + i) % num_threads;
+			if (!nodes.empty() && (nodes[victim_index] == nodes[thread_index]) != (round == 0))
+				continue;
+			Queue &victim = queues[victim_index];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.tasks.empty())
+				continue;
+			out_task = victim.tasks.back();
+			victim.tasks.pop_back();
+			queues[thread_index].num_steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool TileScheduler::next(uint32_t thread_index, TileTask &out_task) {
+	if (pop(thread_index, out_task) || steal(thread_index, out_task))
+		return true;
+
+	// Out of work. Other threads might still push passes of tiles they are working on, so wait for that.
+	const auto idle_start = std::chrono::high_resolution_clock::now();
+	bool found = false;
+	while (num_outstanding.load() != 0) {
+		if (pop(thread_index, out_task) || steal(thread_index, out_task)) {
+			found = true;
+			break;
+		}
+		std::this_thread::yield();
+	}
+	queues[thread_index].idle_seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - idle_start).count();
+	return found;
+}
+
+void TileScheduler::push(uint32_t thread_index, const TileTask &task) {
+	num_outstanding++;
+	Queue &queue = queues[thread_index];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	queue.tasks.push_back(task);
+}
+
+void TileScheduler::complete() {
+	assert(num_outstanding.load() != 0);
+	num_outstanding--;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+/*
+	Hands out tiles to the render threads.
+
+	Each thread has its own queue of tasks. A thread takes tasks from the front of its own queue and when that is
+	empty it steals from the back of the queues of other threads. Each thread starts out with a contiguous range of
+	tiles along the tile order so that neighbouring tiles (and the parts of the scene they see) are rendered by the
+	same thread.
+
+	A task is one pass over a tile. Passes of the same tile can be rendered by different threads at the same time and
+	are merged afterwards. In adaptive mode a pass depends on the ones before it, so the next pass of a tile is pushed
+	when the previous one is done.
+
+	When the threads are pinned to NUMA nodes, a thread out of work steals from threads on its own node first.
+*/
+
+struct TileTask {
+	uint32_t tile;
+	uint32_t pass;
+};
+
+enum TileOrder {
+	TILE_ORDER_ROW,
+	TILE_ORDER_MORTON,
+	TILE_ORDER_HILBERT,
+};
+
+// Returns all tile indices (y*num_tiles_x+x) in the given order
+std::vector<uint32_t> tile_order(uint32_t num_tiles_x, uint32_t num_tiles_y, TileOrder order);
+
+struct TileScheduler {
+	TileScheduler(uint32_t num_threads);
+
+	// Deals out tasks in order so that each thread gets a contiguous range. Call before starting the threads.
+	void add_initial_tasks(const std::vector<TileTask> &tasks);
+
+	// The NUMA node of each thread, for stealing. Call before starting the threads.
+	void set_thread_nodes(const std::vector<uint32_t> &thread_nodes);
+
+	// Copy of the tasks in the queue of a thread
+	std::vector<TileTask> queued_tasks(uint32_t thread_index);
+
+	// Returns false when there is no more work. Waits if other threads might still push tasks.
+	bool next(uint32_t thread_index, TileTask &out_task);
+
+	// Push a task that follows the one currently being worked on. Call before complete().
+	void push(uint32_t thread_index, const TileTask &task);
+
+	// Call when done with the task returned from next()
+	void complete();
+
+	double idle_seconds(uint32_t thread_index) const { return queues[thread_index].idle_seconds; }
+	uint32_t num_steals(uint32_t thread_index) const { return queues[thread_index].num_steals; }
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<TileTask> tasks;
+		double idle_seconds = 0.0; // Time spent waiting for work, only touched by the owning thread
+		uint32_t num_steals = 0;
+	};
+
+	bool pop(uint32_t thread_index, TileTask &out_task);
+	bool steal(uint32_t thread_index, TileTask &out_task);
+
+	std::vector<Queue> queues;
+	std::vector<uint32_t> nodes; // Per thread, empty if not pinned
+	std::atomic<uint32_t> num_outstanding; // Tasks queued or being worked on
+};
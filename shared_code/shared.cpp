@@ -1,41 +1,130 @@
 #include "shared.h"
+#if PATHTRACER_EMBREE
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_scene.h>
 #include <embree2/rtcore_geometry.h>
 #include <embree2/rtcore_ray.h>
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#else
+#include "bvh.h"
+#endif
+#include "scheduler.h"
+#include "image_io.h"
+#include "tonemap.h"
+#include "checkpoint.h"
+#include "framebuffer.h"
+#include "scene_file.h"
+#include "stats.h"
+#include "topology.h"
+#include "worker_pool.h"
 #include <algorithm>
 #include <vector>
 #include <assert.h>
+#include <limits>
 #include <atomic>
 #include <thread>
+#include <chrono>
+#include <string>
+#include <memory>
+#include <random> // Only for comparing against in rng_benchmark
 
 /*
 	TODO:
-	* Find good tile size
-	* Make random numbers stable? Perhaps that means settings a seed per tile so number of threads doesnt interfere
 	* Replace tonemapper. Add exposure control to command line.
 
 	NOTE:
 	* Anything in this file as a hack to support the post code. It might be cleaned up over the course of the posts!
 */
 
-#define TILESIZE 16
-
 namespace {
-	struct Material {
-		Float3 diffuse, emissive;
+	struct LightTriangle {
+		Float3 v0, v1, v2;
+		Float3 emissive;
 	};
 }
 
 struct Scene {
+#if PATHTRACER_EMBREE
+	RTCDevice embree_device;
 	RTCScene embree_scene;
-	Array<uint32_t> instance_material;
-	Array<Material> materials;
+	Array<RTCScene> embree_prototypes;
+	Array<Transform> object_from_world; // Per top level id. Embree gives the normals of instances in prototype space.
+#else
+	Bvh bvh; // Meshes
+	BvhTopLevel top_level; // Instances
+#endif
+	Array<uint32_t> instance_material; // Per top level id. Meshes (geom_id) and instances (inst_id) share the ids.
+	uint32_t cube_prototype = 0; // All cubes of the built-in scene are instances of this one
+	MaterialTable materials;
+	SceneFile file; // From -scene. Embree uses its vertex and index arrays as they are, so it has to outlive the scene.
+
+	Array<LightTriangle> lights;
+	Array<float> light_cdf; // Normalized running sum of the light weights
+	float light_weight_total = 0.0f;
+	bool light_power = false; // Lights weighted by power instead of area
 };
 
+namespace {
+	// Number of rays traced by this thread, used for reporting throughput
+	thread_local uint64_t thread_ray_count = 0; // Cleared when a render thread starts on an image
+
+	// The render threads of all render_image calls
+	WorkerPool &render_threads() {
+		static WorkerPool pool;
+		return pool;
+	}
+
+	WavefrontFunction wavefront_function = nullptr;
+
+	const uint32_t NO_INSTANCE = 0xFFFFFFFF; // Same as RTC_INVALID_GEOMETRY_ID and BVH_NO_INSTANCE
+
+	// Ng does not need to be normalized, pack_normal takes care of that
+	inline void fill_hit(const Scene &scene, const Float3 dir, float t, uint32_t geom_id, uint32_t prim_id, uint32_t inst_id, Float3 Ng, Hit &out_hit) {
+		const uint32_t id = inst_id != NO_INSTANCE ? inst_id : geom_id;
+#if PATHTRACER_EMBREE
+		if (inst_id != NO_INSTANCE)
+			Ng = transform_normal(scene.object_from_world[inst_id], Ng);
+#endif
+		if (dot(dir,Ng)>0.0f)
+			Ng = -Ng;
+
+		STAT_INC(STAT_CLOSEST_HITS);
+		out_hit.t = t;
+		out_hit.material = scene.instance_material[id];
+		out_hit.prim_id = prim_id;
+		out_hit.normal = pack_normal(Ng);
+	}
+
+	inline void expand_hit(const Scene &scene, const Float3 pos, const Float3 dir, const Hit &hit, IntersectResult &out_result) {
+		out_result.diffuse = scene.materials.diffuse(hit.material);
+		out_result.emissive = scene.materials.emissive(hit.material);
+		out_result.pos = hit_position(pos, dir, hit);
+		out_result.face_normal = hit_normal(hit);
+	}
+}
+
+const MaterialTable &scene_materials(const Scene &scene) {
+	return scene.materials;
+}
+
 bool intersect_closest(const Scene &scene, const Float3 pos, const Float3 dir, IntersectResult &out_result) {
+	Hit hit;
+	if (!intersect_closest(scene, pos, dir, hit))
+		return false;
+	expand_hit(scene, pos, dir, hit, out_result);
+	return true;
+}
+
+bool register_wavefront(WavefrontFunction function) {
+	wavefront_function = function;
+	return true;
+}
+
+#if PATHTRACER_EMBREE
+bool intersect_closest(const Scene &scene, const Float3 pos, const Float3 dir, Hit &out_hit) {
+	STAT_SCOPED_TIMER(STAT_TIMER_INTERSECT);
+	STAT_INC(STAT_CLOSEST_RAYS);
+	thread_ray_count++;
+
 	RTCRay ray;
 	ray.org[0] = pos.x;
 	ray.org[1] = pos.y;
@@ -44,7 +133,7 @@ bool intersect_closest(const Scene &scene, const Float3 pos, const Float3 dir, I
 	ray.dir[1] = dir.y;
 	ray.dir[2] = dir.z;
 	ray.time = 0.0f;
-	ray.tnear = 1E-5f;//0.0f;
+	ray.tnear = 0.0f; // Ray origins are moved off surfaces instead, see offset_ray_origin
 	ray.mask = 0;
 	ray.tfar = std::numeric_limits<float>::max();
 	ray.instID = RTC_INVALID_GEOMETRY_ID;
@@ -55,101 +144,591 @@ bool intersect_closest(const Scene &scene, const Float3 pos, const Float3 dir, I
 	if (ray.geomID == RTC_INVALID_GEOMETRY_ID)
 		return false;
 
-	const Material &m = scene.materials[scene.instance_material[ray.geomID]];
-	out_result.diffuse = m.diffuse;
-	out_result.emissive = m.emissive;
-	out_result.pos = pos + dir * ray.tfar;
-	Float3 fn = normalized(float3(ray.Ng[0], ray.Ng[1], ray.Ng[2]));
-	if (dot(dir,fn)>0.0f)
-		fn = -fn;
+	fill_hit(scene, dir, ray.tfar, ray.geomID, ray.primID, ray.instID, float3(ray.Ng[0], ray.Ng[1], ray.Ng[2]), out_hit);
+	return true;
+}
+
+bool occluded(const Scene &scene, const Float3 pos, const Float3 dir, float tmax) {
+	STAT_SCOPED_TIMER(STAT_TIMER_INTERSECT);
+	STAT_INC(STAT_OCCLUSION_RAYS);
+	thread_ray_count++;
+
+	RTCRay ray;
+	ray.org[0] = pos.x;
+	ray.org[1] = pos.y;
+	ray.org[2] = pos.z;
+	ray.dir[0] = dir.x;
+	ray.dir[1] = dir.y;
+	ray.dir[2] = dir.z;
+	ray.time = 0.0f;
+	ray.tnear = 0.0f;
+	ray.mask = 0xFFFFFFFF;
+	ray.tfar = tmax;
+	ray.instID = RTC_INVALID_GEOMETRY_ID;
+	ray.geomID = RTC_INVALID_GEOMETRY_ID;
+	ray.primID = RTC_INVALID_GEOMETRY_ID;
+	rtcOccluded(scene.embree_scene, ray);
+
+	// Embree sets geomID to 0 when the ray is occluded
+	STAT_ADD(STAT_OCCLUDED, ray.geomID == 0);
+	return ray.geomID == 0;
+}
+
+void intersect_closest_packet(const Scene &scene, const Float3 pos, const Float3 *dirs, uint32_t count, bool *out_hit, Hit *out_hits) {
+	static_assert(PACKET_SIZE == 8, "Packet size must match RTCRay8");
+	assert(count != 0 && count <= PACKET_SIZE);
+	STAT_ADD(STAT_CLOSEST_RAYS, count);
+	thread_ray_count += count;
+
+	RTCORE_ALIGN(32) int valid[PACKET_SIZE];
+	RTCRay8 ray;
+	for (uint32_t i = 0; i < PACKET_SIZE; i++) {
+		valid[i] = i < count ? -1 : 0;
+		const Float3 dir = dirs[i < count ? i : 0];
+		ray.orgx[i] = pos.x;
+		ray.orgy[i] = pos.y;
+		ray.orgz[i] = pos.z;
+		ray.dirx[i] = dir.x;
+		ray.diry[i] = dir.y;
+		ray.dirz[i] = dir.z;
+		ray.tnear[i] = 0.0f;
+		ray.tfar[i] = std::numeric_limits<float>::max();
+		ray.time[i] = 0.0f;
+		ray.mask[i] = 0xFFFFFFFF;
+		ray.instID[i] = RTC_INVALID_GEOMETRY_ID;
+		ray.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+		ray.primID[i] = RTC_INVALID_GEOMETRY_ID;
+	}
+	rtcIntersect8(valid, scene.embree_scene, ray);
+
+	for (uint32_t i = 0; i < count; i++) {
+		out_hit[i] = ray.geomID[i] != RTC_INVALID_GEOMETRY_ID;
+		if (out_hit[i])
+			fill_hit(scene, dirs[i], ray.tfar[i], ray.geomID[i], ray.primID[i], ray.instID[i], float3(ray.Ngx[i], ray.Ngy[i], ray.Ngz[i]), out_hits[i]);
+	}
+}
+
+namespace {
+	// Embree wants the hit part of the ray stream as well. We keep it per thread so we don't allocate per call.
+	struct StreamHitData {
+		std::vector<float> tnear, tfar, time, Ng_x, Ng_y, Ng_z, u, v;
+		std::vector<uint32_t> mask, geom_id, prim_id, inst_id;
+	};
+	thread_local StreamHitData stream_hit_data;
+}
+
+void intersect_closest_stream(const Scene &scene, const RayStream &rays, uint32_t count, bool *out_hit, Hit *out_hits) {
+	if (count == 0)
+		return;
+	STAT_ADD(STAT_CLOSEST_RAYS, count);
+	thread_ray_count += count;
+
+	StreamHitData &h = stream_hit_data;
+	h.tnear.assign(count, 0.0f);
+	h.tfar.assign(count, std::numeric_limits<float>::max());
+	h.time.assign(count, 0.0f);
+	h.mask.assign(count, 0xFFFFFFFF);
+	h.Ng_x.resize(count); h.Ng_y.resize(count); h.Ng_z.resize(count);
+	h.u.resize(count); h.v.resize(count);
+	h.geom_id.assign(count, RTC_INVALID_GEOMETRY_ID);
+	h.prim_id.assign(count, RTC_INVALID_GEOMETRY_ID);
+	h.inst_id.assign(count, RTC_INVALID_GEOMETRY_ID);
+
+	// Embree does not write to the ray origin or direction
+	RTCRayNp np;
+	np.orgx = const_cast<float*>(&rays.org_x[0]);
+	np.orgy = const_cast<float*>(&rays.org_y[0]);
+	np.orgz = const_cast<float*>(&rays.org_z[0]);
+	np.dirx = const_cast<float*>(&rays.dir_x[0]);
+	np.diry = const_cast<float*>(&rays.dir_y[0]);
+	np.dirz = const_cast<float*>(&rays.dir_z[0]);
+	np.tnear = &h.tnear[0];
+	np.tfar = &h.tfar[0];
+	np.time = &h.time[0];
+	np.mask = &h.mask[0];
+	np.Ngx = &h.Ng_x[0];
+	np.Ngy = &h.Ng_y[0];
+	np.Ngz = &h.Ng_z[0];
+	np.u = &h.u[0];
+	np.v = &h.v[0];
+	np.geomID = &h.geom_id[0];
+	np.primID = &h.prim_id[0];
+	np.instID = &h.inst_id[0];
+
+	RTCIntersectContext context;
+	context.flags = RTC_INTERSECT_INCOHERENT;
+	context.userRayExt = nullptr;
+	rtcIntersectNp(scene.embree_scene, &context, np, count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		out_hit[i] = h.geom_id[i] != RTC_INVALID_GEOMETRY_ID;
+		if (out_hit[i])
+			fill_hit(scene, rays.dir(i), h.tfar[i], h.geom_id[i], h.prim_id[i], h.inst_id[i], float3(h.Ng_x[i], h.Ng_y[i], h.Ng_z[i]), out_hits[i]);
+	}
+}
+
+void occluded_stream(const Scene &scene, const RayStream &rays, const float *tmax, uint32_t count, bool *out_occluded) {
+	if (count == 0)
+		return;
+	STAT_ADD(STAT_OCCLUSION_RAYS, count);
+	thread_ray_count += count;
+
+	StreamHitData &h = stream_hit_data;
+	h.tnear.assign(count, 0.0f);
+	h.tfar.assign(tmax, tmax + count);
+	h.time.assign(count, 0.0f);
+	h.mask.assign(count, 0xFFFFFFFF);
+	h.Ng_x.resize(count); h.Ng_y.resize(count); h.Ng_z.resize(count);
+	h.u.resize(count); h.v.resize(count);
+	h.geom_id.assign(count, RTC_INVALID_GEOMETRY_ID);
+	h.prim_id.assign(count, RTC_INVALID_GEOMETRY_ID);
+	h.inst_id.assign(count, RTC_INVALID_GEOMETRY_ID);
+
+	RTCRayNp np;
+	np.orgx = const_cast<float*>(&rays.org_x[0]);
+	np.orgy = const_cast<float*>(&rays.org_y[0]);
+	np.orgz = const_cast<float*>(&rays.org_z[0]);
+	np.dirx = const_cast<float*>(&rays.dir_x[0]);
+	np.diry = const_cast<float*>(&rays.dir_y[0]);
+	np.dirz = const_cast<float*>(&rays.dir_z[0]);
+	np.tnear = &h.tnear[0];
+	np.tfar = &h.tfar[0];
+	np.time = &h.time[0];
+	np.mask = &h.mask[0];
+	np.Ngx = &h.Ng_x[0];
+	np.Ngy = &h.Ng_y[0];
+	np.Ngz = &h.Ng_z[0];
+	np.u = &h.u[0];
+	np.v = &h.v[0];
+	np.geomID = &h.geom_id[0];
+	np.primID = &h.prim_id[0];
+	np.instID = &h.inst_id[0];
+
+	RTCIntersectContext context;
+	context.flags = RTC_INTERSECT_INCOHERENT;
+	context.userRayExt = nullptr;
+	rtcOccludedNp(scene.embree_scene, &context, np, count);
+
+	// Embree sets geomID to 0 for occluded rays
+	for (uint32_t i = 0; i < count; i++) {
+		out_occluded[i] = h.geom_id[i] == 0;
+		STAT_ADD(STAT_OCCLUDED, out_occluded[i]);
+	}
+}
+#else
+namespace {
+	// The meshes, then the instances that are closer than the closest mesh hit
+	inline bool intersect_meshes_and_instances(const Scene &scene, const Float3 pos, const Float3 dir, BvhHit &out_hit) {
+		const bool mesh_hit = bvh_intersect(scene.bvh, pos, dir, 0.0f, std::numeric_limits<float>::max(), out_hit);
+		const bool instance_hit = bvh_intersect_instances(scene.top_level, pos, dir, 0.0f, mesh_hit ? out_hit.t : std::numeric_limits<float>::max(), out_hit);
+		return mesh_hit || instance_hit;
+	}
+
+	// Same for up to BVH_PACKET_SIZE rays as a packet
+	inline void intersect_packet_meshes_and_instances(const Scene &scene, const Float3 *orgs, const Float3 *dirs, uint32_t count, bool *out_hit, BvhHit *out_hits) {
+		float tfar[BVH_PACKET_SIZE];
+		for (uint32_t i = 0; i < BVH_PACKET_SIZE; i++)
+			tfar[i] = std::numeric_limits<float>::max();
+		bvh_intersect_packet(scene.bvh, orgs, dirs, count, 0.0f, tfar, out_hit, out_hits);
+		bool instance_hit[BVH_PACKET_SIZE];
+		for (uint32_t i = 0; i < count; i++)
+			tfar[i] = out_hit[i] ? out_hits[i].t : std::numeric_limits<float>::max();
+		bvh_intersect_instances_packet(scene.top_level, orgs, dirs, count, 0.0f, tfar, instance_hit, out_hits);
+		for (uint32_t i = 0; i < count; i++)
+			out_hit[i] = out_hit[i] || instance_hit[i];
+	}
+
+	const uint32_t ORDER_CELLS = 4; // Per axis of the box around the origins of a stream
+	const uint32_t ORDER_BINS = 8 * ORDER_CELLS*ORDER_CELLS*ORDER_CELLS;
+
+	/*
+		The indices of the first count rays in the stream in the order they are traced in packets, binned by the
+		octant of the direction and by a coarse grid cell of the origin. Rays in a bin start close together and go
+		roughly the same way, so they share more of the nodes they visit. A counting sort, since a full sort of the
+		stream costs about a third of tracing it.
+	*/
+	const std::vector<uint32_t> &coherent_order(const RayStream &rays, uint32_t count) {
+		thread_local std::vector<uint32_t> order, bins;
+		order.resize(count);
+		bins.resize(count);
+		Float3 mn = float3(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+		Float3 mx = -mn;
+		for (uint32_t i = 0; i < count; i++) {
+			mn = float3(std::min(mn.x, rays.org_x[i]), std::min(mn.y, rays.org_y[i]), std::min(mn.z, rays.org_z[i]));
+			mx = float3(std::max(mx.x, rays.org_x[i]), std::max(mx.y, rays.org_y[i]), std::max(mx.z, rays.org_z[i]));
+		}
+		const Float3 extent = mx - mn;
+		const float cells = ORDER_CELLS * (1.0f - 1E-6f); // So the largest origin lands in the last cell
+		const Float3 scale = float3(extent.x > 0.0f ? cells/extent.x : 0.0f, extent.y > 0.0f ? cells/extent.y : 0.0f, extent.z > 0.0f ? cells/extent.z : 0.0f);
+
+		uint32_t bin_start[ORDER_BINS+1] = {};
+		for (uint32_t i = 0; i < count; i++) {
+			const uint32_t octant = (rays.dir_x[i] < 0.0f ? 1 : 0) | (rays.dir_y[i] < 0.0f ? 2 : 0) | (rays.dir_z[i] < 0.0f ? 4 : 0);
+			const uint32_t cx = std::min((uint32_t)((rays.org_x[i] - mn.x) * scale.x), ORDER_CELLS-1);
+			const uint32_t cy = std::min((uint32_t)((rays.org_y[i] - mn.y) * scale.y), ORDER_CELLS-1);
+			const uint32_t cz = std::min((uint32_t)((rays.org_z[i] - mn.z) * scale.z), ORDER_CELLS-1);
+			bins[i] = ((octant * ORDER_CELLS + cz) * ORDER_CELLS + cy) * ORDER_CELLS + cx;
+			bin_start[bins[i]+1]++;
+		}
+		for (uint32_t b = 0; b < ORDER_BINS; b++)
+			bin_start[b+1] += bin_start[b];
+		for (uint32_t i = 0; i < count; i++)
+			order[bin_start[bins[i]]++] = i;
+		return order;
+	}
+
+	/*
+		A packet only pays off when its rays visit mostly the same nodes. Diffuse bounces are spread over the whole
+		hemisphere even when the origins are close, so those rays are traced one at a time. Camera rays and shadow rays
+		towards a light from nearby points go in packets. Occlusion packets need to be tighter, since a lane that is
+		occluded can't stop the others.
+	*/
+	const float PACKET_MIN_COS = 0.9f; // Between the direction of the first ray and the others
+	const float OCCLUSION_PACKET_MIN_COS = 0.99f;
+
+	inline bool is_coherent(const Float3 *dirs, uint32_t count, float min_cos) {
+		const float min_dot = min_cos * length(dirs[0]);
+		for (uint32_t i = 1; i < count; i++) {
+			if (dot(dirs[0], dirs[i]) < min_dot * length(dirs[i]))
+				return false;
+		}
+		return true;
+	}
+}
+
+bool intersect_closest(const Scene &scene, const Float3 pos, const Float3 dir, Hit &out_hit) {
+	STAT_SCOPED_TIMER(STAT_TIMER_INTERSECT);
+	STAT_INC(STAT_CLOSEST_RAYS);
+	thread_ray_count++;
+
+	BvhHit hit;
+	if (!intersect_meshes_and_instances(scene, pos, dir, hit))
+		return false;
+
+	fill_hit(scene, dir, hit.t, hit.geom_id, hit.prim_id, hit.inst_id, hit.Ng, out_hit);
+	return true;
+}
+
+bool occluded(const Scene &scene, const Float3 pos, const Float3 dir, float tmax) {
+	STAT_SCOPED_TIMER(STAT_TIMER_INTERSECT);
+	STAT_INC(STAT_OCCLUSION_RAYS);
+	thread_ray_count++;
+
+	const bool is_occluded = bvh_occluded(scene.bvh, pos, dir, 0.0f, tmax) || bvh_occluded_instances(scene.top_level, pos, dir, 0.0f, tmax);
+	STAT_ADD(STAT_OCCLUDED, is_occluded);
+	return is_occluded;
+}
+
+void intersect_closest_packet(const Scene &scene, const Float3 pos, const Float3 *dirs, uint32_t count, bool *out_hit, Hit *out_hits) {
+	static_assert(PACKET_SIZE <= BVH_PACKET_SIZE, "Packet does not fit in BVH packet");
+	STAT_ADD(STAT_CLOSEST_RAYS, count);
+	thread_ray_count += count;
+
+	Float3 orgs[BVH_PACKET_SIZE];
+	for (uint32_t i = 0; i < BVH_PACKET_SIZE; i++)
+		orgs[i] = pos;
+	BvhHit hits[BVH_PACKET_SIZE];
+	intersect_packet_meshes_and_instances(scene, orgs, dirs, count, out_hit, hits);
+	for (uint32_t i = 0; i < count; i++) {
+		if (out_hit[i])
+			fill_hit(scene, dirs[i], hits[i].t, hits[i].geom_id, hits[i].prim_id, hits[i].inst_id, hits[i].Ng, out_hits[i]);
+	}
+}
+
+// The rays are traced as packets of BVH_PACKET_SIZE in coherent_order
+void intersect_closest_stream(const Scene &scene, const RayStream &rays, uint32_t count, bool *out_hit, Hit *out_hits) {
+	STAT_ADD(STAT_CLOSEST_RAYS, count);
+	thread_ray_count += count;
+
+	const std::vector<uint32_t> &order = coherent_order(rays, count);
+	for (uint32_t first = 0; first < count; first += BVH_PACKET_SIZE) {
+		const uint32_t n = std::min(BVH_PACKET_SIZE, count - first);
+		Float3 orgs[BVH_PACKET_SIZE], dirs[BVH_PACKET_SIZE];
+		for (uint32_t i = 0; i < n; i++) {
+			orgs[i] = rays.org(order[first + i]);
+			dirs[i] = rays.dir(order[first + i]);
+		}
+		bool hit[BVH_PACKET_SIZE];
+		BvhHit hits[BVH_PACKET_SIZE];
+		if (is_coherent(dirs, n, PACKET_MIN_COS))
+			intersect_packet_meshes_and_instances(scene, orgs, dirs, n, hit, hits);
+		else {
+			for (uint32_t i = 0; i < n; i++)
+				hit[i] = intersect_meshes_and_instances(scene, orgs[i], dirs[i], hits[i]);
+		}
+		for (uint32_t i = 0; i < n; i++) {
+			const uint32_t r = order[first + i];
+			out_hit[r] = hit[i];
+			if (hit[i])
+				fill_hit(scene, dirs[i], hits[i].t, hits[i].geom_id, hits[i].prim_id, hits[i].inst_id, hits[i].Ng, out_hits[r]);
+		}
+	}
+}
+
+void occluded_stream(const Scene &scene, const RayStream &rays, const float *tmax, uint32_t count, bool *out_occluded) {
+	STAT_ADD(STAT_OCCLUSION_RAYS, count);
+	thread_ray_count += count;
+
+	const std::vector<uint32_t> &order = coherent_order(rays, count);
+	for (uint32_t first = 0; first < count; first += BVH_PACKET_SIZE) {
+		const uint32_t n = std::min(BVH_PACKET_SIZE, count - first);
+		Float3 orgs[BVH_PACKET_SIZE], dirs[BVH_PACKET_SIZE];
+		float tfar[BVH_PACKET_SIZE];
+		for (uint32_t i = 0; i < n; i++) {
+			const uint32_t r = order[first + i];
+			orgs[i] = rays.org(r);
+			dirs[i] = rays.dir(r);
+			tfar[i] = tmax[r];
+		}
+		bool occluded[BVH_PACKET_SIZE], instance_occluded[BVH_PACKET_SIZE];
+		if (!is_coherent(dirs, n, OCCLUSION_PACKET_MIN_COS)) {
+			for (uint32_t i = 0; i < n; i++) {
+				const bool is_occluded = bvh_occluded(scene.bvh, orgs[i], dirs[i], 0.0f, tfar[i]) || bvh_occluded_instances(scene.top_level, orgs[i], dirs[i], 0.0f, tfar[i]);
+				out_occluded[order[first + i]] = is_occluded;
+				STAT_ADD(STAT_OCCLUDED, is_occluded);
+			}
+			continue;
+		}
+		bvh_occluded_packet(scene.bvh, orgs, dirs, n, 0.0f, tfar, occluded);
+
+		// Only the rays that got through the meshes go on to the instances
+		uint32_t lanes[BVH_PACKET_SIZE], num_lanes = 0;
+		for (uint32_t i = 0; i < n; i++) {
+			if (occluded[i])
+				continue;
+			orgs[num_lanes] = orgs[i];
+			dirs[num_lanes] = dirs[i];
+			tfar[num_lanes] = tfar[i];
+			lanes[num_lanes++] = i;
+		}
+		if (num_lanes != 0)
+			bvh_occluded_instances_packet(scene.top_level, orgs, dirs, num_lanes, 0.0f, tfar, instance_occluded);
+		for (uint32_t i = 0; i < num_lanes; i++)
+			occluded[lanes[i]] = instance_occluded[i];
+
+		for (uint32_t i = 0; i < n; i++) {
+			out_occluded[order[first + i]] = occluded[i];
+			STAT_ADD(STAT_OCCLUDED, occluded[i]);
+		}
+	}
+}
+#endif
+
+bool sample_light(const Scene &scene, float u_select, const Float2 u, LightSample &out_sample) {
+	const uint32_t num_lights = scene.lights.size();
+	if (num_lights == 0)
+		return false;
+
+	const float *cdf = &scene.light_cdf[0];
+	const uint32_t index = std::min((uint32_t)(std::upper_bound(cdf, cdf + num_lights, u_select) - cdf), num_lights - 1);
+	const LightTriangle &light = scene.lights[index];
+
+	// Uniform point on the triangle, https://www.pbr-book.org/3ed-2018/Monte_Carlo_Integration/2D_Sampling_with_Multidimensional_Transformations
+	const float su = sqrtf(u.x);
+	const float b0 = 1.0f - su, b1 = u.y * su;
+	out_sample.pos = light.v0 * b0 + light.v1 * b1 + light.v2 * (1.0f - b0 - b1);
+	out_sample.normal = normalized(cross(light.v1 - light.v0, light.v2 - light.v0));
+	out_sample.emissive = light.emissive;
+	out_sample.pdf_area = light_pdf_area(scene, light.emissive);
+	return true;
+}
+
+float light_pdf_area(const Scene &scene, const Float3 emissive) {
+	if (scene.light_weight_total == 0.0f)
+		return 0.0f;
+	// Weight of a light is area*luminance or area so the area density is the same everywhere on an emitter
+	return (scene.light_power ? luminance(emissive) : 1.0f) / scene.light_weight_total;
+}
+
+bool trace_camera_ray(ThreadContext &thread_context, const Scene &scene, const Camera &camera, uint32_t x, uint32_t y, uint32_t sample_index, float one_over_width, float one_over_height, Float3 &out_dir, Hit &out_hit) {
+	const CameraPacket &packet = thread_context.camera_packet;
+	for (uint32_t i = 0; i < packet.count; i++) {
+		if (packet.x[i] == x && packet.y[i] == y && packet.sample_index[i] == sample_index) {
+			out_dir = packet.dir[i];
+			if (packet.hit[i])
+				out_hit = packet.hits[i];
+			thread_context.dimension += 2; // Used for the jitter when the packet was set up
+			return packet.hit[i];
+		}
+	}
 
-	out_result.face_normal = fn;
+	const Float2 jitter = sample2d(thread_context);
+	out_dir = generate_camera_direction(camera, (x + jitter.x) * one_over_width, (y + jitter.y) * one_over_height);
+	return intersect_closest(scene, camera.position, out_dir, out_hit);
+}
+
+bool trace_camera_ray(ThreadContext &thread_context, const Scene &scene, const Camera &camera, uint32_t x, uint32_t y, uint32_t sample_index, float one_over_width, float one_over_height, Float3 &out_dir, IntersectResult &out_result) {
+	Hit hit;
+	if (!trace_camera_ray(thread_context, scene, camera, x, y, sample_index, one_over_width, one_over_height, out_dir, hit))
+		return false;
+	expand_hit(scene, camera.position, out_dir, hit, out_result);
 	return true;
 }
 
 namespace {
 
+#if PATHTRACER_EMBREE
 	void embree_error(void* userPtr, const RTCError code, const char* str) {
 		printf("Embree error %s\n", str);
 		exit(1);
 	}
+#endif
 
-	void add_cube(Scene &scene, uint32_t material_id, const Float3 center_pos, const Float3 size) {
+	// Cube from -1 to 1. The faces are quads with 4 vertices each since we want hard normals.
+	const Float3 cube_corners[8] = {
+		float3(-1,-1,-1),
+		float3( 1,-1,-1),
+		float3(-1,-1, 1),
+		float3( 1,-1, 1),
+		float3(-1, 1,-1),
+		float3( 1, 1,-1),
+		float3(-1, 1, 1),
+		float3( 1, 1, 1),
+	};
 
-		// TODO: Add normal that we can interpolate
+	const uint32_t cube_faces[6][4] = {
+		{0,1,3,2}, // top
+		{4,6,7,5}, // bottom
+		{1,5,7,3}, // right
+		{2,3,7,6}, // front
+		{0,2,6,4}, // left
+		{0,4,5,1},  // back
+	};
 
-		uint32_t mesh_id = scene.instance_material.size();
-		scene.instance_material.push_back(material_id);
+	// Returns the index of the prototype. It has a single mesh with geom_id 0 and gets its material from the instances.
+	uint32_t add_cube_prototype(Scene &scene) {
 
-		// 6 quads with 4 vertices each = 6*4=24 vertices
-		// This is because we want hard normals on our cube
-		// Notice cute trick here; using material index as geometry index
-		uint32_t embree_mesh_id = rtcNewQuadMesh2(scene.embree_scene, RTC_GEOMETRY_STATIC, 6, 24, 1, mesh_id);
+		// TODO: Add normal that we can interpolate
 
-		assert(mesh_id == embree_mesh_id);
+#if PATHTRACER_EMBREE
+		RTCScene prototype = rtcDeviceNewScene(scene.embree_device, RTC_SCENE_STATIC|RTC_SCENE_INCOHERENT, RTC_INTERSECT1|RTC_INTERSECT8|RTC_INTERSECT_STREAM|RTC_INTERPOLATE);
+		// 6 quads with 4 vertices each = 6*4=24 vertices
+		uint32_t mesh_id = rtcNewQuadMesh2(prototype, RTC_GEOMETRY_STATIC, 6, 24, 1, 0);
 
-		uint32_t *index_buffer = (uint32_t*)rtcMapBuffer(scene.embree_scene, mesh_id, RTC_INDEX_BUFFER);
+		uint32_t *index_buffer = (uint32_t*)rtcMapBuffer(prototype, mesh_id, RTC_INDEX_BUFFER);
 		for (uint32_t i = 0; i < 6*4; ++i) {
 			index_buffer[i] = i;
 		}
-		rtcUnmapBuffer(scene.embree_scene, mesh_id, RTC_INDEX_BUFFER);
-
-		Float3 pos[8]={
-			float3(-1,-1,-1),
-			float3( 1,-1,-1),
-			float3(-1,-1, 1),
-			float3( 1,-1, 1),
-			float3(-1, 1,-1),
-			float3( 1, 1,-1),
-			float3(-1, 1, 1),
-			float3( 1, 1, 1),
-		};
-
-		for (uint32_t i=0; i<8; i++) {
-			pos[i] = pos[i]*size + center_pos;
-		}
-
-		static const uint32_t idx[6][4]={
-			{0,1,3,2}, // top
-			{4,6,7,5}, // bottom
-			{1,5,7,3}, // right
-			{2,3,7,6}, // front
-			{0,2,6,4}, // left
-			{0,4,5,1},  // back
-		};
+		rtcUnmapBuffer(prototype, mesh_id, RTC_INDEX_BUFFER);
 
-		Float4 *vertex_buffer = (Float4*)rtcMapBuffer(scene.embree_scene, mesh_id, RTC_VERTEX_BUFFER);
+		Float4 *vertex_buffer = (Float4*)rtcMapBuffer(prototype, mesh_id, RTC_VERTEX_BUFFER);
 		for (uint32_t f = 0, ofs = 0; f < 6; f++) {
 			for (uint32_t v = 0; v < 4; v++, ofs++) {
 				Float4 &vp = vertex_buffer[ofs];
-				Float3 s = pos[idx[f][v]];
+				Float3 s = cube_corners[cube_faces[f][v]];
 				vp.x = s.x;
 				vp.y = s.y;
 				vp.z = s.z;
 				vp.w = 0.0f; // padding
 			}
-			
 		}
-		rtcUnmapBuffer(scene.embree_scene, mesh_id, RTC_VERTEX_BUFFER);
+		rtcUnmapBuffer(prototype, mesh_id, RTC_VERTEX_BUFFER);
+		rtcCommit(prototype);
+
+		scene.embree_prototypes.push_back(prototype);
+		return scene.embree_prototypes.size() - 1;
+#else
+		Bvh *prototype = new Bvh;
+		for (uint32_t f = 0; f < 6; f++) {
+			BvhQuad q;
+			q.v0 = cube_corners[cube_faces[f][0]];
+			q.v1 = cube_corners[cube_faces[f][1]];
+			q.v2 = cube_corners[cube_faces[f][2]];
+			q.v3 = cube_corners[cube_faces[f][3]];
+			q.geom_id = 0;
+			q.prim_id = f;
+			prototype->quads.push_back(q);
+		}
+		bvh_build(*prototype);
+
+		scene.top_level.prototypes.push_back(prototype);
+		return scene.top_level.prototypes.size() - 1;
+#endif
+	}
+
+	void add_instance(Scene &scene, uint32_t prototype, uint32_t material_id, const Transform &world_from_object) {
+		const uint32_t inst_id = scene.instance_material.size();
+		scene.instance_material.push_back(material_id);
+
+#if PATHTRACER_EMBREE
+		uint32_t embree_inst_id = rtcNewInstance2(scene.embree_scene, scene.embree_prototypes[prototype], 1);
+		assert(inst_id == embree_inst_id);
+		rtcSetTransform2(scene.embree_scene, inst_id, RTC_MATRIX_COLUMN_MAJOR, &world_from_object.x.x, 0); // Transform is 12 floats, column by column
+		scene.object_from_world.push_back(inverse(world_from_object));
+#else
+		bvh_add_instance(scene.top_level, prototype, world_from_object, inst_id);
+#endif
+	}
+
+	void add_cube(Scene &scene, uint32_t material_id, const Float3 center_pos, const Float3 size) {
+		const Transform world_from_object = scale_translate(size, center_pos);
+		add_instance(scene, scene.cube_prototype, material_id, world_from_object);
+
+		const Float3 emissive = scene.materials.emissive(material_id);
+		if (max(emissive) > 0.0f) {
+			for (uint32_t f = 0; f < 6; f++) {
+				Float3 v[4];
+				for (uint32_t k = 0; k < 4; k++)
+					v[k] = transform_point(world_from_object, cube_corners[cube_faces[f][k]]);
+				scene.lights.push_back(LightTriangle{v[0], v[1], v[3], emissive});
+				scene.lights.push_back(LightTriangle{v[2], v[3], v[1], emissive});
+			}
+		}
 	}
 
-	void create_scene(RTCDevice embree_device, Scene &scene) {
-		scene.embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC|RTC_SCENE_INCOHERENT, RTC_INTERSECT1|RTC_INTERPOLATE);
+	// Meshes of scene.file. Triangle i of a mesh has prim_id i.
+	void add_scene_file(Scene &scene) {
+		const SceneFile &file = scene.file;
+		const uint32_t first_material = scene.materials.size();
+		for (uint32_t i = 0; i < file.materials.size(); i++)
+			scene.materials.add(file.materials[i].diffuse, file.materials[i].emissive);
 
-		uint32_t red_material = scene.materials.size();
-		scene.materials.push_back(Material{float3(1.0f,0.5f,0.5f), float3(0,0,0)});
+#if !PATHTRACER_EMBREE
+		scene.bvh.quads.reserve(scene.bvh.quads.size() + file.num_triangles);
+#endif
+		for (uint32_t i = 0; i < file.meshes.size(); i++) {
+			const SceneFileMesh &mesh = file.meshes[i];
+			const uint32_t *indices = file.indices + 3 * mesh.first_triangle;
+			const uint32_t mesh_id = scene.instance_material.size();
+			scene.instance_material.push_back(first_material + mesh.material);
 
-		uint32_t white_material = scene.materials.size();
-		scene.materials.push_back(Material{float3(0.8f,0.8f,0.8f), float3(0,0,0)});
+#if PATHTRACER_EMBREE
+			// Shared buffers, no copies
+			uint32_t embree_mesh_id = rtcNewTriangleMesh2(scene.embree_scene, RTC_GEOMETRY_STATIC, mesh.num_triangles, file.num_vertices, 1, mesh_id);
+			assert(mesh_id == embree_mesh_id);
+			rtcSetBuffer2(scene.embree_scene, mesh_id, RTC_VERTEX_BUFFER, file.vertices, 0, sizeof(Float3), file.num_vertices);
+			rtcSetBuffer2(scene.embree_scene, mesh_id, RTC_INDEX_BUFFER, indices, 0, 3 * sizeof(uint32_t), mesh.num_triangles);
+			scene.object_from_world.push_back(scale_translate(float3(1,1,1), float3(0,0,0)));
+#else
+			// The BVH reorders its primitives so it gets a copy. A triangle is a quad with v3 == v2, like in Embree.
+			for (uint32_t t = 0; t < mesh.num_triangles; t++) {
+				BvhQuad q;
+				q.v0 = file.vertices[indices[3*t+0]];
+				q.v1 = file.vertices[indices[3*t+1]];
+				q.v2 = q.v3 = file.vertices[indices[3*t+2]];
+				q.geom_id = mesh_id;
+				q.prim_id = t;
+				scene.bvh.quads.push_back(q);
+			}
+#endif
 
-		uint32_t greenish_material = scene.materials.size();
-		scene.materials.push_back(Material{float3(0.6f,0.9f,0.6f), float3(0,0,0)});
+			const Float3 emissive = scene.materials.emissive(first_material + mesh.material);
+			if (max(emissive) > 0.0f) {
+				for (uint32_t t = 0; t < mesh.num_triangles; t++)
+					scene.lights.push_back(LightTriangle{file.vertices[indices[3*t+0]], file.vertices[indices[3*t+1]], file.vertices[indices[3*t+2]], emissive});
+			}
+		}
+	}
 
-		uint32_t blueish_material = scene.materials.size();
-		scene.materials.push_back(Material{float3(0.3f,0.3f,0.9f), float3(0,0,0)});
+	// num_pillars*num_pillars extra pillars on the floor around the room, to see how instancing scales
+	void add_builtin_scene(Scene &scene, uint32_t num_pillars) {
+		scene.cube_prototype = add_cube_prototype(scene);
 
-		uint32_t emissive_material = scene.materials.size();
-		scene.materials.push_back(Material{float3(0,0,0), float3(2.0f,2.0f,0.25f)});
+		const uint32_t red_material = scene.materials.add(float3(1.0f,0.5f,0.5f), float3(0,0,0));
+		const uint32_t white_material = scene.materials.add(float3(0.8f,0.8f,0.8f), float3(0,0,0));
+		const uint32_t greenish_material = scene.materials.add(float3(0.6f,0.9f,0.6f), float3(0,0,0));
+		const uint32_t blueish_material = scene.materials.add(float3(0.3f,0.3f,0.9f), float3(0,0,0));
+		const uint32_t emissive_material = scene.materials.add(float3(0,0,0), float3(2.0f,2.0f,0.25f));
 		
 		// Back wall
 		add_cube(scene, greenish_material, float3(0, 3,        5.0), float3(  5, 3,0.5f));
@@ -170,70 +749,172 @@ namespace {
 		// Emissive cube
 		add_cube(scene, emissive_material, float3(2.5f,1.5f,0), float3(1,1.5f,1));
 
-		rtcCommit(scene.embree_scene);
-	}
-}
-
-inline float linear_to_srgb(float c_linear) {
-	// https://en.wikipedia.org/wiki/SRGB
-	const float a = 0.055f;
-	if (c_linear <=0.0031308) {
-		return 12.92f*c_linear;
-	} else {
-		return (1.0f+a)*powf(c_linear, 1.0f/2.4f)-a;
+		// Leave the room and the view of it from the camera free
+		for (uint32_t z = 0; z < num_pillars; z++) {
+			for (uint32_t x = 0; x < num_pillars; x++) {
+				const Float3 pos = float3(2.0f * x - (num_pillars - 1.0f), 3, 2.0f * z - (num_pillars - 1.0f));
+				if (fabsf(pos.x) < 8.0f && pos.z < 7.0f)
+					continue;
+				add_cube(scene, blueish_material, pos, float3(0.3f,3,0.3f));
+			}
+		}
 	}
-}
 
-// https://knarkowicz.wordpress.com/2016/01/06/aces-filmic-tone-mapping-curve/
-Float3 ACESFilm(Float3 x)
-{
-	float a = 2.51f;
-	Float3 b = float3(0.03f, 0.03f, 0.03f);
-	float c = 2.43f;
-	Float3 d = float3(0.59f, 0.59f, 0.59f);
-	Float3 e = float3(0.14f, 0.14f, 0.14f);
+	// The scene from scene.file if it has been loaded, otherwise the built-in one. If bvh_cache is a directory the BVH
+	// of the meshes is mapped from a cache file in it when the same scene has been built before. Returns true if it was.
+	bool create_scene(Scene &scene, const char *bvh_cache, uint32_t num_pillars) {
+#if PATHTRACER_EMBREE
+		scene.embree_device = rtcNewDevice();
+		rtcDeviceSetErrorFunction2(scene.embree_device, embree_error, nullptr);
+		scene.embree_scene = rtcDeviceNewScene(scene.embree_device, RTC_SCENE_STATIC|RTC_SCENE_INCOHERENT, RTC_INTERSECT1|RTC_INTERSECT8|RTC_INTERSECT_STREAM|RTC_INTERPOLATE);
+#endif
 
-	Float3 t = (x*(a*x+b));
-	Float3 n = (x*(c*x+d)+e);
-	Float3 in = float3(1.0f/n.x, 1.0f/n.y, 1.0f/n.z);
+		if (scene.file.num_triangles != 0)
+			add_scene_file(scene);
+		else
+			add_builtin_scene(scene, num_pillars);
 
-	return saturate(t*in);
-}
+#if PATHTRACER_EMBREE
+		rtcCommit(scene.embree_scene);
+		return false;
+#else
+		bvh_build_top_level(scene.top_level);
+		if (!bvh_cache || scene.bvh.quads.size() == 0) {
+			bvh_build(scene.bvh);
+			return false;
+		}
+		const uint64_t input_hash = bvh_input_hash(scene.bvh);
+		char filename[1024];
+		snprintf(filename, sizeof(filename), "%s/bvh_%016llx.ptbvh", bvh_cache, (unsigned long long)input_hash);
+		if (bvh_load_cache(scene.bvh, filename, input_hash))
+			return true;
+		bvh_build(scene.bvh);
+		if (!bvh_write_cache(scene.bvh, filename, input_hash))
+			printf("Could not write BVH cache '%s'\n", filename);
+		return false;
+#endif
+	}
 
-uint32_t linear_to_png(Float3 linear, RandomContext &random) {
-	Float3 linear_tonemapped = ACESFilm(linear);
-	Float3 srgb = float3(linear_to_srgb(linear_tonemapped.x), linear_to_srgb(linear_tonemapped.y), linear_to_srgb(linear_tonemapped.z));
+	// Light picking probabilities for sample_light. Call when all geometry has been added.
+	void build_light_distribution(Scene &scene, bool power) {
+		const uint32_t num_lights = scene.lights.size();
+		scene.light_power = power;
+		scene.light_cdf.resize(num_lights);
 
-	// We are going to convert srgb into 8-bit. This will introduce banding.
-	// To alleviate this we will add noise. This breaks up the banding.
-	// More details can be found in presentations on the game INSIDE from Playdead.
-	// The tringular noise is adapated from https://www.shadertoy.com/view/4t2SDh
-	float v = uniform(random);
-	
-	// Inspired from INSIDE/Playdead rendering (exactly what they use)
-	float orig = v * 2.0f - 1.0f;
-	v = std::max(-1.0f, orig/sqrtf(abs(v))); // TODO: This is to filter out NANs in HLSL but might not work in our setting
-	const float dither = v - (orig>=0?1:-1);
+		double total = 0.0;
+		for (uint32_t i = 0; i < num_lights; i++) {
+			const LightTriangle &light = scene.lights[i];
+			const float area = 0.5f * length(cross(light.v1 - light.v0, light.v2 - light.v0));
+			total += area * (power ? luminance(light.emissive) : 1.0f);
+			scene.light_cdf[i] = (float)total;
+		}
+		for (uint32_t i = 0; i < num_lights; i++)
+			scene.light_cdf[i] = (float)(scene.light_cdf[i] / total);
+		scene.light_weight_total = (float)total;
+	}
 
-	uint8_t r8 = (uint8_t)std::max(std::min(round(srgb.x * 255.0f + dither), 255.0f), 0.0f);
-	uint8_t g8 = (uint8_t)std::max(std::min(round(srgb.y * 255.0f + dither), 255.0f), 0.0f);
-	uint8_t b8 = (uint8_t)std::max(std::min(round(srgb.z * 255.0f + dither), 255.0f), 0.0f);
+	void destroy_scene(Scene &scene) {
+#if PATHTRACER_EMBREE
+		rtcDeleteScene(scene.embree_scene);
+		for (uint32_t i = 0; i < scene.embree_prototypes.size(); i++)
+			rtcDeleteScene(scene.embree_prototypes[i]);
+		rtcDeleteDevice(scene.embree_device);
+#else
+		for (uint32_t i = 0; i < scene.top_level.prototypes.size(); i++)
+			delete scene.top_level.prototypes[i];
+#endif
+	}
 
-	uint8_t a8 = 0xFF;
-	return r8|(g8<<8)|(b8<<16)|(a8<<24);
+	// Build or load time and, for the built-in BVH, memory
+	void print_acceleration_structure(const Scene &scene, bool cached, double seconds) {
+		const uint32_t num_instances = scene.instance_material.size() - scene.file.meshes.size();
+#if PATHTRACER_EMBREE
+		printf("%s acceleration structure in %.3fs (%d instances)\n", cached ? "Loaded cached" : "Built", seconds, num_instances);
+#else
+		size_t bytes = sizeof(BvhNode) * scene.bvh.nodes.size() + sizeof(BvhQuad) * scene.bvh.quads.size();
+		if (cached)
+			bytes = scene.bvh.cache_file.size;
+		bytes += sizeof(BvhNode) * scene.top_level.nodes.size() + sizeof(BvhInstance) * scene.top_level.instances.size();
+		for (uint32_t i = 0; i < scene.top_level.prototypes.size(); i++)
+			bytes += sizeof(BvhNode) * scene.top_level.prototypes[i]->nodes.size() + sizeof(BvhQuad) * scene.top_level.prototypes[i]->quads.size();
+		printf("%s acceleration structure in %.3fs (%d instances, %.2f MB)\n", cached ? "Loaded cached" : "Built", seconds, num_instances, bytes / (1024.0 * 1024.0));
+#endif
+	}
 }
 
-
 struct Settings {
 	uint32_t image_index = 0; // Basically image index for the blog post
 	uint32_t num_threads = 0;
 	uint32_t width = 640;
 	uint32_t height = 480;
 	uint32_t num_samples = 64;
-	uint32_t camera_index = 0;
-	const char *output = "image.png";
+	int32_t camera_index = -1; // Only render this view of -cameras or -orbit, -1 is all of them
+	const char *cameras = nullptr; // One view per line: from_x,from_y,from_z to_x,to_y,to_z
+	uint32_t orbit = 0; // Number of views on a circle around -look_at, see create_views
+	uint32_t seed = 0;
+	bool wavefront = false;
+	bool packets = false;
+	uint32_t num_passes = 1; // Samples are split into passes so that late tiles can be shared by threads
+	TileOrder tile_order = TILE_ORDER_HILBERT;
+	uint32_t tile_size = DEFAULT_TILE_SIZE; // 0 picks one with a calibration run, see autotune_tile_size
+	ThreadPinning pinning = PIN_NONE; // Also makes the threads first touch the framebuffer memory of their tiles
+	bool has_look_from = false, has_look_at = false; // Override the default camera, see create_camera
+	Float3 look_from = float3(0,0,0);
+	Float3 look_at = float3(0,0,0);
+	bool server = false; // Render jobs from stdin, see run_server
+	float adaptive_threshold = 0.0f; // Pixels stop getting samples when their relative error is below this, 0 is off
+	SamplerType sampler = SAMPLER_RANDOM;
+	bool light_power = true; // Lights are picked by power or by area
+	const char *sample_heatmap = nullptr;
+	const char *rmse_report = nullptr; // Reference image (.pfm) to compare the samplers against
+	bool ray_benchmark = false;
+	bool rng_benchmark = false;
+	const char *checkpoint = nullptr;
+	float checkpoint_interval = 60.0f; // Seconds
+	bool resume = false; // Continue from the checkpoint if there is one
+	uint32_t shard_index = 0; // Only render shard_index of num_shards, see -shard
+	uint32_t num_shards = 1;
+	ShardMode shard_mode = SHARD_TILES;
+	uint32_t sample_offset = 0; // Added to all sample indices. A sample shard renders [sample_offset, sample_offset+num_samples).
+	const char *output = "image.png"; // .pfm and .exr get the linear image, anything else a png
+	const char *scene = nullptr; // .obj or .ptscene, the built-in scene if not set
+	const char *write_scene = nullptr; // Converts -scene to a .ptscene and exits
+	const char *bvh_cache = nullptr; // Directory with built BVHs, keyed by a hash of the scene
+	uint32_t num_pillars = 0; // Adds num_pillars^2 instanced pillars to the built-in scene
+	const char *json = nullptr; // Timings and throughput of the run as JSON, see pathtracer_bench
+	const char *reference = nullptr; // .pfm that the image is compared against, the RMSE goes in the JSON report
+	const char *trace = nullptr; // Timeline of the tile passes in Chrome trace format, needs PATHTRACER_STATS
+	bool progressive = false; // Render in rounds over the whole image, see render_progressive
+	const char *preview = nullptr; // The image so far, written by the progressive mode
+	float preview_interval = 1.0f; // Seconds
+	float pass_budget = 0.0f; // Seconds per progressive round. 0 is one sample per pixel per round.
 };
 
+inline TileLayout tile_layout(const Settings &settings) {
+	return tile_layout(settings.width, settings.height, settings.tile_size != 0 ? settings.tile_size : DEFAULT_TILE_SIZE);
+}
+
+inline uint32_t samples_per_pass(const Settings &settings) {
+	return (settings.num_samples + settings.num_passes - 1) / settings.num_passes;
+}
+
+// Never trust a variance estimate from fewer samples than this
+const uint32_t ADAPTIVE_MIN_SAMPLES = 16;
+
+inline bool needs_samples(const Pixel &pixel, const Settings &settings) {
+	if (pixel.N >= settings.num_samples)
+		return false;
+	if (settings.adaptive_threshold == 0.0f || pixel.N < ADAPTIVE_MIN_SAMPLES)
+		return true;
+	return relative_error(pixel) > settings.adaptive_threshold;
+}
+
+// For options that take a float. Server jobs come from stdin, so a bad value is an error and not an assert.
+bool wants_number(const char *option) {
+	printf("%s wants a number\n", option);
+	return false;
+}
+
 bool parse_command_line(Settings &settings, int argc, char **argv) {
 	bool found = false;
 	for (int i = 1; i<argc; ++i) {
@@ -244,125 +925,1489 @@ bool parse_command_line(Settings &settings, int argc, char **argv) {
 			continue;
 		}
 		uint32_t uint_value = 0;
-		bool has_uint = false;
-		if (i!=argc) {
+		float float_value = 0.0f;
+		bool has_uint = false, has_float = false;
+		if (i+1<argc) {
 			has_uint = sscanf(argv[i+1], "%u", &uint_value) == 1;
+			has_float = sscanf(argv[i+1], "%f", &float_value) == 1;
 		}
 
 		     if (strcmp(argv[i], "-image_index")==0) { assert(has_uint); settings.image_index = uint_value; i++; }
 		else if (strcmp(argv[i], "-width")==0) { assert(has_uint); settings.width = uint_value; i++; }
 		else if (strcmp(argv[i], "-height")==0) { assert(has_uint); settings.height = uint_value; i++; }
 		else if (strcmp(argv[i], "-samples")==0) { assert(has_uint); settings.num_samples = uint_value; i++; }
-		else if (strcmp(argv[i], "-camera")==0) { assert(has_uint); settings.camera_index = uint_value; i++; }
+		else if (strcmp(argv[i], "-camera")==0) { assert(has_uint); settings.camera_index = (int32_t)uint_value; i++; }
+		else if (strcmp(argv[i], "-cameras")==0) { settings.cameras = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-orbit")==0) { assert(has_uint && uint_value > 0); settings.orbit = uint_value; i++; }
 		else if (strcmp(argv[i], "-output")==0) { settings.output = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-wavefront")==0) { settings.wavefront = true; }
+		else if (strcmp(argv[i], "-packets")==0) { settings.packets = true; }
+		else if (strcmp(argv[i], "-seed")==0) { assert(has_uint); settings.seed = uint_value; i++; }
+		else if (strcmp(argv[i], "-threads")==0) { assert(has_uint); settings.num_threads = uint_value; i++; }
+		else if (strcmp(argv[i], "-passes")==0) { assert(has_uint && uint_value > 0); settings.num_passes = uint_value; i++; }
+		else if (strcmp(argv[i], "-adaptive")==0) { if (!has_float) return wants_number(argv[i]); settings.adaptive_threshold = float_value; i++; }
+		else if (strcmp(argv[i], "-sample_heatmap")==0) { settings.sample_heatmap = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-light_sampling")==0) {
+			     if (strcmp(argv[i+1], "area")==0)  settings.light_power = false;
+			else if (strcmp(argv[i+1], "power")==0) settings.light_power = true;
+			else {
+				printf("Invalid light sampling '%s'\n", argv[i+1]);
+				return false;
+			}
+			i++;
+		}
+		else if (strcmp(argv[i], "-rmse_report")==0) { settings.rmse_report = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-ray_benchmark")==0) { settings.ray_benchmark = true; }
+		else if (strcmp(argv[i], "-rng_benchmark")==0) { settings.rng_benchmark = true; }
+		else if (strcmp(argv[i], "-checkpoint")==0) { settings.checkpoint = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-checkpoint_interval")==0) { if (!has_float) return wants_number(argv[i]); settings.checkpoint_interval = float_value; i++; }
+		else if (strcmp(argv[i], "-resume")==0) { settings.resume = true; }
+		else if (strcmp(argv[i], "-scene")==0) { settings.scene = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-write_scene")==0) { settings.write_scene = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-bvh_cache")==0) { settings.bvh_cache = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-pillars")==0) { assert(has_uint); settings.num_pillars = uint_value; i++; }
+		else if (strcmp(argv[i], "-json")==0) { settings.json = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-reference")==0) { settings.reference = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-trace")==0) { settings.trace = argv[i+1]; i++; }
+		else if (strcmp(argv[i], "-progressive")==0) { settings.progressive = true; }
+		else if (strcmp(argv[i], "-preview")==0) { settings.preview = argv[i+1]; settings.progressive = true; i++; }
+		else if (strcmp(argv[i], "-preview_interval")==0) { if (!has_float) return wants_number(argv[i]); settings.preview_interval = float_value; i++; }
+		else if (strcmp(argv[i], "-pass_budget")==0) { if (!has_float) return wants_number(argv[i]); settings.pass_budget = float_value; settings.progressive = true; i++; }
+		else if (strcmp(argv[i], "-shard")==0) {
+			if (i+1 >= argc || sscanf(argv[i+1], "%u/%u", &settings.shard_index, &settings.num_shards) != 2 || settings.shard_index >= settings.num_shards) {
+				printf("-shard wants i/N with i < N\n");
+				return false;
+			}
+			i++;
+		}
+		else if (strcmp(argv[i], "-shard_by")==0) {
+			     if (strcmp(argv[i+1], "tiles")==0)   settings.shard_mode = SHARD_TILES;
+			else if (strcmp(argv[i+1], "samples")==0) settings.shard_mode = SHARD_SAMPLES;
+			else {
+				printf("Invalid shard mode '%s'\n", argv[i+1]);
+				return false;
+			}
+			i++;
+		}
+		else if (strcmp(argv[i], "-sampler")==0) {
+			uint32_t s = 0;
+			while (s < NUM_SAMPLERS && strcmp(argv[i+1], sampler_name((SamplerType)s))!=0)
+				s++;
+			if (s == NUM_SAMPLERS) {
+				printf("Invalid sampler '%s'\n", argv[i+1]);
+				return false;
+			}
+			settings.sampler = (SamplerType)s;
+			i++;
+		}
+		else if (strcmp(argv[i], "-look_from")==0 || strcmp(argv[i], "-look_at")==0) {
+			const bool from = strcmp(argv[i], "-look_from")==0;
+			Float3 &p = from ? settings.look_from : settings.look_at;
+			if (i+1 >= argc || sscanf(argv[i+1], "%f,%f,%f", &p.x, &p.y, &p.z) != 3) {
+				printf("%s wants x,y,z\n", argv[i]);
+				return false;
+			}
+			(from ? settings.has_look_from : settings.has_look_at) = true;
+			i++;
+		}
+		else if (strcmp(argv[i], "-server")==0) { settings.server = true; }
+		else if (strcmp(argv[i], "-pin")==0) {
+			     if (strcmp(argv[i+1], "none")==0)  settings.pinning = PIN_NONE;
+			else if (strcmp(argv[i+1], "cores")==0) settings.pinning = PIN_CORES;
+			else if (strcmp(argv[i+1], "nodes")==0) settings.pinning = PIN_NODES;
+			else {
+				printf("Invalid pinning '%s'\n", argv[i+1]);
+				return false;
+			}
+			i++;
+		}
+		else if (strcmp(argv[i], "-tile_size")==0) {
+			if (i+1 < argc && strcmp(argv[i+1], "auto")==0)
+				settings.tile_size = 0;
+			else if (has_uint && uint_value > 0 && uint_value <= MAX_TILE_SIZE)
+				settings.tile_size = uint_value;
+			else {
+				printf("-tile_size wants auto or 1 to %d\n", MAX_TILE_SIZE);
+				return false;
+			}
+			i++;
+		}
+		else if (strcmp(argv[i], "-tile_order")==0) {
+			     if (strcmp(argv[i+1], "row")==0)     settings.tile_order = TILE_ORDER_ROW;
+			else if (strcmp(argv[i+1], "morton")==0)  settings.tile_order = TILE_ORDER_MORTON;
+			else if (strcmp(argv[i+1], "hilbert")==0) settings.tile_order = TILE_ORDER_HILBERT;
+			else {
+				printf("Invalid tile order '%s'\n", argv[i+1]);
+				return false;
+			}
+			i++;
+		}
 		else {
 			printf("Invalid command line option '%s'", argv[i]);
 			return false;
 		}
 	}
 
-	// TODO: Support partial tiles?
-	if ((settings.width  % TILESIZE)!=0) return false;
-	if ((settings.height % TILESIZE)!=0) return false;
-
-	const uint32_t num_tiles_x = (settings.width  + TILESIZE-1)/TILESIZE;
-	const uint32_t num_tiles_y = (settings.height + TILESIZE-1)/TILESIZE;
-	const uint32_t num_tiles = num_tiles_x * num_tiles_y;
+	if (settings.width == 0 || settings.height == 0) {
+		printf("The image needs at least one pixel\n");
+		return false;
+	}
 
 	if (settings.num_threads == 0) {
-		settings.num_threads = std::min(std::thread::hardware_concurrency(), num_tiles);
+		settings.num_threads = std::min(std::thread::hardware_concurrency(), num_tiles(tile_layout(settings)));
+	}
+	if (settings.tile_size == 0 && settings.checkpoint) {
+		// The calibration might pick another size next time, and shards must all have the same
+		printf("-tile_size auto can't be used with -checkpoint\n");
+		return false;
+	}
+	if (settings.wavefront && !wavefront_function) {
+		printf("This post has no wavefront integrator\n");
+		return false;
+	}
+	if (settings.wavefront && settings.packets) {
+		printf("Can't use both -wavefront and -packets\n");
+		return false;
+	}
+	if (settings.resume && !settings.checkpoint) {
+		printf("-resume needs a -checkpoint file\n");
+		return false;
+	}
+#if PATHTRACER_EMBREE
+	if (settings.bvh_cache) {
+		printf("Embree can't save what it builds, -bvh_cache is ignored\n");
+		settings.bvh_cache = nullptr;
+	}
+#endif
+#if !PATHTRACER_STATS
+	if (settings.trace) {
+		printf("-trace needs a build with the CMake option PATHTRACER_STATS\n");
+		return false;
+	}
+#endif
+	if (settings.reference && !settings.json) {
+		printf("-reference needs -json to report the RMSE in\n");
+		return false;
+	}
+	if (settings.cameras && settings.orbit != 0) {
+		printf("Use either -cameras or -orbit\n");
+		return false;
+	}
+	if ((settings.cameras || settings.orbit != 0) && (settings.checkpoint || settings.progressive || settings.reference || settings.server || settings.ray_benchmark || settings.rmse_report)) {
+		printf("-cameras and -orbit can't be used with -checkpoint, -progressive, -reference, -server, -ray_benchmark or -rmse_report\n");
+		return false;
+	}
+	if (settings.num_pillars != 0 && settings.scene) {
+		printf("-pillars is for the built-in scene\n");
+		return false;
+	}
+	if (settings.write_scene && !settings.scene) {
+		printf("-write_scene needs a -scene to convert\n");
+		return false;
+	}
+	if (settings.progressive && settings.checkpoint) {
+		// TODO: Checkpoints would be written after every round
+		printf("-progressive can't be used with -checkpoint\n");
+		return false;
+	}
+	if (settings.num_shards > 1 && !settings.checkpoint) {
+		printf("-shard needs a -checkpoint file to write the partial framebuffer to\n");
+		return false;
+	}
+	if (settings.num_samples == 0) {
+		printf("Need at least one sample per pixel\n");
+		return false;
+	}
+	if (settings.num_shards > 1 && settings.shard_mode == SHARD_SAMPLES) {
+		if (settings.adaptive_threshold != 0.0f) {
+			printf("Adaptive sampling can't be split by samples, use -shard_by tiles\n");
+			return false;
+		}
+		const uint32_t sample_end = (uint32_t)((uint64_t)settings.num_samples * (settings.shard_index+1) / settings.num_shards);
+		settings.sample_offset = (uint32_t)((uint64_t)settings.num_samples * settings.shard_index / settings.num_shards);
+		settings.num_samples = sample_end - settings.sample_offset;
+		if (settings.num_samples == 0) {
+			printf("Shard %d/%d gets no samples\n", settings.shard_index, settings.num_shards);
+			return false;
+		}
+	}
+	if (settings.wavefront && settings.adaptive_threshold != 0.0f) {
+		printf("Adaptive sampling is not supported by the wavefront integrator\n");
+		return false;
+	}
+	if (settings.adaptive_threshold != 0.0f && settings.num_passes == 1) {
+		// Adaptive sampling needs passes to be able to stop
+		settings.num_passes = std::max(settings.num_samples / ADAPTIVE_MIN_SAMPLES, 1u);
+	}
+	// No empty passes at the end
+	settings.num_passes = std::max(std::min(settings.num_passes, settings.num_samples), 1u);
+	settings.num_passes = (settings.num_samples + samples_per_pass(settings) - 1) / samples_per_pass(settings);
+	printf("Render image %d in %dx%d (%d spp, %s, %d threads%s) to '%s'\n", settings.image_index, settings.width, settings.height, settings.num_samples, sampler_name(settings.sampler), settings.num_threads, settings.wavefront ? ", wavefront" : (settings.packets ? ", packets" : ""), settings.write_scene ? settings.write_scene : (settings.ray_benchmark ? "ray benchmark" : (settings.rng_benchmark ? "rng benchmark" : (settings.rmse_report ? "rmse report" : (settings.num_shards > 1 ? settings.checkpoint : settings.output)))));
+	if (settings.num_shards > 1) {
+		if (settings.shard_mode == SHARD_SAMPLES)
+			printf("Shard %d/%d: samples %d to %d\n", settings.shard_index, settings.num_shards, settings.sample_offset, settings.sample_offset + settings.num_samples - 1);
+		else
+			printf("Shard %d/%d: every %d:th tile\n", settings.shard_index, settings.num_shards, settings.num_shards);
+	}
+	if (settings.pinning != PIN_NONE) {
+		const ThreadPlacement placement = place_threads(cpu_topology(), settings.num_threads, settings.pinning);
+		printf("Pinning threads to %s on %d NUMA nodes\n", settings.pinning == PIN_CORES ? "cores" : "nodes", placement.node.back() + 1);
 	}
-	printf("Render image %d in %dx%d (%d spp, %d threads) to '%s'\n", settings.image_index, settings.width, settings.height, settings.num_samples, settings.num_threads, settings.output);
 	return true;
 }
 
-int main(int argc, char **argv) {
-	Settings settings;
-	if (!parse_command_line(settings, argc, argv))
-		return 1;
-	
-	const uint32_t width       = settings.width;
-	const uint32_t height      = settings.height;
-	const uint32_t num_threads = settings.num_threads;
-	const uint32_t num_tiles_x = (settings.width  + TILESIZE-1)/TILESIZE;
-	const uint32_t num_tiles_y = (settings.height + TILESIZE-1)/TILESIZE;
-	const uint32_t num_tiles   = num_tiles_x * num_tiles_y;
+/*
+	Renders one pass over a tile into pass_pixels, which are cleared by the caller. In adaptive mode the pass goes to
+	the pixels that still need samples according to the earlier passes in tile_pixels. Passes are then rendered one
+	after the other. Otherwise each pass has a fixed range of sample indices, counted from the number of samples each
+	pixel had when the render started (tile_first_sample). tile_pixels is not looked at then, since other threads
+	might be merging into it. Sample indices are offset by settings.sample_offset when the samples are sharded.
+*/
+void render_tile(ThreadContext &thread_context, const Settings &settings, const Scene &scene, const Camera &camera, const TileRect &rect, uint32_t pass, const Pixel *tile_pixels, const uint32_t *tile_first_sample, Pixel *pass_pixels) {
+	const uint32_t width = settings.width;
+	const uint32_t height = settings.height;
+	const uint32_t num_samples = settings.num_samples;
+	const uint32_t num_pass_samples = samples_per_pass(settings);
+	const bool adaptive = settings.adaptive_threshold != 0.0f;
+	const uint32_t sample_offset = settings.sample_offset;
+	const float iw = 1.0f/width;
+	const float ih = 1.0f/height;
+	const uint32_t num_tile_pixels = rect.width * rect.height;
 
-	RTCDevice embree_device = rtcNewDevice();
-	Scene scene;
-	rtcDeviceSetErrorFunction2(embree_device, embree_error, nullptr);
-	create_scene(embree_device, scene);
+	if (settings.wavefront) {
+		const uint32_t sample_start = tile_first_sample[0] + pass * num_pass_samples; // All pixels of the tile have the same
+		assert(sample_start < num_samples);
+		const uint32_t n = std::min(num_pass_samples, num_samples - sample_start);
+		wavefront_function(thread_context, scene, camera, rect.x, rect.y, rect.width, rect.height, width, height, sample_offset + sample_start, n, pass_pixels);
+		return;
+	}
 
-	std::vector<Pixel> framebuffer;
-	framebuffer.resize(width*height);
-	memset(&framebuffer[0], 0, sizeof(Pixel)*width*height);
+	// Pixels that get samples in this pass and the first sample index of each
+	uint32_t active[MAX_TILE_SIZE*MAX_TILE_SIZE];
+	uint32_t sample_start[MAX_TILE_SIZE*MAX_TILE_SIZE];
+	uint32_t num_active = 0;
+	for (uint32_t i = 0; i < num_tile_pixels; i++) {
+		if (adaptive && !needs_samples(tile_pixels[i], settings))
+			continue;
+		sample_start[i] = adaptive ? tile_pixels[i].N : tile_first_sample[i] + pass * num_pass_samples;
+		if (sample_start[i] < num_samples)
+			active[num_active++] = i;
+	}
 
-	Camera camera;
-	camera.position = float3(0,5,-15);
-	camera.forward = float3(0,0,1);
-	// TODO: Do aspect ratio at least
-	camera.up = float3(0,-1,0); // TODO: Choose a coordinate system and act accordingly! -1 fixes that v value is upside down.. or is it?
-	camera.right = float3(1,0,0);
+	if (settings.packets) {
+		// Camera rays for PACKET_SIZE pixels are traced together. trace_camera_ray picks them up.
+		CameraPacket &packet = thread_context.camera_packet;
+		uint32_t packet_pixel[PACKET_SIZE];
+		for (uint32_t s = 0; s < num_pass_samples; s++) {
+			for (uint32_t a = 0; a < num_active;) {
+				packet.count = 0;
+				for (; a < num_active && packet.count < PACKET_SIZE; a++) {
+					const uint32_t p = active[a];
+					if (sample_start[p] + s >= num_samples)
+						continue;
+					const uint32_t i = packet.count++;
+					packet_pixel[i] = p;
+					packet.x[i] = rect.x + p % rect.width;
+					packet.y[i] = rect.y + p / rect.width;
+					packet.sample_index[i] = sample_offset + sample_start[p] + s;
+					start_sample(thread_context, packet.x[i], packet.y[i], packet.sample_index[i]);
+					const Float2 jitter = sample2d(thread_context);
+					packet.dir[i] = generate_camera_direction(camera, (packet.x[i] + jitter.x) * iw, (packet.y[i] + jitter.y) * ih);
+				}
+				if (packet.count == 0)
+					break;
+				intersect_closest_packet(scene, camera.position, packet.dir, packet.count, packet.hit, packet.hits);
+
+				for (uint32_t i = 0; i < packet.count; i++) {
+					start_sample(thread_context, packet.x[i], packet.y[i], packet.sample_index[i]);
+					Float3 color = pathtrace_sample(thread_context, scene, camera, packet.x[i], packet.y[i], width, height, packet.sample_index[i], iw, ih);
+					add_sample(pass_pixels[packet_pixel[i]], color);
+				}
+			}
+		}
+		packet.count = 0;
+	} else {
+		for (uint32_t a = 0; a < num_active; a++) {
+			const uint32_t p = active[a];
+			const uint32_t x = rect.x + p % rect.width;
+			const uint32_t y = rect.y + p / rect.width;
+			const uint32_t sample_end = std::min(sample_start[p] + num_pass_samples, num_samples);
+			for (uint32_t ns = sample_offset + sample_start[p]; ns < sample_offset + sample_end; ns++) {
+				start_sample(thread_context, x, y, ns);
+				Float3 color = pathtrace_sample(thread_context, scene, camera, x, y, width, height, ns, iw, ih);
+				add_sample(pass_pixels[p], color);
+			}
+		}
+	}
+}
+
+inline bool tile_needs_samples(const Pixel *tile_pixels, uint32_t num_tile_pixels, const Settings &settings) {
+	for (uint32_t i = 0; i < num_tile_pixels; i++) {
+		if (needs_samples(tile_pixels[i], settings))
+			return true;
+	}
+	return false;
+}
+
+/*
+	Merges the passes of the tiles into the framebuffer. Different threads can render passes of the same tile at the
+	same time. The passes of a tile are added in pass order, so the image does not depend on which thread rendered
+	what. A pass that is done before the passes before it is parked as a copy until it is its turn. There are no
+	locks. The thread that sets the merging flag of a tile merges all passes that are ready. Other threads park
+	their pass and move on. With several views (framebuffers) tile view*num_tiles+t is tile t of that view.
+*/
+struct TileMerger {
+	TileMerger(const std::vector<Pixel*> &framebuffers, const TileLayout &layout, uint32_t num_passes) : framebuffers(framebuffers), layout(layout), num_passes(num_passes),
+		tiles(num_tiles(layout) * framebuffers.size()), parked(num_tiles(layout) * framebuffers.size() * num_passes) {
+		for (TileState &state : tiles) {
+			state.num_merged.store(0);
+			state.merging.store(false);
+		}
+		for (std::atomic<Pixel*> &p : parked)
+			p.store(nullptr);
+	}
+
+	void merge(uint32_t tile, uint32_t pass, const Pixel *pass_pixels) {
+		assert(pass < num_passes);
+		TileState &state = tiles[tile];
+		if (state.num_merged.load() == pass && !state.merging.exchange(true)) {
+			// Our turn, no need to copy
+			add(tile, pass_pixels);
+			state.num_merged.store(pass + 1);
+			state.merging.store(false);
+		} else {
+			const TileRect rect = tile_rect(layout, tile % num_tiles(layout));
+			Pixel *copy = new Pixel[rect.width*rect.height];
+			memcpy(copy, pass_pixels, sizeof(Pixel)*rect.width*rect.height);
+			parked[tile * num_passes + pass].store(copy);
+		}
+		merge_parked(tile);
+	}
+
+	// Waits until a pass of a tile has been merged. It can be parked while a checkpoint copies the tile.
+	void wait_merged(uint32_t tile, uint32_t pass) {
+		TileState &state = tiles[tile];
+		while (state.num_merged.load() <= pass) {
+			merge_parked(tile);
+			std::this_thread::yield();
+		}
+	}
+
+	// Copies the merged passes of a tile. Waits if another thread is merging into it.
+	void snapshot(uint32_t tile, Pixel *out_pixels) {
+		TileState &state = tiles[tile];
+		while (state.merging.exchange(true))
+			std::this_thread::yield();
+		const TileRect rect = tile_rect(layout, tile % num_tiles(layout));
+		memcpy(out_pixels, tile_pixels(tile), sizeof(Pixel)*rect.width*rect.height);
+		state.merging.store(false);
+		merge_parked(tile); // Passes might have been parked while we had the flag
+	}
+
+	// Merges all parked passes of a tile. Call when every pass of it has been given to merge.
+	void finish(uint32_t tile) {
+		TileState &state = tiles[tile];
+		while (state.merging.exchange(true))
+			std::this_thread::yield();
+		for (uint32_t pass = state.num_merged.load(); pass < num_passes; pass++) {
+			Pixel *pass_pixels = parked[tile * num_passes + pass].exchange(nullptr);
+			if (!pass_pixels)
+				break;
+			add(tile, pass_pixels);
+			delete [] pass_pixels;
+			state.num_merged.store(pass + 1);
+		}
+		state.merging.store(false);
+	}
+
+private:
+	struct TileState {
+		std::atomic<uint32_t> num_merged;
+		std::atomic<bool> merging;
+	};
+
+	Pixel *tile_pixels(uint32_t tile) {
+		const uint32_t n = num_tiles(layout);
+		return framebuffers[tile / n] + tile_rect(layout, tile % n).offset;
+	}
+
+	void add(uint32_t tile, const Pixel *pass_pixels) {
+		const TileRect rect = tile_rect(layout, tile % num_tiles(layout));
+		Pixel *pixels = tile_pixels(tile);
+		for (uint32_t i = 0; i < rect.width*rect.height; i++)
+			add_pixel(pixels[i], pass_pixels[i]);
+	}
+
+	void merge_parked(uint32_t tile) {
+		TileState &state = tiles[tile];
+		while (true) {
+			const uint32_t next = state.num_merged.load();
+			if (next == num_passes || parked[tile * num_passes + next].load() == nullptr)
+				return;
+			if (state.merging.exchange(true))
+				return; // Whoever is merging checks for parked passes again when done
+
+			for (uint32_t pass = state.num_merged.load(); pass < num_passes; pass++) {
+				Pixel *pass_pixels = parked[tile * num_passes + pass].exchange(nullptr);
+				if (!pass_pixels)
+					break;
+				add(tile, pass_pixels);
+				delete [] pass_pixels;
+				state.num_merged.store(pass + 1);
+			}
+			state.merging.store(false);
+		}
+	}
+
+	const std::vector<Pixel*> framebuffers; // Per view
+	const TileLayout layout;
+	const uint32_t num_passes;
+	std::vector<TileState> tiles;
+	std::vector<std::atomic<Pixel*>> parked; // tile * num_passes + pass
+};
+
+struct RenderStats {
+	double seconds = 0.0;
+	uint64_t num_rays = 0;
+	uint64_t num_cycles = 0; // Spent rendering tiles, summed over the threads
+	std::vector<TileEvent> tile_events; // With -trace
+	std::vector<double> idle_seconds;
+	std::vector<uint32_t> num_steals;
+	double num_samples = 0.0; // Rendered now, not counting what was in the framebuffer before
+	uint32_t num_checkpoints = 0;
+	double checkpoint_seconds = 0.0;
+	uint32_t num_previews = 0;
+	double preview_seconds = 0.0; // Writing them
+	double first_preview_seconds = 0.0; // From the start of the render
+};
+
+void write_checkpoint(Checkpoint &checkpoint, TileMerger &merger, const TileLayout &layout) {
+	Pixel *pixels = checkpoint.begin_write();
+	for (uint32_t tile = 0; tile < num_tiles(layout); tile++)
+		merger.snapshot(tile, pixels + tile_rect(layout, tile).offset);
+	if (!checkpoint.commit())
+		printf("Failed to write checkpoint\n");
+}
+
+/*
+	Adds samples to the framebuffers (tiled, see framebuffer_offset) of num_views views of the scene until all pixels
+	have settings.num_samples, or have converged in adaptive mode. Pixels can already have samples, from a checkpoint.
+	The tiles of all views go in the same queues, so threads don't wait for each other between views. view_done is
+	called on the calling thread for each view when its framebuffer is complete, which can be before the others are.
+	If checkpoint is set (one view only) the framebuffer is saved to it every settings.checkpoint_interval seconds and
+	when done.
+*/
+RenderStats render_views(const Settings &settings, const Scene &scene, const Camera *cameras, std::vector<Pixel> *framebuffers, uint32_t num_views,
+	Checkpoint *checkpoint, const std::function<void(uint32_t view)> &view_done)
+{
+	const uint32_t width       = settings.width;
+	const uint32_t height      = settings.height;
+	const uint32_t num_threads = settings.num_threads;
+	const TileLayout layout = tile_layout(settings);
+	const bool adaptive = settings.adaptive_threshold != 0.0f;
+	assert(!checkpoint || num_views == 1);
+
+	const uint32_t num_tiles = ::num_tiles(layout);
+	const uint32_t num_pass_samples = samples_per_pass(settings);
+	std::vector<Pixel*> view_pixels(num_views);
+	for (uint32_t view = 0; view < num_views; view++) {
+		assert(framebuffers[view].size() == width*height);
+		view_pixels[view] = &framebuffers[view][0];
+	}
+	TileMerger merger(view_pixels, layout, settings.num_passes);
+
+	std::vector<uint32_t> first_sample(num_views*width*height);
+	double num_samples_before = 0.0;
+	for (uint32_t view = 0; view < num_views; view++) {
+		for (uint32_t i = 0; i < width*height; i++) {
+			first_sample[view*width*height + i] = framebuffers[view][i].N;
+			num_samples_before += framebuffers[view][i].N;
+		}
+	}
 
-	std::atomic<uint32_t> next_tile_generator = 0;
+	// All passes are queued up front, except in adaptive mode where a pass depends on the earlier ones. A tile shard
+	// takes every num_shards:th tile along the tile order, so all shards get some of the expensive parts of the image.
+	// Task tiles count over all views, view*num_tiles + tile.
+	const std::vector<uint32_t> tiles = tile_order(layout.num_tiles_x, layout.num_tiles_y, settings.tile_order);
+	std::vector<TileTask> initial_tasks;
+	std::vector<std::atomic<uint32_t>> view_tasks_left(num_views); // Tasks queued or being worked on
+	for (uint32_t view = 0; view < num_views; view++) {
+		const size_t num_tasks_before = initial_tasks.size();
+		for (uint32_t k = 0; k < num_tiles; k++) {
+			const uint32_t tile = tiles[k];
+			if (settings.shard_mode == SHARD_TILES && k % settings.num_shards != settings.shard_index)
+				continue;
+			const TileRect rect = tile_rect(layout, tile);
+			const uint32_t *tile_first_sample = &first_sample[view*width*height + rect.offset];
+			if (adaptive) {
+				if (tile_needs_samples(&framebuffers[view][rect.offset], rect.width*rect.height, settings))
+					initial_tasks.push_back(TileTask{view*num_tiles + tile, 0});
+				continue;
+			}
+			const uint32_t tile_first = *std::min_element(tile_first_sample, tile_first_sample + rect.width*rect.height);
+			const uint32_t num_tile_passes = tile_first < settings.num_samples ? (settings.num_samples - tile_first + num_pass_samples - 1) / num_pass_samples : 0;
+			for (uint32_t pass = 0; pass < num_tile_passes; pass++)
+				initial_tasks.push_back(TileTask{view*num_tiles + tile, pass});
+		}
+		view_tasks_left[view].store((uint32_t)(initial_tasks.size() - num_tasks_before));
+	}
+	TileScheduler scheduler(num_threads);
+	scheduler.add_initial_tasks(initial_tasks);
+	const bool pinned = settings.pinning != PIN_NONE;
+	ThreadPlacement placement; // Reads the topology from sysfs, so only when pinning
+	if (pinned) {
+		placement = place_threads(cpu_topology(), num_threads, settings.pinning);
+		scheduler.set_thread_nodes(placement.node);
+	}
+	std::atomic<uint32_t> num_threads_touched(0);
+
+	std::atomic<uint64_t> total_ray_count(0);
+	std::atomic<uint64_t> total_cycle_count(0);
+	std::atomic<uint32_t> num_threads_done(0);
+	std::vector<std::vector<TileEvent>> thread_tile_events(num_threads);
+	const auto render_start = std::chrono::high_resolution_clock::now();
 
 	// TODO: Is there a benefit passing all the captured stuff as parameters? We have them in scope when we call the function so might as well
-	auto thread_func = [&settings, &next_tile_generator, num_tiles, num_tiles_x, &framebuffer, height, width, &scene, &camera](uint32_t thread_index) {
-		ThreadContext thread_context;
+	auto thread_func = [&settings, &scheduler, &merger, &total_ray_count, &total_cycle_count, &num_threads_done, &thread_tile_events, &render_start, &layout, num_tiles, num_threads, adaptive, pinned, &placement, &num_threads_touched, &view_tasks_left, &view_pixels, &first_sample, &scene, cameras](uint32_t thread_index) {
+		thread_ray_count = 0;
+		ThreadContext thread_context = {};
 		thread_context.image_index = settings.image_index;
 		thread_context.thread_index = thread_index;
-		const float iw = 1.0f/width;
-		const float ih = 1.0f/height;
-		const uint32_t num_samples = settings.num_samples;
-		while (true) {
-			uint32_t tile = next_tile_generator++;
-			if (tile >= num_tiles)
-				return;
-			const uint32_t tile_start_x = (tile % num_tiles_x) * TILESIZE;
-			const uint32_t tile_start_y = (tile / num_tiles_x) * TILESIZE;
-
-			uint32_t destination_offset = tile * (TILESIZE * TILESIZE);
-			for (uint32_t y = 0; y<TILESIZE; ++y) {
-				for (uint32_t x = 0; x<TILESIZE; ++x, ++destination_offset) {
-					for (uint32_t ns = 0; ns < num_samples; ns++) {
-						Pixel &pixel = framebuffer[destination_offset];
-						Float3 color = pathtrace_sample(thread_context, scene, camera, tile_start_x+x, tile_start_y+y, width, height, ns, iw, ih);
-						pixel.N++;
-						pixel.rgb += (color-pixel.rgb) * (1.0f/pixel.N);
-					}
+		thread_context.seed = settings.seed;
+		thread_context.sampler = settings.sampler;
+
+		if (pinned) {
+			pin_current_thread(placement.cpus[thread_index]);
+			// The pages of the tiles we start out with are allocated on our node, if main released them. Everyone
+			// has to be done before rendering, since pages are shared with the neighbouring tiles.
+			for (const TileTask &task : scheduler.queued_tasks(thread_index)) {
+				const TileRect rect = tile_rect(layout, task.tile % num_tiles);
+				if (task.pass == 0)
+					touch_pages(view_pixels[task.tile / num_tiles] + rect.offset, sizeof(Pixel)*rect.width*rect.height);
+			}
+			num_threads_touched++;
+			while (num_threads_touched.load() != num_threads)
+				std::this_thread::yield();
+		}
+
+		std::vector<Pixel> pass_pixels(layout.tile_size*layout.tile_size);
+		uint64_t cycle_count = 0;
+
+		TileTask task;
+		while (scheduler.next(thread_index, task)) {
+			const uint32_t view = task.tile / num_tiles;
+			const TileRect rect = tile_rect(layout, task.tile % num_tiles);
+			const Pixel *tile_pixels = view_pixels[view] + rect.offset;
+
+			memset(&pass_pixels[0], 0, sizeof(Pixel)*rect.width*rect.height);
+#if PATHTRACER_STATS
+			const auto tile_start_time = std::chrono::high_resolution_clock::now();
+#endif
+			const uint64_t tile_start_cycles = read_cycle_counter();
+			{
+				STAT_SCOPED_TIMER(STAT_TIMER_TILE);
+				render_tile(thread_context, settings, scene, cameras[view], rect, task.pass, tile_pixels, &first_sample[view*layout.width*layout.height + rect.offset], &pass_pixels[0]);
+			}
+			cycle_count += read_cycle_counter() - tile_start_cycles;
+#if PATHTRACER_STATS
+			if (settings.trace) {
+				const auto tile_end_time = std::chrono::high_resolution_clock::now();
+				thread_tile_events[thread_index].push_back(TileEvent{thread_index, task.tile, task.pass,
+					std::chrono::duration<double, std::micro>(tile_start_time - render_start).count(), std::chrono::duration<double, std::micro>(tile_end_time - render_start).count()});
+			}
+#endif
+			merger.merge(task.tile, task.pass, &pass_pixels[0]);
+
+			// In adaptive mode the tile keeps coming back until all pixels have converged. The next pass starts at the
+			// sample counts of the merged pixels, so our pass has to be in them.
+			if (adaptive) {
+				merger.wait_merged(task.tile, task.pass);
+				if (tile_needs_samples(tile_pixels, rect.width*rect.height, settings)) {
+					view_tasks_left[view]++;
+					scheduler.push(thread_index, TileTask{task.tile, task.pass+1});
 				}
 			}
+			view_tasks_left[view]--;
+			scheduler.complete();
+		}
+		total_ray_count += thread_ray_count;
+		total_cycle_count += cycle_count;
+		merge_thread_stats();
+		num_threads_done++;
+	};
+
+	render_threads().start(num_threads, thread_func);
+
+	RenderStats stats;
+	auto timed_checkpoint = [&]() {
+		const auto start = std::chrono::high_resolution_clock::now();
+		write_checkpoint(*checkpoint, merger, layout);
+		stats.checkpoint_seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		stats.num_checkpoints++;
+	};
+
+	// A view is done when all its tasks are. Passes that are still parked then are merged here.
+	std::vector<bool> view_reported(num_views, false);
+	auto report_done_views = [&]() {
+		for (uint32_t view = 0; view < num_views; view++) {
+			if (view_reported[view] || view_tasks_left[view].load() != 0)
+				continue;
+			for (uint32_t tile = 0; tile < num_tiles; tile++)
+				merger.finish(view*num_tiles + tile);
+			view_reported[view] = true;
+			view_done(view);
 		}
 	};
 
-	std::vector<std::thread> threads;
+	if (checkpoint || view_done) {
+		// We have nothing better to do while the others render
+		auto last_checkpoint = std::chrono::high_resolution_clock::now();
+		while (num_threads_done.load() != num_threads) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(checkpoint ? 50 : 5));
+			const auto now = std::chrono::high_resolution_clock::now();
+			if (checkpoint && std::chrono::duration<double>(now - last_checkpoint).count() >= settings.checkpoint_interval) {
+				timed_checkpoint();
+				last_checkpoint = now;
+			}
+			if (view_done)
+				report_done_views();
+		}
+	}
+
+	render_threads().wait();
+
+	if (checkpoint)
+		timed_checkpoint();
+
+	stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - render_start).count();
+	if (view_done)
+		report_done_views();
+	stats.num_rays = total_ray_count;
+	stats.num_cycles = total_cycle_count;
+	for (const std::vector<TileEvent> &events : thread_tile_events)
+		stats.tile_events.insert(stats.tile_events.end(), events.begin(), events.end());
+	for (uint32_t view = 0; view < num_views; view++) {
+		for (uint32_t i = 0; i < width*height; i++)
+			stats.num_samples += framebuffers[view][i].N;
+	}
+	stats.num_samples -= num_samples_before;
 	for (uint32_t i = 0; i<num_threads; ++i) {
-		std::thread t(thread_func, i);
-		threads.push_back(std::move(t));
+		stats.idle_seconds.push_back(scheduler.idle_seconds(i));
+		stats.num_steals.push_back(scheduler.num_steals(i));
 	}
+	return stats;
+}
+
+// One view, see render_views
+RenderStats render_image(const Settings &settings, const Scene &scene, const Camera &camera, std::vector<Pixel> &framebuffer, Checkpoint *checkpoint) {
+	return render_views(settings, scene, &camera, &framebuffer, 1, checkpoint, nullptr);
+}
+
+// Written to a temporary file that is then renamed, so a viewer polling the file never reads half an image
+bool write_preview(const Settings &settings, const std::vector<Pixel> &framebuffer) {
+	std::string temp = settings.preview;
+	const size_t dot = temp.find_last_of('.');
+	const size_t slash = temp.find_last_of("/\\");
+	temp.insert(dot != std::string::npos && (slash == std::string::npos || dot > slash) ? dot : temp.size(), ".partial");
+	if (!write_image(temp.c_str(), framebuffer, tile_layout(settings), settings.seed, settings.num_threads))
+		return false;
+#if defined(_WIN32)
+	remove(settings.preview); // rename does not replace files on Windows
+#endif
+	return rename(temp.c_str(), settings.preview) == 0;
+}
+
+/*
+	Progressive mode for look-dev. The image is rendered in rounds of render_image that give every pixel a few more
+	samples, so there is a whole (noisy) image after the first round. The sample indices of a round continue where the
+	previous one stopped, as when resuming from a checkpoint, so the samples are the same as in a batch render. The
+	image so far is written to settings.preview after the first round, every settings.preview_interval seconds and when
+	done. With a pass budget the number of samples per round is picked from the time per sample of the last round.
+*/
+RenderStats render_progressive(const Settings &settings, const Scene &scene, const Camera &camera, std::vector<Pixel> &framebuffer) {
+	const bool adaptive = settings.adaptive_threshold != 0.0f;
+	Settings round_settings = settings;
+	round_settings.num_passes = 1;
+	uint32_t round_samples = 1;
+	uint32_t samples_done = 0; // By the pixels that got the most
+
+	RenderStats stats;
+	stats.idle_seconds.resize(settings.num_threads, 0.0);
+	stats.num_steals.resize(settings.num_threads, 0);
+	const auto render_start = std::chrono::high_resolution_clock::now();
+	auto last_preview = render_start;
+	while (samples_done < settings.num_samples) {
+		round_settings.num_samples = std::min(samples_done + round_samples, settings.num_samples);
+		const double round_start_us = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - render_start).count();
+		const RenderStats round = render_image(round_settings, scene, camera, framebuffer, nullptr);
+
+		stats.num_rays += round.num_rays;
+		stats.num_cycles += round.num_cycles;
+		stats.num_samples += round.num_samples;
+		for (uint32_t i = 0; i < settings.num_threads; i++) {
+			stats.idle_seconds[i] += round.idle_seconds[i];
+			stats.num_steals[i] += round.num_steals[i];
+		}
+		for (TileEvent event : round.tile_events) {
+			event.start_us += round_start_us;
+			event.end_us += round_start_us;
+			stats.tile_events.push_back(event);
+		}
+
+		if (settings.pass_budget > 0.0f && round.seconds > 0.0) {
+			// Assumes the next round costs about the same per sample
+			const double seconds_per_sample = round.seconds / (round_settings.num_samples - samples_done);
+			round_samples = (uint32_t)std::max(std::min(settings.pass_budget / seconds_per_sample, (double)settings.num_samples), 1.0);
+		}
+		samples_done = round_settings.num_samples;
+		const bool done = samples_done >= settings.num_samples || (adaptive && round.num_samples == 0.0); // Or everything has converged
 
-	for (auto &t : threads) {
-		t.join();
+		const auto now = std::chrono::high_resolution_clock::now();
+		if (settings.preview && (stats.num_previews == 0 || done || std::chrono::duration<double>(now - last_preview).count() >= settings.preview_interval)) {
+			if (!write_preview(settings, framebuffer))
+				printf("Failed to write '%s'\n", settings.preview);
+			last_preview = std::chrono::high_resolution_clock::now();
+			stats.preview_seconds += std::chrono::duration<double>(last_preview - now).count();
+			if (stats.num_previews++ == 0)
+				stats.first_preview_seconds = std::chrono::duration<double>(last_preview - render_start).count();
+		}
+		if (done)
+			break;
 	}
+	stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - render_start).count();
+	return stats;
+}
 
-	RandomContext random_context;
+/*
+	Picks the tile size for -tile_size auto. Small tiles keep all threads busy until the end of the render, large ones
+	have less scheduling and merging overhead per pixel and keep rays that see the same parts of the scene together.
+	Each size that gives the threads a few tiles each is timed with a one sample per pixel render of the image.
+*/
+uint32_t autotune_tile_size(const Settings &settings, const Scene &scene, const Camera &camera) {
+	const uint32_t candidates[] = {8, 16, 32, 64};
+	const uint32_t MIN_TILES_PER_THREAD = 4;
 
-	std::vector<uint32_t> byte_data(width*height);
-	for (uint32_t y=0, ofs=0; y<height; y++) {
-		for (uint32_t x=0; x<width; x++, ofs++) {
+	Settings calibration = settings;
+	calibration.num_samples = 1;
+	calibration.num_passes = 1;
+	calibration.adaptive_threshold = 0.0f;
+	calibration.sample_offset = 0;
+	calibration.num_shards = 1;
+	calibration.shard_index = 0;
+	calibration.trace = nullptr;
 
-			// Lets figure out the "tiled" coordinate of this pixel
-			uint32_t tx = x / TILESIZE, ty = y / TILESIZE;
-			uint32_t lx = x - tx * TILESIZE, ly = y - ty * TILESIZE;
-			uint32_t tile = ty * num_tiles_x + tx;
-			uint32_t source_ofs = tile * (TILESIZE * TILESIZE) + ly * TILESIZE + lx;
-			byte_data[ofs] = linear_to_png(framebuffer[source_ofs].rgb, random_context);
+	std::vector<Pixel> framebuffer;
+	uint32_t best_size = DEFAULT_TILE_SIZE;
+	double best_seconds = std::numeric_limits<double>::infinity();
+	for (uint32_t tile_size : candidates) {
+		// The smallest size is always tried, so tiny images get one
+		if (tile_size != candidates[0] && num_tiles(tile_layout(settings.width, settings.height, tile_size)) < MIN_TILES_PER_THREAD * settings.num_threads)
+			break;
+		calibration.tile_size = tile_size;
+		framebuffer.assign(settings.width * settings.height, Pixel());
+		const RenderStats stats = render_image(calibration, scene, camera, framebuffer, nullptr);
+		printf("  Tile size %2d: %.3fs for one sample per pixel\n", tile_size, stats.seconds);
+		if (stats.seconds < best_seconds) {
+			best_seconds = stats.seconds;
+			best_size = tile_size;
 		}
 	}
+	clear_stats(); // Only count the real render
+	return best_size;
+}
+
+void print_render_stats(const RenderStats &stats, const Settings &settings, const std::vector<Pixel> &framebuffer) {
+	// Makes it possible to compare throughput between the scalar and the wavefront integrator
+	double num_paths = 0.0; // Including samples from a checkpoint
+	for (const Pixel &pixel : framebuffer)
+		num_paths += pixel.N;
+	if (settings.adaptive_threshold != 0.0f)
+		printf("Adaptive sampling used %.1f%% of the maximum number of samples\n", 100.0 * num_paths / ((double)settings.width * settings.height * settings.num_samples));
+	printf("Rendered in %.3fs: %.2f Mrays/s, %.2f Msamples/s, %.2f rays per sample, %.0f cycles per ray\n", stats.seconds, stats.num_rays / stats.seconds * 1E-6, stats.num_samples / stats.seconds * 1E-6, stats.num_rays / stats.num_samples,
+		stats.num_rays != 0 ? (double)stats.num_cycles / stats.num_rays : 0.0);
+	if (stats.num_checkpoints != 0)
+		printf("Wrote %d checkpoints in %.3fs\n", stats.num_checkpoints, stats.checkpoint_seconds);
+	if (stats.num_previews != 0)
+		printf("Wrote %d previews to '%s' in %.3fs, the first after %.3fs\n", stats.num_previews, settings.preview, stats.preview_seconds, stats.first_preview_seconds);
+	for (uint32_t i = 0; i<(uint32_t)stats.idle_seconds.size(); ++i) {
+		printf("  Thread %2d: idle %.3fs (%.1f%%), %d steals\n", i, stats.idle_seconds[i], 100.0 * stats.idle_seconds[i] / stats.seconds, stats.num_steals[i]);
+	}
+}
+
+bool read_reference(const char *filename, const Settings &settings, std::vector<Float3> &out_reference) {
+	uint32_t reference_width = 0, reference_height = 0;
+	if (!read_pfm(filename, reference_width, reference_height, out_reference)) {
+		printf("Could not read reference image '%s'\n", filename);
+		return false;
+	}
+	if (reference_width != settings.width || reference_height != settings.height) {
+		printf("Reference image is %dx%d, expected %dx%d\n", reference_width, reference_height, settings.width, settings.height);
+		return false;
+	}
+	return true;
+}
+
+// Wall clock time of the phases of a run
+struct PhaseTimes {
+	double load_seconds = 0.0;
+	double build_seconds = 0.0;
+	ImageWriteTimes write;
+};
+
+void write_json_string(FILE *f, const char *str) {
+	fputc('"', f);
+	for (const char *c = str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if ((unsigned char)*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+// One JSON object per run, for pathtracer_bench and anything else that wants to track performance. rmse is negative without -reference.
+bool write_json_report(const char *filename, const char *program, const Settings &settings, const PhaseTimes &times, const RenderStats &stats, double rmse) {
+	FILE *f = fopen(filename, "w");
+	if (!f)
+		return false;
+	fprintf(f, "{\n\t\"integrator\": ");
+	write_json_string(f, program);
+	fprintf(f, ",\n\t\"scene\": ");
+	write_json_string(f, settings.scene ? settings.scene : "builtin");
+	fprintf(f, ",\n\t\"pillars\": %u,\n", settings.num_pillars);
+	fprintf(f, "\t\"width\": %u,\n\t\"height\": %u,\n\t\"spp\": %u,\n\t\"passes\": %u,\n", settings.width, settings.height, settings.num_samples, settings.num_passes);
+	fprintf(f, "\t\"threads\": %u,\n\t\"seed\": %u,\n\t\"sampler\": \"%s\",\n", settings.num_threads, settings.seed, sampler_name(settings.sampler));
+	fprintf(f, "\t\"mode\": \"%s\",\n", settings.wavefront ? "wavefront" : (settings.packets ? "packets" : "scalar"));
+	fprintf(f, "\t\"load_seconds\": %.6f,\n\t\"build_seconds\": %.6f,\n\t\"trace_seconds\": %.6f,\n", times.load_seconds, times.build_seconds, stats.seconds);
+	fprintf(f, "\t\"resolve_seconds\": %.6f,\n\t\"encode_seconds\": %.6f,\n", times.write.resolve_seconds, times.write.encode_seconds);
+	fprintf(f, "\t\"rays\": %llu,\n\t\"samples\": %.0f,\n", (unsigned long long)stats.num_rays, stats.num_samples);
+	fprintf(f, "\t\"mrays_per_second\": %.4f,\n\t\"msamples_per_second\": %.4f,\n", stats.num_rays / stats.seconds * 1E-6, stats.num_samples / stats.seconds * 1E-6);
+	fprintf(f, "\t\"cycles_per_ray\": %.1f,\n", stats.num_rays != 0 ? (double)stats.num_cycles / stats.num_rays : 0.0);
+	if (rmse >= 0.0)
+		fprintf(f, "\t\"rmse\": %.8f\n}\n", rmse);
+	else
+		fprintf(f, "\t\"rmse\": null\n}\n");
+	return fclose(f) == 0;
+}
+
+// Renders the image with each sampler at 1, 2, 4... spp and prints the RMSE against a reference image
+bool rmse_report(const Settings &settings, const Scene &scene, const Camera &camera) {
+	std::vector<Float3> reference;
+	if (!read_reference(settings.rmse_report, settings, reference))
+		return false;
+
+	printf("%8s", "spp");
+	for (uint32_t s = 0; s < NUM_SAMPLERS; s++)
+		printf(" %10s", sampler_name((SamplerType)s));
+	printf("\n");
+
+	std::vector<Pixel> framebuffer;
+	for (uint32_t spp = 1; spp <= settings.num_samples; spp *= 2) {
+		printf("%8d", spp);
+		for (uint32_t s = 0; s < NUM_SAMPLERS; s++) {
+			Settings sampler_settings = settings;
+			sampler_settings.sampler = (SamplerType)s;
+			sampler_settings.num_samples = spp;
+			sampler_settings.num_passes = 1;
+			sampler_settings.adaptive_threshold = 0.0f;
+			framebuffer.assign(settings.width * settings.height, Pixel());
+			render_image(sampler_settings, scene, camera, framebuffer, nullptr);
+
+			printf(" %10.6f", image_rmse(detile(framebuffer, tile_layout(settings)), reference));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+	return true;
+}
+
+/*
+	Closest hit versus occlusion queries on the same rays, single threaded. The rays start at the first hits of the
+	camera rays and go towards points on the lights (shadow rays) or in cosine distributed directions (bounce rays).
+*/
+void ray_benchmark(const Settings &settings, const Scene &scene, const Camera &camera) {
+	const uint32_t NUM_RAYS = 1 << 19;
+	const float iw = 1.0f/settings.width;
+	const float ih = 1.0f/settings.height;
+
+	RayStream shadow_rays, bounce_rays;
+	shadow_rays.resize(NUM_RAYS);
+	bounce_rays.resize(NUM_RAYS);
+	std::vector<float> shadow_tmax(NUM_RAYS), bounce_tmax(NUM_RAYS, std::numeric_limits<float>::max());
+
+	RandomContext random_context = {};
+	random_context.seed = settings.seed;
+	random_context.sampler = settings.sampler;
+	for (uint32_t i = 0, n = 0; n < NUM_RAYS; i++) {
+		const uint32_t x = i % settings.width, y = (i / settings.width) % settings.height;
+		start_sample(random_context, x, y, i / (settings.width * settings.height));
+		const Float2 jitter = sample2d(random_context);
+		const Float3 dir = generate_camera_direction(camera, (x + jitter.x) * iw, (y + jitter.y) * ih);
+		Hit hit;
+		if (!intersect_closest(scene, camera.position, dir, hit))
+			continue;
+		const Float3 normal = hit_normal(hit);
+		const Float3 pos = bounce_origin(camera.position, dir, hit, normal);
+
+		const float u_light = sample1d(random_context);
+		LightSample light;
+		if (!sample_light(scene, u_light, sample2d(random_context), light)) {
+			printf("Scene has no lights\n");
+			return;
+		}
+		const Float3 to_light = light.pos - pos;
+		const float distance = length(to_light);
+		shadow_rays.set(n, pos, to_light / distance);
+		shadow_tmax[n] = distance * (1.0f - 1E-4f);
+
+		const Float2 u = sample2d(random_context);
+		bounce_rays.set(n, pos, random_cosine_hemisphere(normal, u.x, u.y));
+		n++;
+	}
+
+	std::vector<Hit> results(NUM_RAYS);
+	bool *hit = new bool[NUM_RAYS];
+
+	auto run = [&](const char *name, const RayStream &rays, const float *tmax) {
+		uint32_t num_closest = 0, num_occluded = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < NUM_RAYS; i++)
+			num_closest += intersect_closest(scene, rays.org(i), rays.dir(i), results[i]) ? 1 : 0;
+		const double closest_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < NUM_RAYS; i++)
+			num_occluded += occluded(scene, rays.org(i), rays.dir(i), tmax[i]) ? 1 : 0;
+		const double occluded_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		intersect_closest_stream(scene, rays, NUM_RAYS, hit, &results[0]);
+		const double closest_stream_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		occluded_stream(scene, rays, tmax, NUM_RAYS, hit);
+		const double occluded_stream_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		printf("%-8s %10.2f %10.2f %10.2f %10.2f   %5.1f%% / %5.1f%%\n", name,
+			NUM_RAYS / closest_seconds * 1E-6, NUM_RAYS / occluded_seconds * 1E-6,
+			NUM_RAYS / closest_stream_seconds * 1E-6, NUM_RAYS / occluded_stream_seconds * 1E-6,
+			100.0 * num_closest / NUM_RAYS, 100.0 * num_occluded / NUM_RAYS);
+	};
+
+	printf("Mrays/s for %d rays\n", NUM_RAYS);
+	printf("%-8s %10s %10s %10s %10s   %s\n", "", "closest", "occluded", "closest*N", "occluded*N", "hit / occluded");
+	run("shadow", shadow_rays, &shadow_tmax[0]);
+	run("bounce", bounce_rays, &bounce_tmax[0]);
+	delete [] hit;
+}
+
+/*
+	Nanoseconds per random number, single threaded. Each sample draws NUM_DIMENSIONS numbers after start_sample, like a
+	path with a few bounces does. minstd_rand with uniform_real_distribution is what RandomContext used before it was
+	made counter based, it is only here to compare against.
+*/
+void rng_benchmark(const Settings &settings) {
+	const uint32_t NUM_SAMPLES = 1 << 21;
+	const uint32_t NUM_DIMENSIONS = 16;
+
+	double sum = 0.0; // Printed so that the loops are not optimized away
+	auto run = [&](const char *name, const std::function<void(RandomContext &random_context)> &draw) {
+		RandomContext random_context = {};
+		random_context.seed = settings.seed;
+		random_context.sampler = settings.sampler;
+		const auto start = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < NUM_SAMPLES; i++) {
+			start_sample(random_context, i % settings.width, (i / settings.width) % settings.height, i / (settings.width * settings.height));
+			draw(random_context);
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		printf("%-28s %6.2f ns\n", name, seconds / ((double)NUM_SAMPLES * NUM_DIMENSIONS) * 1E9);
+	};
+
+	std::minstd_rand rng(settings.seed + 1); // Zero is not a valid minstd_rand seed
+	std::uniform_real_distribution<float> distribution;
+	run("minstd_rand", [&](RandomContext &) {
+		for (uint32_t d = 0; d < NUM_DIMENSIONS; d++)
+			sum += distribution(rng);
+	});
+	run("uniform", [&](RandomContext &random_context) {
+		for (uint32_t d = 0; d < NUM_DIMENSIONS; d++)
+			sum += uniform(random_context);
+	});
+	run("uniform_batch", [&](RandomContext &random_context) {
+		float u[NUM_DIMENSIONS];
+		uniform_batch(random_context, u, NUM_DIMENSIONS);
+		for (uint32_t d = 0; d < NUM_DIMENSIONS; d++)
+			sum += u[d];
+	});
+	char name[64];
+	snprintf(name, sizeof(name), "sample1d (%s)", sampler_name(settings.sampler));
+	run(name, [&](RandomContext &random_context) {
+		for (uint32_t d = 0; d < NUM_DIMENSIONS; d++)
+			sum += sample1d(random_context);
+	});
+	snprintf(name, sizeof(name), "sample2d (%s)", sampler_name(settings.sampler));
+	run(name, [&](RandomContext &random_context) {
+		for (uint32_t d = 0; d < NUM_DIMENSIONS; d += 2) {
+			const Float2 u = sample2d(random_context);
+			sum += u.x + u.y;
+		}
+	});
+	printf("(sum %f)\n", sum);
+}
+
+// The camera of the built-in scene, or one that sees all of a loaded scene. -look_from and -look_at override it.
+Camera create_camera(const Settings &settings, const Scene &scene) {
+	Float3 position = float3(0,5,-15);
+	Float3 forward = float3(0,0,1);
+	if (settings.scene) {
+		// TODO: Cameras in the scene file. Until then we look along z at the middle of the scene, from far enough away to see all of it.
+		const Float3 center = (scene.file.bounds_min + scene.file.bounds_max) * 0.5f;
+		position = center - forward * length(scene.file.bounds_max - scene.file.bounds_min);
+	}
+	if (settings.has_look_from)
+		position = settings.look_from;
+	if (settings.has_look_at && length(settings.look_at - position) > 0.0f)
+		forward = settings.look_at - position;
+
+	// TODO: Do aspect ratio at least
+	// TODO: Choose a coordinate system and act accordingly! up is -y since the v value is upside down.. or is it?
+	Camera camera;
+	camera.position = position;
+	camera.forward = normalized(forward);
+	Float3 right = cross(float3(0,1,0), camera.forward);
+	if (length(right) < 1E-6f)
+		right = cross(float3(0,0,1), camera.forward); // Looking straight up or down
+	camera.right = normalized(right);
+	camera.up = cross(camera.right, camera.forward);
+	return camera;
+}
+
+// Cleared framebuffer for the image of settings
+void clear_framebuffer(const Settings &settings, std::vector<Pixel> &framebuffer) {
+	framebuffer.assign(settings.width * settings.height, Pixel());
+	if (settings.pinning != PIN_NONE) {
+		// Clearing it put all of it on our NUMA node. The render threads write to their tiles first.
+		release_pages(&framebuffer[0], sizeof(Pixel)*framebuffer.size());
+	}
+}
+
+// Writes the image, the sample heatmap and the JSON report, as asked for by settings
+void write_results(const char *program, const Settings &settings, const std::vector<Pixel> &framebuffer, const RenderStats &stats, const std::vector<Float3> &reference, PhaseTimes &times) {
+	if (settings.num_shards > 1) {
+		// The image comes from merging the checkpoints of all shards with pathtracer_merge
+		printf("Wrote shard %d/%d to '%s'\n", settings.shard_index, settings.num_shards, settings.checkpoint);
+	} else {
+		if (!write_image(settings.output, framebuffer, tile_layout(settings), settings.seed, settings.num_threads, &times.write))
+			printf("Failed to write '%s'\n", settings.output);
+		printf("Wrote '%s' in %.3fs\n", settings.output, times.write.resolve_seconds + times.write.encode_seconds);
+
+		if (settings.sample_heatmap)
+			write_sample_heatmap(settings.sample_heatmap, framebuffer, tile_layout(settings), settings.num_samples);
+	}
+
+	if (settings.json) {
+		// Shards only have part of the image, there is nothing to compare with the reference
+		const double rmse = settings.reference && settings.num_shards == 1 ? image_rmse(detile(framebuffer, tile_layout(settings)), reference) : -1.0;
+		if (!write_json_report(settings.json, program, settings, times, stats, rmse))
+			printf("Failed to write '%s'\n", settings.json);
+	}
+}
+
+namespace {
+	struct ServerJob {
+		uint32_t index;
+		std::vector<std::string> args; // settings point into these
+		Settings settings;
+		std::vector<Float3> reference;
+		std::vector<Pixel> framebuffer;
+		RenderStats stats;
+	};
+
+	// Splits a job line at whitespace. TODO: Quoting, for paths with spaces.
+	std::vector<std::string> split_job_line(const char *line) {
+		std::vector<std::string> args;
+		char arg[1024];
+		int length = 0;
+		while (sscanf(line, " %1023s%n", arg, &length) == 1) {
+			args.push_back(arg);
+			line += length;
+		}
+		return args;
+	}
+
+	// The job may only change what is rendered from the scene, not the scene
+	bool same_scene(const Settings &a, const Settings &b) {
+		const bool same_file = a.scene == b.scene || (a.scene && b.scene && strcmp(a.scene, b.scene) == 0);
+		return same_file && a.num_pillars == b.num_pillars && a.light_power == b.light_power;
+	}
+}
+
+/*
+	Server mode (-server). The scene is loaded and built once and the render threads are kept, then render jobs are read
+	from stdin, one per line, until the end of the input or a line with quit. A job is command line options on top of the
+	ones the server was started with, for example:
+
+		-look_from 0,5,-15 -look_at 0,0,0 -width 640 -height 480 -samples 64 -output frame0.png
+
+	Options that change the scene are not allowed. Jobs are rendered one at a time in order, and the image of a job is
+	written on another thread while the next one renders. "Job n done" is printed when the files of job n are written.
+*/
+int run_server(const Settings &settings, const Scene &scene, const char *program) {
+	if (settings.checkpoint || settings.ray_benchmark || settings.rmse_report || settings.write_scene) {
+		printf("-server can't be used with -checkpoint, -ray_benchmark, -rmse_report or -write_scene\n");
+		return 1;
+	}
+	printf("Server ready, reading jobs from stdin\n");
+	fflush(stdout);
+
+	std::thread writer;
+	uint32_t num_jobs = 0, num_failed = 0;
+	char line[16384];
+	while (fgets(line, sizeof(line), stdin)) {
+		std::unique_ptr<ServerJob> job(new ServerJob());
+		job->args = split_job_line(line);
+		if (job->args.empty() || job->args[0][0] == '#')
+			continue;
+		if (job->args[0] == "quit")
+			break;
+
+		job->index = num_jobs++;
+		std::vector<char*> argv;
+		argv.push_back((char*)program);
+		for (std::string &arg : job->args)
+			argv.push_back(&arg[0]);
+		job->settings = settings;
+		job->settings.server = false;
+		bool ok = parse_command_line(job->settings, (int)argv.size(), &argv[0]);
+		if (ok && (!same_scene(settings, job->settings) || job->settings.checkpoint || job->settings.cameras || job->settings.orbit != 0 || job->settings.ray_benchmark || job->settings.rmse_report || job->settings.write_scene || job->settings.server)) {
+			printf("Jobs can only change the image, not the scene or the mode\n");
+			ok = false;
+		}
+		if (ok && job->settings.reference)
+			ok = read_reference(job->settings.reference, job->settings, job->reference);
+		if (!ok) {
+			printf("Job %d failed\n", job->index);
+			fflush(stdout);
+			num_failed++;
+			continue;
+		}
+
+		Settings &job_settings = job->settings;
+		if (job_settings.tile_size == 0) {
+			job_settings.tile_size = autotune_tile_size(job_settings, scene, create_camera(job_settings, scene));
+			printf("Using %dx%d tiles\n", job_settings.tile_size, job_settings.tile_size);
+		}
+		clear_framebuffer(job_settings, job->framebuffer);
+		const Camera camera = create_camera(job_settings, scene);
+		job->stats = job_settings.progressive ? render_progressive(job_settings, scene, camera, job->framebuffer) : render_image(job_settings, scene, camera, job->framebuffer, nullptr);
+		print_render_stats(job->stats, job_settings, job->framebuffer);
+		print_stats();
+		clear_stats();
+		if (job_settings.trace && !write_tile_trace(job_settings.trace, job->stats.tile_events))
+			printf("Failed to write '%s'\n", job_settings.trace);
+		fflush(stdout);
+
+		// One image is written at a time, while the next one renders
+		if (writer.joinable())
+			writer.join();
+		writer = std::thread([program](std::unique_ptr<ServerJob> job) {
+			PhaseTimes times; // The scene was loaded and built before the first job
+			write_results(program, job->settings, job->framebuffer, job->stats, job->reference, times);
+			printf("Job %d done\n", job->index);
+			fflush(stdout);
+		}, std::move(job));
+	}
+	if (writer.joinable())
+		writer.join();
+	printf("Server done: %d jobs, %d failed\n", num_jobs, num_failed);
+	return num_failed == 0 ? 0 : 1;
+}
+
+/*
+	The views for -cameras or -orbit. An orbit starts at the default camera (or -look_from) and goes around -look_at, or
+	around the middle of the scene, at the same height. For the built-in scene it goes around the point the default
+	camera looks at above the origin. With -camera only that view is returned. out_numbers gets the index of each view
+	in the whole list, for the output file names.
+*/
+bool create_views(const Settings &settings, const Scene &scene, std::vector<Camera> &out_cameras, std::vector<uint32_t> &out_numbers) {
+	std::vector<Camera> cameras;
+	Settings view_settings = settings;
+	view_settings.has_look_from = view_settings.has_look_at = true;
+	if (settings.cameras) {
+		FILE *f = fopen(settings.cameras, "r");
+		if (!f) {
+			printf("Could not read '%s'\n", settings.cameras);
+			return false;
+		}
+		char line[1024];
+		for (uint32_t line_number = 1; fgets(line, sizeof(line), f); line_number++) {
+			Float3 &from = view_settings.look_from, &to = view_settings.look_at;
+			char first = 0;
+			if (sscanf(line, " %c", &first) != 1 || first == '#')
+				continue;
+			if (sscanf(line, "%f,%f,%f %f,%f,%f", &from.x, &from.y, &from.z, &to.x, &to.y, &to.z) != 6) {
+				printf("%s:%d: expected from_x,from_y,from_z to_x,to_y,to_z\n", settings.cameras, line_number);
+				fclose(f);
+				return false;
+			}
+			cameras.push_back(create_camera(view_settings, scene));
+		}
+		fclose(f);
+	} else {
+		Settings start_settings = settings;
+		start_settings.has_look_at = false;
+		const Float3 start = create_camera(start_settings, scene).position;
+		Float3 center = float3(0, start.y, 0);
+		if (settings.has_look_at)
+			center = settings.look_at;
+		else if (settings.scene)
+			center = (scene.file.bounds_min + scene.file.bounds_max) * 0.5f;
+		const Float3 d = start - center;
+		for (uint32_t i = 0; i < settings.orbit; i++) {
+			const float angle = float(2.0*M_PI) * i / settings.orbit;
+			const float c = cosf(angle), s = sinf(angle);
+			view_settings.look_from = center + float3(d.x*c - d.z*s, d.y, d.x*s + d.z*c);
+			view_settings.look_at = center;
+			cameras.push_back(create_camera(view_settings, scene));
+		}
+	}
+
+	out_cameras.clear();
+	out_numbers.clear();
+	for (uint32_t i = 0; i < (uint32_t)cameras.size(); i++) {
+		if (settings.camera_index < 0 || (uint32_t)settings.camera_index == i) {
+			out_cameras.push_back(cameras[i]);
+			out_numbers.push_back(i);
+		}
+	}
+	if (out_cameras.empty()) {
+		printf("There is no view %d, there are %d\n", settings.camera_index, (uint32_t)cameras.size());
+		return false;
+	}
+	return true;
+}
+
+// The file name for view n. A run of # in filename is replaced by n with that many digits, frame_###.png gives
+// frame_007.png. Otherwise _n goes before the extension.
+std::string view_filename(const char *filename, uint32_t n) {
+	std::string name = filename;
+	const size_t first = name.find('#');
+	if (first != std::string::npos) {
+		size_t last = first;
+		while (last < name.size() && name[last] == '#')
+			last++;
+		char number[16];
+		snprintf(number, sizeof(number), "%0*u", (int)(last - first), n);
+		return name.substr(0, first) + number + name.substr(last);
+	}
+	const size_t dot = name.find_last_of('.');
+	const size_t slash = name.find_last_of("/\\");
+	const size_t insert = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? dot : name.size();
+	return name.substr(0, insert) + "_" + std::to_string(n) + name.substr(insert);
+}
+
+/*
+	Batch mode (-cameras or -orbit). All views are rendered in one go with the tiles of all of them in the same queues,
+	as many views at a time as fit in BATCH_MEMORY. The image of a view is written on another thread as soon as the view
+	is done, while the rest render. The JSON report covers the whole batch.
+*/
+int render_batch(const Settings &settings, const Scene &scene, const char *program, PhaseTimes &times) {
+	const size_t BATCH_MEMORY = (size_t)1 << 30; // For the framebuffers of the views that are rendered together
+
+	std::vector<Camera> cameras;
+	std::vector<uint32_t> numbers;
+	if (!create_views(settings, scene, cameras, numbers))
+		return 1;
+	const uint32_t num_views = (uint32_t)cameras.size();
+
+	Settings batch_settings = settings;
+	if (batch_settings.tile_size == 0) {
+		batch_settings.tile_size = autotune_tile_size(batch_settings, scene, cameras[0]);
+		printf("Using %dx%d tiles\n", batch_settings.tile_size, batch_settings.tile_size);
+	}
+	const uint32_t views_per_batch = (uint32_t)std::max(std::min(BATCH_MEMORY / (sizeof(Pixel) * settings.width * settings.height), (size_t)num_views), (size_t)1);
+	printf("Rendering %d views, %d at a time\n", num_views, views_per_batch);
+
+	RenderStats total;
+	total.idle_seconds.resize(settings.num_threads, 0.0);
+	total.num_steals.resize(settings.num_threads, 0);
+	std::vector<std::vector<Pixel>> framebuffers(views_per_batch);
+	std::thread writer;
+	bool ok = true;
+	for (uint32_t first = 0; first < num_views; first += views_per_batch) {
+		const uint32_t count = std::min(views_per_batch, num_views - first);
+		for (uint32_t i = 0; i < count; i++)
+			clear_framebuffer(batch_settings, framebuffers[i]);
+
+		// One image is written at a time, while the rest of the views render
+		auto view_done = [&](uint32_t i) {
+			if (writer.joinable())
+				writer.join();
+			writer = std::thread([&batch_settings, &framebuffers, &ok, i](uint32_t n) {
+				const std::string output = view_filename(batch_settings.output, n);
+				if (!write_image(output.c_str(), framebuffers[i], tile_layout(batch_settings), batch_settings.seed, batch_settings.num_threads)) {
+					printf("Failed to write '%s'\n", output.c_str());
+					ok = false;
+				} else
+					printf("Wrote view %d to '%s'\n", n, output.c_str());
+				if (batch_settings.sample_heatmap)
+					write_sample_heatmap(view_filename(batch_settings.sample_heatmap, n).c_str(), framebuffers[i], tile_layout(batch_settings), batch_settings.num_samples);
+			}, numbers[first + i]);
+		};
+		const RenderStats stats = render_views(batch_settings, scene, &cameras[first], &framebuffers[0], count, nullptr, view_done);
+		if (writer.joinable())
+			writer.join(); // The framebuffers are reused by the next views
+
+		total.seconds += stats.seconds;
+		total.num_rays += stats.num_rays;
+		total.num_cycles += stats.num_cycles;
+		total.num_samples += stats.num_samples;
+		for (uint32_t i = 0; i < settings.num_threads; i++) {
+			total.idle_seconds[i] += stats.idle_seconds[i];
+			total.num_steals[i] += stats.num_steals[i];
+		}
+		total.tile_events.insert(total.tile_events.end(), stats.tile_events.begin(), stats.tile_events.end());
+	}
+
+	// print_render_stats counts the samples of one framebuffer for adaptive sampling, these are the samples of all views
+	printf("Rendered %d views\n", num_views);
+	if (settings.adaptive_threshold != 0.0f)
+		printf("Adaptive sampling used %.1f%% of the maximum number of samples\n", 100.0 * total.num_samples / ((double)settings.width * settings.height * settings.num_samples * num_views));
+	Settings print_settings = batch_settings;
+	print_settings.adaptive_threshold = 0.0f;
+	print_render_stats(total, print_settings, framebuffers[0]);
+	print_stats();
+	if (settings.trace && !write_tile_trace(settings.trace, total.tile_events))
+		printf("Failed to write '%s'\n", settings.trace);
+	if (settings.json && !write_json_report(settings.json, program, batch_settings, times, total, -1.0))
+		printf("Failed to write '%s'\n", settings.json);
+	return ok ? 0 : 1;
+}
+
+// "post5" for "build/post5/post5.exe"
+std::string program_name(const char *path) {
+	std::string name = path;
+	const size_t slash = name.find_last_of("/\\");
+	if (slash != std::string::npos)
+		name = name.substr(slash + 1);
+	const size_t dot = name.find_last_of('.');
+	if (dot != std::string::npos && dot != 0)
+		name = name.substr(0, dot);
+	return name;
+}
+
+int main(int argc, char **argv) {
+	Settings settings;
+	if (!parse_command_line(settings, argc, argv))
+		return 1;
+
+	if (settings.rng_benchmark) {
+		rng_benchmark(settings);
+		return 0;
+	}
+
+	const uint32_t width  = settings.width;
+	const uint32_t height = settings.height;
+
+	std::vector<Float3> reference;
+	if (settings.reference && !read_reference(settings.reference, settings, reference))
+		return 1;
+
+	PhaseTimes times;
+	Scene scene;
+	if (settings.scene) {
+		const auto load_start = std::chrono::high_resolution_clock::now();
+		if (!load_scene_file(settings.scene, settings.num_threads, scene.file)) {
+			printf("Could not load scene '%s'\n", settings.scene);
+			return 1;
+		}
+		times.load_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - load_start).count();
+		printf("Loaded '%s' in %.3fs: %d triangles, %d vertices, %d materials\n", settings.scene, times.load_seconds,
+			scene.file.num_triangles, scene.file.num_vertices, scene.file.materials.size());
+		if (settings.write_scene) {
+			const bool ok = write_scene_binary(settings.write_scene, scene.file);
+			printf(ok ? "Wrote '%s'\n" : "Failed to write '%s'\n", settings.write_scene);
+			return ok ? 0 : 1;
+		}
+	}
+
+	const auto build_start = std::chrono::high_resolution_clock::now();
+	const bool cached = create_scene(scene, settings.bvh_cache, settings.num_pillars);
+	build_light_distribution(scene, settings.light_power);
+	times.build_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - build_start).count();
+	print_acceleration_structure(scene, cached, times.build_seconds);
+
+	if (settings.server) {
+		const int result = run_server(settings, scene, program_name(argv[0]).c_str());
+		destroy_scene(scene);
+		return result;
+	}
+
+	if (settings.cameras || settings.orbit != 0) {
+		const int result = render_batch(settings, scene, program_name(argv[0]).c_str(), times);
+		destroy_scene(scene);
+		return result;
+	}
+
+	const Camera camera = create_camera(settings, scene);
+
+	if (settings.ray_benchmark) {
+		ray_benchmark(settings, scene, camera);
+		destroy_scene(scene);
+		return 0;
+	}
+
+	if (settings.rmse_report) {
+		const bool ok = rmse_report(settings, scene, camera);
+		destroy_scene(scene);
+		return ok ? 0 : 1;
+	}
+
+	if (settings.tile_size == 0) {
+		settings.tile_size = autotune_tile_size(settings, scene, camera);
+		printf("Using %dx%d tiles\n", settings.tile_size, settings.tile_size);
+	}
+
+	std::vector<Pixel> framebuffer;
+	clear_framebuffer(settings, framebuffer);
+	Checkpoint checkpoint;
+	if (settings.checkpoint) {
+		const CheckpointDescription description = {width, height, settings.tile_size, settings.image_index, settings.seed, (uint32_t)settings.sampler, (uint32_t)settings.shard_mode, settings.shard_index, settings.num_shards};
+		bool resumed = false;
+		if (!checkpoint.open(settings.checkpoint, description, settings.resume, resumed)) {
+			printf("Could not use checkpoint '%s'\n", settings.checkpoint);
+			destroy_scene(scene);
+			return 1;
+		}
+		if (resumed) {
+			memcpy(&framebuffer[0], checkpoint.pixels(), sizeof(Pixel)*width*height);
+			double num_samples = 0.0;
+			for (const Pixel &pixel : framebuffer)
+				num_samples += pixel.N;
+			printf("Resuming from '%s' with %.1f samples per pixel\n", settings.checkpoint, num_samples / (width*height));
+		}
+		if (settings.wavefront && !tiles_have_uniform_samples(framebuffer, tile_layout(settings))) {
+			printf("The wavefront integrator can't continue from a checkpoint made with adaptive sampling\n");
+			destroy_scene(scene);
+			return 1;
+		}
+	}
+
+	const RenderStats stats = settings.progressive ? render_progressive(settings, scene, camera, framebuffer) : render_image(settings, scene, camera, framebuffer, settings.checkpoint ? &checkpoint : nullptr);
+	print_render_stats(stats, settings, framebuffer);
+	print_stats();
+	if (settings.trace) {
+		if (write_tile_trace(settings.trace, stats.tile_events))
+			printf("Wrote tile timeline to '%s'\n", settings.trace);
+		else
+			printf("Failed to write '%s'\n", settings.trace);
+	}
 
-	stbi_write_png(settings.output, width, height, 4, (const void*)&byte_data[0], 0);
+	write_results(program_name(argv[0]).c_str(), settings, framebuffer, stats, reference, times);
 
-	rtcDeleteScene(scene.embree_scene);
-	rtcDeleteDevice(embree_device);
+	destroy_scene(scene);
 	return 0;
 }
@@ -1,10 +1,12 @@
 #pragma once
 
 #include "vector_math.h"
+#include "stats.h"
 
 #include <stdint.h>
+#include <string.h>
 #include <cassert>
-#include <random> // TODO: Overkill
+#include <limits>
 
 /*
 	Assumes elements are POD-structs. No constructor/destructor.
@@ -51,6 +53,7 @@ public:
 			assert(new_size > _size);
 			memset(_elements + _size, 0, (new_size-_size)*sizeof(ELEMENT));
 		}
+		_size = new_size;
 	}
 	void reserve(uint32_t new_capacity) {
 		const uint32_t old_capacity = _capacity;
@@ -70,11 +73,41 @@ private:
 	ELEMENT *_elements;
 };
 
+/*
+	Plain sums so that pixels rendered by different threads can be added together. We only divide when resolving.
+*/
 struct Pixel {
-	Float3 rgb;
+	Float3 sum;
 	uint32_t N;
+	Float3 sum_squares; // Used to estimate variance
 };
 
+inline void add_sample(Pixel &pixel, const Float3 color) {
+	pixel.sum += color;
+	pixel.sum_squares += color * color;
+	pixel.N++;
+}
+
+inline void add_pixel(Pixel &pixel, const Pixel &other) {
+	pixel.sum += other.sum;
+	pixel.sum_squares += other.sum_squares;
+	pixel.N += other.N;
+}
+
+inline Float3 pixel_mean(const Pixel &pixel) {
+	return pixel.N != 0 ? pixel.sum / (float)pixel.N : float3(0,0,0);
+}
+
+// Estimated standard error of the pixel mean relative to the mean. Averaged over the channels.
+inline float relative_error(const Pixel &pixel) {
+	if (pixel.N < 2)
+		return std::numeric_limits<float>::max();
+	const Float3 m = pixel_mean(pixel);
+	const float variance = std::max(mean(pixel.sum_squares - pixel.sum * m), 0.0f) / (pixel.N - 1);
+	const float standard_error = sqrtf(variance / pixel.N);
+	return standard_error / std::max(mean(m), 1E-3f); // Avoid blowing up in black pixels
+}
+
 // Opaque to the posts (for now)
 struct Scene;
 
@@ -83,6 +116,59 @@ struct IntersectResult {
 	Float3 pos, face_normal/*, interpolated_normal*/;
 };
 
+/*
+	Compact version of IntersectResult for the bounce loop. The position is not stored since the ray has it (see
+	hit_position) and the colors are only fetched from the material table when they are needed.
+*/
+struct Hit {
+	float t;
+	uint32_t material; // Index into the MaterialTable of the scene
+	uint32_t prim_id;
+	uint32_t normal; // Face normal turned towards the ray origin, see pack_normal
+};
+
+inline Float3 hit_position(const Float3 pos, const Float3 dir, const Hit &hit) { return pos + dir * hit.t; }
+inline Float3 hit_normal(const Hit &hit) { return unpack_normal(hit.normal); }
+
+// Origin for the next ray from a hit. The hit position is off by ulps of the ray origin and of the distance to the
+// hit, so the offset is scaled by those (see offset_ray_origin).
+inline Float3 bounce_origin(const Float3 pos, const Float3 dir, const Hit &hit, const Float3 normal) {
+	return offset_ray_origin(hit_position(pos, dir, hit), normal, max_abs(pos) + hit.t);
+}
+inline Float3 bounce_origin(const Float3 pos, const IntersectResult &result) {
+	return offset_ray_origin(result.pos, result.face_normal, max_abs(pos) + length(result.pos - pos));
+}
+
+/*
+	True if hit is on the surface the ray started from, where from is the hit that the ray origin org was moved off.
+	Quads and triangles are flat, so this only happens when the origin ended up behind the surface, and then the hit is
+	within a few origin offsets (see offset_ray_origin) of org. For STAT_SELF_HITS. Meshes and instances share
+	prim_ids, the normal and the distance tell them apart.
+*/
+inline bool is_self_hit(const Float3 org, const Hit &from, const Hit &hit) {
+	const float SELF_HIT_OFFSETS = 4.0f;
+	return hit.prim_id == from.prim_id && hit.t < SELF_HIT_OFFSETS * ray_origin_offset(max_abs(org)) && fabsf(dot(hit_normal(hit), hit_normal(from))) > 0.9999f;
+}
+
+/*
+	Material colors as a structure of arrays, indexed by Hit::material.
+*/
+struct MaterialTable {
+	Array<float> diffuse_r, diffuse_g, diffuse_b;
+	Array<float> emissive_r, emissive_g, emissive_b;
+
+	uint32_t size() const { return diffuse_r.size(); }
+	uint32_t add(const Float3 diffuse, const Float3 emissive) {
+		diffuse_r.push_back(diffuse.x); diffuse_g.push_back(diffuse.y); diffuse_b.push_back(diffuse.z);
+		emissive_r.push_back(emissive.x); emissive_g.push_back(emissive.y); emissive_b.push_back(emissive.z);
+		return size() - 1;
+	}
+	Float3 diffuse(uint32_t i) const { return float3(diffuse_r[i], diffuse_g[i], diffuse_b[i]); }
+	Float3 emissive(uint32_t i) const { return float3(emissive_r[i], emissive_g[i], emissive_b[i]); }
+};
+
+const MaterialTable &scene_materials(const Scene &scene);
+
 // Until we do DOF we don't need anything more advanced than this
 // Notice that this is a 4x3 matrix in disguise
 // Also we don't do aspect ratio (yet)
@@ -102,16 +188,116 @@ inline Float3 sky_color_in_direction(const Scene &scene, const Float3 dir) {
 	return lerp(float3(0.2f, 0.2f, 0.3f), float3(0.4f,0.4f,0.9f), upness);
 }
 
+bool intersect_closest(const Scene &scene, const Float3 pos, const Float3 dir, Hit &out_hit);
 bool intersect_closest(const Scene &scene, const Float3 pos, const Float3 dir, IntersectResult &out_result);
 
-struct RandomContext {
-	RandomContext() : uniform(0.0f, 1.0f) {
-		rng.seed(std::random_device()());
+// True if the ray hits anything closer than tmax. Use this for shadow rays; it does not need the closest hit.
+bool occluded(const Scene &scene, const Float3 pos, const Float3 dir, float tmax);
+
+/*
+	Light sampling for next event estimation. Every emissive quad in the scene is a light. It is sampled as the
+	same two triangles that are used for intersection. A triangle is picked with probability proportional to its
+	area or to its power (area times luminance of the emission), see -light_sampling.
+*/
+struct LightSample {
+	Float3 pos, normal, emissive;
+	float pdf_area; // Density of picking pos, per unit area
+};
+
+// Returns false if the scene has no lights
+bool sample_light(const Scene &scene, float u_select, const Float2 u, LightSample &out_sample);
+
+// Density per unit area with which sample_light picks a point on an emissive surface with the given emission
+float light_pdf_area(const Scene &scene, const Float3 emissive);
+
+/*
+	Rays stored as a structure of arrays. Used to intersect many rays in one call.
+*/
+struct RayStream {
+	Array<float> org_x, org_y, org_z;
+	Array<float> dir_x, dir_y, dir_z;
+
+	uint32_t size() const { return org_x.size(); }
+	void resize(uint32_t n) {
+		org_x.resize(n); org_y.resize(n); org_z.resize(n);
+		dir_x.resize(n); dir_y.resize(n); dir_z.resize(n);
+	}
+	void set(uint32_t i, const Float3 org, const Float3 dir) {
+		org_x[i] = org.x; org_y[i] = org.y; org_z[i] = org.z;
+		dir_x[i] = dir.x; dir_y[i] = dir.y; dir_z[i] = dir.z;
 	}
+	Float3 org(uint32_t i) const { return float3(org_x[i], org_y[i], org_z[i]); }
+	Float3 dir(uint32_t i) const { return float3(dir_x[i], dir_y[i], dir_z[i]); }
+};
+
+const uint32_t PACKET_SIZE = 8;
 
-	// TODO: We should be able to keep a single uint[64] here, no reason to leak <random>
-	std::minstd_rand rng;
-	std::uniform_real_distribution<float> uniform;
+// Intersects up to PACKET_SIZE rays that share the same origin, such as camera rays, as one packet.
+void intersect_closest_packet(const Scene &scene, const Float3 pos, const Float3 *dirs, uint32_t count, bool *out_hit, Hit *out_hits);
+
+// Intersects the first count rays in the stream. out_hit[i] is true if ray i hit something, then out_hits[i] is filled in.
+void intersect_closest_stream(const Scene &scene, const RayStream &rays, uint32_t count, bool *out_hit, Hit *out_hits);
+
+// Occlusion test for the first count rays in the stream, ray i is tested against [0, tmax[i]).
+void occluded_stream(const Scene &scene, const RayStream &rays, const float *tmax, uint32_t count, bool *out_occluded);
+
+/*
+	Counter based random numbers. Each sample of each pixel gets its own stream and the n:th random number of a
+	stream is a hash of the stream and n (the dimension). This means that the image does not depend on which
+	thread rendered what.
+*/
+enum SamplerType {
+	SAMPLER_RANDOM,
+	SAMPLER_SOBOL, // Owen scrambled, shuffled and padded 2D Sobol
+	SAMPLER_HALTON, // Randomized per pixel with Cranley-Patterson rotation
+	SAMPLER_BLUE_NOISE, // Same Sobol sequence for all pixels, offset per pixel with a blue noise like dither
+	NUM_SAMPLERS
+};
+
+// Plain data so that it can go in an Array. Zero initialize it with = {}.
+struct RandomContext {
+	uint32_t seed;
+	uint32_t stream;
+	uint32_t dimension;
+	SamplerType sampler; // Used by sample1d
+	uint32_t x, y, sample_index;
+};
+
+// https://nullprogram.com/blog/2018/07/31/ (lowbias32)
+inline uint32_t hash32(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+inline float uniform_from_bits(uint32_t bits) {
+	return (bits >> 8) * (1.0f/16777216.0f); // 24 bits in [0,1)
+}
+
+inline void start_sample(RandomContext &random_context, uint32_t x, uint32_t y, uint32_t sample_index) {
+	random_context.stream = hash32(random_context.seed ^ hash32(x + hash32(y + hash32(sample_index))));
+	random_context.dimension = 0;
+	random_context.x = x;
+	random_context.y = y;
+	random_context.sample_index = sample_index;
+}
+
+inline uint32_t random_bits(const RandomContext &random_context, uint32_t dimension) {
+	return hash32(random_context.stream + dimension * 0x9E3779B9U);
+}
+
+/*
+	Camera rays that were traced together as a packet (see -packets).
+*/
+struct CameraPacket {
+	uint32_t x[PACKET_SIZE], y[PACKET_SIZE], sample_index[PACKET_SIZE];
+	uint32_t count = 0; // Zero when not in use
+	Float3 dir[PACKET_SIZE];
+	bool hit[PACKET_SIZE];
+	Hit hits[PACKET_SIZE];
 };
 
 /*
@@ -120,11 +306,56 @@ struct RandomContext {
 struct ThreadContext : public RandomContext {
 	uint32_t thread_index;
 	uint32_t image_index = 0;
+	CameraPacket camera_packet;
 };
 
 inline float uniform(RandomContext &random_context) {
-	return random_context.uniform(random_context.rng);
+	return uniform_from_bits(random_bits(random_context, random_context.dimension++));
+}
+
+// Same as calling uniform count times. Written so that the compiler can vectorize it.
+inline void uniform_batch(RandomContext &random_context, float *out, uint32_t count) {
+	const uint32_t stream = random_context.stream;
+	const uint32_t dimension = random_context.dimension;
+	for (uint32_t i = 0; i < count; i++)
+		out[i] = uniform_from_bits(hash32(stream + (dimension + i) * 0x9E3779B9U));
+	random_context.dimension += count;
+}
+
+/*
+	Next dimension of the current sample from the sampler in random_context.sampler (see sampler.cpp).
+	Shares the dimension counter with uniform(). Consecutive pairs of dimensions starting at an even dimension
+	are well distributed in 2D, so draw two dimensional samples from an even dimension.
+*/
+float sample1d(RandomContext &random_context);
+const char *sampler_name(SamplerType sampler);
+
+inline Float2 sample2d(RandomContext &random_context) {
+	random_context.dimension += random_context.dimension & 1; // Start at an even dimension
+	if (random_context.sampler == SAMPLER_RANDOM) {
+		float u[2];
+		uniform_batch(random_context, u, 2);
+		return float2(u[0], u[1]);
+	}
+	const float u0 = sample1d(random_context);
+	const float u1 = sample1d(random_context);
+	return float2(u0, u1);
 }
 
+// Jitters a camera ray inside pixel (x,y) and intersects it. If the ray was already traced as part of a packet that result is used.
+bool trace_camera_ray(ThreadContext &thread_context, const Scene &scene, const Camera &camera, uint32_t x, uint32_t y, uint32_t sample_index, float one_over_width, float one_over_height, Float3 &out_dir, Hit &out_hit);
+bool trace_camera_ray(ThreadContext &thread_context, const Scene &scene, const Camera &camera, uint32_t x, uint32_t y, uint32_t sample_index, float one_over_width, float one_over_height, Float3 &out_dir, IntersectResult &out_result);
+
 // To be implemented by post
 Float3 pathtrace_sample(ThreadContext &settings, const Scene &scene, const Camera &camera, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t sample_index, float one_over_width, float one_over_height);
+
+/*
+	Optional wavefront integrator, used when running with -wavefront.
+	Instead of tracing one path at a time it advances all paths of a tile one bounce at a time.
+	It renders samples [sample_start, sample_start+num_samples) of each pixel.
+	Samples are added to tile_pixels, a cleared buffer with the tile_width*tile_height pixels of the tile, row by row.
+	Tiles at the right and bottom edges of the image can be smaller than the others.
+	A post that has one registers it using a static initializer (see post5).
+*/
+typedef void (*WavefrontFunction)(ThreadContext &thread_context, const Scene &scene, const Camera &camera, uint32_t tile_start_x, uint32_t tile_start_y, uint32_t tile_width, uint32_t tile_height, uint32_t width, uint32_t height, uint32_t sample_start, uint32_t num_samples, Pixel *tile_pixels);
+bool register_wavefront(WavefrontFunction function);
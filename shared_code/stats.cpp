@@ -0,0 +1,86 @@
+#include "stats.h"
+#include <mutex>
+
+#if PATHTRACER_STATS
+thread_local ThreadStats thread_stats;
+
+namespace {
+	std::mutex total_stats_mutex;
+	ThreadStats total_stats;
+
+	const char *counter_names[NUM_STAT_COUNTERS] = {
+		"closest rays",
+		"  hits",
+		"    self hits",
+		"occlusion rays",
+		"  occluded",
+		"russian roulette terminations",
+	};
+
+	const char *timer_names[NUM_STAT_TIMERS] = {
+		"tile pass",
+		"intersect",
+	};
+}
+#endif
+
+void merge_thread_stats() {
+#if PATHTRACER_STATS
+	std::lock_guard<std::mutex> lock(total_stats_mutex);
+	for (uint32_t i = 0; i < NUM_STAT_COUNTERS; i++)
+		total_stats.counters[i] += thread_stats.counters[i];
+	for (uint32_t i = 0; i < NUM_STAT_TIMERS; i++) {
+		total_stats.timer_cycles[i] += thread_stats.timer_cycles[i];
+		total_stats.timer_calls[i] += thread_stats.timer_calls[i];
+	}
+	for (uint32_t i = 0; i <= STAT_MAX_PATH_LENGTH; i++)
+		total_stats.path_lengths[i] += thread_stats.path_lengths[i];
+	thread_stats = ThreadStats();
+#endif
+}
+
+void print_stats() {
+#if PATHTRACER_STATS
+	std::lock_guard<std::mutex> lock(total_stats_mutex);
+	const ThreadStats &s = total_stats;
+	printf("Stats:\n");
+	for (uint32_t i = 0; i < NUM_STAT_COUNTERS; i++)
+		printf("  %-32s %14llu\n", counter_names[i], (unsigned long long)s.counters[i]);
+	for (uint32_t i = 0; i < NUM_STAT_TIMERS; i++) {
+		if (s.timer_calls[i] != 0)
+			printf("  %-32s %14llu calls, %10.0f cycles per call\n", timer_names[i], (unsigned long long)s.timer_calls[i], (double)s.timer_cycles[i] / s.timer_calls[i]);
+	}
+
+	uint64_t num_paths = 0;
+	for (uint32_t i = 0; i <= STAT_MAX_PATH_LENGTH; i++)
+		num_paths += s.path_lengths[i];
+	if (num_paths != 0) {
+		printf("  Path lengths (bounces):\n");
+		for (uint32_t i = 0; i <= STAT_MAX_PATH_LENGTH; i++) {
+			if (s.path_lengths[i] != 0)
+				printf("    %2u%s %14llu %6.2f%%\n", i, i == STAT_MAX_PATH_LENGTH ? "+" : " ", (unsigned long long)s.path_lengths[i], 100.0 * s.path_lengths[i] / num_paths);
+		}
+	}
+#endif
+}
+
+void clear_stats() {
+#if PATHTRACER_STATS
+	std::lock_guard<std::mutex> lock(total_stats_mutex);
+	total_stats = ThreadStats();
+#endif
+}
+
+bool write_tile_trace(const char *filename, const std::vector<TileEvent> &events) {
+	FILE *f = fopen(filename, "w");
+	if (!f)
+		return false;
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (size_t i = 0; i < events.size(); i++) {
+		const TileEvent &e = events[i];
+		fprintf(f, "%s{\"name\":\"tile %u\",\"cat\":\"tile\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"tile\":%u,\"pass\":%u}}\n",
+			i ? "," : "", e.tile, e.thread_index, e.start_us, e.end_us - e.start_us, e.tile, e.pass);
+	}
+	fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+	return fclose(f) == 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+	Counters and timers for the hot paths, compiled in with the CMake option PATHTRACER_STATS. Each thread counts in
+	its own ThreadStats and adds them to the totals when it is done, so there is no sharing while rendering. Without
+	the option the STAT_ macros expand to nothing.
+*/
+
+// Time stamp counter on x86. Elsewhere nanoseconds, which is close enough to compare runs on the same machine.
+inline uint64_t read_cycle_counter() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+#endif
+}
+
+enum StatCounter {
+	STAT_CLOSEST_RAYS,
+	STAT_CLOSEST_HITS, // The rest missed
+	STAT_SELF_HITS, // Bounce rays that hit the surface they left from, see is_self_hit
+	STAT_OCCLUSION_RAYS,
+	STAT_OCCLUDED,
+	STAT_RUSSIAN_ROULETTE_TERMINATIONS,
+	NUM_STAT_COUNTERS
+};
+
+enum StatTimer {
+	STAT_TIMER_TILE, // One pass over a tile
+	STAT_TIMER_INTERSECT, // intersect_closest and occluded, one ray at a time
+	NUM_STAT_TIMERS
+};
+
+const uint32_t STAT_MAX_PATH_LENGTH = 32; // Longer paths go in the last bucket
+
+struct ThreadStats {
+	uint64_t counters[NUM_STAT_COUNTERS] = {};
+	uint64_t timer_cycles[NUM_STAT_TIMERS] = {};
+	uint64_t timer_calls[NUM_STAT_TIMERS] = {};
+	uint64_t path_lengths[STAT_MAX_PATH_LENGTH+1] = {}; // Number of paths that ended after n bounces
+};
+
+// A pass over a tile, for the timeline (-trace)
+struct TileEvent {
+	uint32_t thread_index, tile, pass;
+	double start_us, end_us; // From the start of the render
+};
+
+// Adds the stats of the calling thread to the totals and clears them
+void merge_thread_stats();
+void print_stats();
+void clear_stats(); // Of all threads, call when none are rendering
+
+// Chrome trace event format, open it in chrome://tracing or ui.perfetto.dev
+bool write_tile_trace(const char *filename, const std::vector<TileEvent> &events);
+
+#if PATHTRACER_STATS
+extern thread_local ThreadStats thread_stats;
+
+struct ScopedStatTimer {
+	StatTimer timer;
+	uint64_t start;
+	ScopedStatTimer(StatTimer timer) : timer(timer), start(read_cycle_counter()) {}
+	~ScopedStatTimer() {
+		thread_stats.timer_cycles[timer] += read_cycle_counter() - start;
+		thread_stats.timer_calls[timer]++;
+	}
+};
+
+#define STAT_ADD(counter, n) (thread_stats.counters[counter] += (n))
+#define STAT_PATH_LENGTH(bounces) (thread_stats.path_lengths[std::min((uint32_t)(bounces), STAT_MAX_PATH_LENGTH)]++)
+#define STAT_SCOPED_TIMER(timer) ScopedStatTimer scoped_stat_timer(timer)
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_PATH_LENGTH(bounces) ((void)0)
+#define STAT_SCOPED_TIMER(timer) ((void)0)
+#endif
+
+#define STAT_INC(counter) STAT_ADD(counter, 1)
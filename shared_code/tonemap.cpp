@@ -0,0 +1,70 @@
+#include "tonemap.h"
+
+namespace {
+	inline float linear_to_srgb(float c_linear) {
+		// https://en.wikipedia.org/wiki/SRGB
+		const float a = 0.055f;
+		if (c_linear <=0.0031308) {
+			return 12.92f*c_linear;
+		} else {
+			return (1.0f+a)*powf(c_linear, 1.0f/2.4f)-a;
+		}
+	}
+
+	// https://knarkowicz.wordpress.com/2016/01/06/aces-filmic-tone-mapping-curve/
+	inline float aces_film(float x) {
+		const float a = 2.51f, b = 0.03f, c = 2.43f, d = 0.59f, e = 0.14f;
+		const float v = (x*(a*x+b)) / (x*(c*x+d)+e);
+		return v > 0.0f ? std::min(v, 1.0f) : 0.0f; // NaN goes to 0, we use this as a table index
+	}
+
+	// We are going to convert srgb into 8-bit. This will introduce banding.
+	// To alleviate this we will add noise. This breaks up the banding.
+	// More details can be found in presentations on the game INSIDE from Playdead.
+	// The tringular noise is adapated from https://www.shadertoy.com/view/4t2SDh
+	inline float triangular_dither(float v) {
+		// Inspired from INSIDE/Playdead rendering (exactly what they use)
+		float orig = v * 2.0f - 1.0f;
+		v = std::max(-1.0f, orig/sqrtf(fabsf(v))); // TODO: This is to filter out NANs in HLSL but might not work in our setting
+		return v - (orig>=0?1:-1);
+	}
+
+	inline uint32_t to_byte(float srgb, float dither) {
+		return (uint32_t)std::max(std::min(roundf(srgb * 255.0f + dither), 255.0f), 0.0f);
+	}
+
+	// linear_to_srgb over [0,1], looked up with linear interpolation. Off by less than 0.01 of an 8-bit step.
+	const uint32_t SRGB_TABLE_SIZE = 4096;
+	struct SrgbTable {
+		float v[SRGB_TABLE_SIZE+1]; // One extra so we can always interpolate
+		SrgbTable() {
+			for (uint32_t i = 0; i < SRGB_TABLE_SIZE; i++)
+				v[i] = linear_to_srgb(i / float(SRGB_TABLE_SIZE-1));
+			v[SRGB_TABLE_SIZE] = v[SRGB_TABLE_SIZE-1];
+		}
+	};
+	const SrgbTable srgb_table;
+
+	const uint32_t ROW_CHUNK = 256; // Pixels per chunk of a row, so the temporaries stay on the stack
+}
+
+void tonemap_row(const Float3 *linear, const float *dither_uniforms, uint32_t count, uint32_t *out_rgba) {
+	float srgb[ROW_CHUNK * 3];
+	for (uint32_t start = 0; start < count; start += ROW_CHUNK) {
+		const uint32_t n = std::min(count - start, ROW_CHUNK);
+		const float *in = &linear[start].x;
+
+		// Channels don't matter for the curve and the table so treat the row as one long array of floats
+		for (uint32_t i = 0; i < n * 3; i++) {
+			const float f = aces_film(in[i]) * float(SRGB_TABLE_SIZE-1);
+			const uint32_t index = (uint32_t)f;
+			const float frac = f - index;
+			srgb[i] = srgb_table.v[index] + (srgb_table.v[index+1] - srgb_table.v[index]) * frac;
+		}
+
+		for (uint32_t i = 0; i < n; i++) {
+			const float dither = triangular_dither(dither_uniforms[start + i]);
+			out_rgba[start + i] = to_byte(srgb[i*3+0], dither) | (to_byte(srgb[i*3+1], dither) << 8) | (to_byte(srgb[i*3+2], dither) << 16) | (0xFFu << 24);
+		}
+	}
+}
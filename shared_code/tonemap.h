@@ -0,0 +1,13 @@
+#pragma once
+
+#include "vector_math.h"
+#include <stdint.h>
+
+/*
+	Linear color to 8-bit sRGB for png output: ACES filmic curve, sRGB transfer function and triangular dither.
+	Works on whole rows. The curve is written so that the compiler can vectorize it and the transfer function
+	is a table instead of powf.
+*/
+
+// dither_uniforms has one uniform random number per pixel. out_rgba gets r|g<<8|b<<16|a<<24.
+void tonemap_row(const Float3 *linear, const float *dither_uniforms, uint32_t count, uint32_t *out_rgba);
@@ -0,0 +1,197 @@
+#include "topology.h"
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+	size_t page_size() {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+#else
+		return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	}
+
+#if defined(__linux__)
+	// Parses lists like "0-3,8-11"
+	std::vector<uint32_t> read_cpu_list(const char *filename) {
+		std::vector<uint32_t> cpus;
+		FILE *f = fopen(filename, "r");
+		if (!f)
+			return cpus;
+		uint32_t first = 0, last = 0;
+		int c = 0;
+		while (fscanf(f, "%u", &first) == 1) {
+			last = first;
+			c = fgetc(f);
+			if (c == '-') {
+				if (fscanf(f, "%u", &last) != 1)
+					break;
+				c = fgetc(f);
+			}
+			for (uint32_t cpu = first; cpu <= last; cpu++)
+				cpus.push_back(cpu);
+			if (c != ',')
+				break;
+		}
+		fclose(f);
+		return cpus;
+	}
+
+	CpuTopology read_topology() {
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		const bool have_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+		std::vector<std::pair<uint32_t, std::vector<uint32_t>>> nodes;
+		if (DIR *dir = opendir("/sys/devices/system/node")) {
+			while (dirent *entry = readdir(dir)) {
+				uint32_t node = 0;
+				if (sscanf(entry->d_name, "node%u", &node) != 1)
+					continue;
+				const std::string filename = std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist";
+				std::vector<uint32_t> cpus;
+				for (uint32_t cpu : read_cpu_list(filename.c_str())) {
+					if (!have_allowed || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+						cpus.push_back(cpu);
+				}
+				if (!cpus.empty())
+					nodes.push_back(std::make_pair(node, cpus));
+			}
+			closedir(dir);
+		}
+		std::sort(nodes.begin(), nodes.end());
+
+		CpuTopology topology;
+		for (const auto &node : nodes)
+			topology.node_cpus.push_back(node.second);
+		if (topology.node_cpus.empty() && have_allowed) {
+			topology.node_cpus.resize(1);
+			for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &allowed))
+					topology.node_cpus[0].push_back(cpu);
+			}
+		}
+		return topology;
+	}
+#elif defined(_WIN32)
+	CpuTopology read_topology() {
+		CpuTopology topology;
+		ULONG highest_node = 0;
+		if (!GetNumaHighestNodeNumber(&highest_node))
+			return topology;
+		for (ULONG node = 0; node <= highest_node && node < 256; node++) {
+			ULONGLONG mask = 0;
+			if (!GetNumaNodeProcessorMask((UCHAR)node, &mask))
+				continue;
+			std::vector<uint32_t> cpus;
+			for (uint32_t cpu = 0; cpu < 64; cpu++) {
+				if (mask & (1ull << cpu))
+					cpus.push_back(cpu);
+			}
+			if (!cpus.empty())
+				topology.node_cpus.push_back(cpus);
+		}
+		return topology;
+	}
+#else
+	CpuTopology read_topology() {
+		return CpuTopology();
+	}
+#endif
+}
+
+const CpuTopology &cpu_topology() {
+	static const CpuTopology topology = []() {
+		CpuTopology t = read_topology();
+		if (t.node_cpus.empty()) {
+			t.node_cpus.resize(1);
+			for (uint32_t cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++)
+				t.node_cpus[0].push_back(cpu);
+		}
+		return t;
+	}();
+	return topology;
+}
+
+ThreadPlacement place_threads(const CpuTopology &topology, uint32_t num_threads, ThreadPinning pinning) {
+	const uint32_t num_nodes = (uint32_t)topology.node_cpus.size();
+	ThreadPlacement placement;
+	placement.node.resize(num_threads);
+	placement.cpus.resize(num_threads);
+	for (uint32_t t = 0; t < num_threads; t++) {
+		const uint32_t node = (uint32_t)((uint64_t)t * num_nodes / num_threads);
+		const uint32_t first_thread_of_node = (uint32_t)(((uint64_t)node * num_threads + num_nodes - 1) / num_nodes);
+		const std::vector<uint32_t> &cpus = topology.node_cpus[node];
+		placement.node[t] = node;
+		if (pinning == PIN_CORES)
+			placement.cpus[t].push_back(cpus[(t - first_thread_of_node) % cpus.size()]); // Wraps around if there are more threads than CPUs
+		else if (pinning == PIN_NODES)
+			placement.cpus[t] = cpus;
+	}
+	return placement;
+}
+
+bool pin_current_thread(const std::vector<uint32_t> &cpus) {
+	if (cpus.empty())
+		return true;
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (uint32_t cpu : cpus) {
+		if (cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for (uint32_t cpu : cpus) {
+		if (cpu < sizeof(DWORD_PTR) * 8)
+			mask |= (DWORD_PTR)1 << cpu;
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	return false;
+#endif
+}
+
+void release_pages(void *data, size_t size) {
+#if defined(__linux__)
+	const size_t page = page_size();
+	const uintptr_t begin = ((uintptr_t)data + page - 1) / page * page;
+	const uintptr_t end = ((uintptr_t)data + size) / page * page;
+	if (end > begin)
+		madvise((void*)begin, end - begin, MADV_DONTNEED);
+#else
+	// TODO: Windows has no way to drop pages of a private allocation that makes them read as zeros afterwards
+	(void)data;
+	(void)size;
+#endif
+}
+
+void touch_pages(void *data, size_t size) {
+	const size_t page = page_size();
+	const uintptr_t begin = ((uintptr_t)data + page - 1) / page * page;
+	const uintptr_t end = (uintptr_t)data + size;
+	for (uintptr_t p = begin; p < end; p += page) {
+		volatile uint8_t *byte = (volatile uint8_t*)p;
+		*byte = *byte;
+	}
+}
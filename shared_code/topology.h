@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+	The logical CPUs the process may run on, grouped by NUMA node, and pinning of the render threads to them. Read from
+	/sys/devices/system/node on Linux and with GetNumaNodeProcessorMask on Windows (first processor group only).
+	Elsewhere, or when that fails, all CPUs are on one node.
+*/
+struct CpuTopology {
+	std::vector<std::vector<uint32_t>> node_cpus; // Logical CPU indices of each node that has any
+};
+
+// Read the first time it is asked for
+const CpuTopology &cpu_topology();
+
+enum ThreadPinning {
+	PIN_NONE,
+	PIN_CORES, // One logical CPU per thread
+	PIN_NODES, // Any CPU of the node of the thread
+};
+
+/*
+	Where each render thread goes. The threads are split into contiguous groups, one per node, so that the contiguous
+	ranges of tiles the scheduler deals out to the threads are node local as well.
+*/
+struct ThreadPlacement {
+	std::vector<uint32_t> node; // Per thread
+	std::vector<std::vector<uint32_t>> cpus; // Per thread, the CPUs it may run on
+};
+
+ThreadPlacement place_threads(const CpuTopology &topology, uint32_t num_threads, ThreadPinning pinning);
+
+bool pin_current_thread(const std::vector<uint32_t> &cpus);
+
+// Drops the physical memory of the whole pages in [data, data+size). They read as zeros and get memory from the node
+// of the thread that writes to them first. Does nothing where that is not supported.
+void release_pages(void *data, size_t size);
+
+// Writes the first byte of each page that starts in [data, data+size) without changing it, so that the page is
+// allocated on the node of the calling thread if it has not been written to yet
+void touch_pages(void *data, size_t size);
@@ -3,6 +3,7 @@
 #define _USE_MATH_DEFINES // TODO: Move to cmake
 
 #include <stdint.h>
+#include <string.h>
 #include <cmath>
 #include <cassert>
 #include <algorithm>
@@ -37,6 +38,9 @@ inline Float3 operator-(const Float3 a, const Float3 b) { return float3(a.x-b.x,
 inline Float3 operator-(const Float3 a) { return float3(-a.x, -a.y, -a.z); }
 inline float mean(const Float3 a) { return (a.x+a.y+a.z)*(1.0f/3.0f); }
 inline float max(const Float3 a) { return std::max(std::max(a.x, a.y), a.z); }
+inline float max_abs(const Float3 a) { return std::max(std::max(fabsf(a.x), fabsf(a.y)), fabsf(a.z)); }
+inline float luminance(const Float3 a) { return 0.2126f*a.x + 0.7152f*a.y + 0.0722f*a.z; } // Rec. 709
+inline float length(const Float3 a) { return sqrtf(a.x*a.x + a.y*a.y + a.z*a.z); }
 inline float clamp(float v, float m0, float m1) {
 	if (v<m0) return m0;
 	if (v>m1) return m1;
@@ -65,6 +69,91 @@ inline Float3 cross(Float3 a, Float3 v) {
 	return float3(y*v.z-z*v.y, z*v.x-x*v.z, x*v.y-y*v.x);
 }
 
+/*
+	Moves p, a point on a surface, off it along the normal n to the side n points to, as the origin of a ray that
+	leaves the surface. The offset is a fixed number of ulps of magnitude, the size of the numbers p was computed from,
+	so it stays above the rounding error of p in scenes of any scale and rays can start at tnear 0. Below ORIGIN the
+	ulps get tiny and the offset is a fixed distance instead. From "A Fast and Robust Method for Avoiding
+	Self-Intersection" in Ray Tracing Gems, which scales each coordinate by its own ulps. That assumes p was
+	interpolated from the vertices, ours come from org + dir*t, so all coordinates are off by ulps of the largest term.
+*/
+inline float ray_origin_offset(float magnitude) {
+	const float ORIGIN = 1.0f/32.0f;
+	const float FLOAT_SCALE = 1.0f/65536.0f;
+	const int32_t INT_SCALE = 256;
+	if (magnitude < ORIGIN)
+		return FLOAT_SCALE;
+	int32_t bits;
+	memcpy(&bits, &magnitude, sizeof(bits));
+	bits += INT_SCALE;
+	float moved;
+	memcpy(&moved, &bits, sizeof(moved));
+	return moved - magnitude;
+}
+inline Float3 offset_ray_origin(const Float3 p, const Float3 n, float magnitude) {
+	return p + n * ray_origin_offset(magnitude);
+}
+
+// Affine transform as the columns of a 3x4 matrix: x*v.x + y*v.y + z*v.z + p
+struct Transform {
+	Float3 x, y, z, p;
+};
+
+inline Transform scale_translate(const Float3 scale, const Float3 translation) {
+	Transform t;
+	t.x = float3(scale.x, 0, 0);
+	t.y = float3(0, scale.y, 0);
+	t.z = float3(0, 0, scale.z);
+	t.p = translation;
+	return t;
+}
+
+inline Float3 transform_vector(const Transform &t, const Float3 v) { return t.x*v.x + t.y*v.y + t.z*v.z; }
+inline Float3 transform_point(const Transform &t, const Float3 v) { return transform_vector(t, v) + t.p; }
+
+// Takes the inverse of the transform of the points, the normals are transformed by its transpose
+inline Float3 transform_normal(const Transform &inverse, const Float3 n) { return float3(dot(inverse.x, n), dot(inverse.y, n), dot(inverse.z, n)); }
+
+inline Transform inverse(const Transform &t) {
+	// The rows of the inverse of the 3x3 part are the cross products of its columns over the determinant
+	const Float3 r0 = cross(t.y, t.z), r1 = cross(t.z, t.x), r2 = cross(t.x, t.y);
+	const float inv_det = 1.0f / dot(t.x, r0);
+	Transform i;
+	i.x = float3(r0.x, r1.x, r2.x) * inv_det;
+	i.y = float3(r0.y, r1.y, r2.y) * inv_det;
+	i.z = float3(r0.z, r1.z, r2.z) * inv_det;
+	i.p = -transform_vector(i, t.p);
+	return i;
+}
+
+// Octahedron encoding with 16 bits per coordinate. n does not need to be normalized.
+inline uint32_t pack_normal(const Float3 n) {
+	const float inv_l1 = 1.0f / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+	float u = n.x * inv_l1, v = n.y * inv_l1;
+	if (n.z < 0.0f) {
+		// Fold the lower half of the octahedron over the upper one
+		const float fu = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		const float fv = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+		u = fu;
+		v = fv;
+	}
+	const uint32_t pu = (uint32_t)(int32_t)lrintf(u * 32767.0f) & 0xFFFF;
+	const uint32_t pv = (uint32_t)(int32_t)lrintf(v * 32767.0f) & 0xFFFF;
+	return pu | (pv << 16);
+}
+
+// Normalized
+inline Float3 unpack_normal(const uint32_t packed) {
+	const float u = (int16_t)(packed & 0xFFFF) * (1.0f/32767.0f);
+	const float v = (int16_t)(packed >> 16) * (1.0f/32767.0f);
+	Float3 n = float3(u, v, 1.0f - fabsf(u) - fabsf(v));
+	if (n.z < 0.0f) {
+		n.x = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		n.y = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+	}
+	return normalized(n);
+}
+
 inline Float3 frame(Float3 normal, float x, float y, float z) {
 	Float3 minor_axis = float3(0,0,0);
 	if (fabs(normal.x) < fabs(normal.y)) {
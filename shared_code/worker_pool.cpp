@@ -0,0 +1,52 @@
+#include "worker_pool.h"
+#include <assert.h>
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (std::thread &t : threads)
+		t.join();
+}
+
+void WorkerPool::start(uint32_t num_threads, const std::function<void(uint32_t)> &f) {
+	std::unique_lock<std::mutex> lock(mutex);
+	assert(num_running == 0);
+	while ((uint32_t)threads.size() < num_threads) {
+		const uint32_t thread_index = (uint32_t)threads.size();
+		threads.push_back(std::thread([this, thread_index]() { worker(thread_index); }));
+	}
+	function = f;
+	num_job_threads = num_threads;
+	num_running = num_threads;
+	generation++;
+	lock.unlock();
+	wake.notify_all();
+}
+
+void WorkerPool::wait() {
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this]() { return num_running == 0; });
+}
+
+void WorkerPool::worker(uint32_t thread_index) {
+	// A thread created by start must still pick up that job, so it starts out one generation behind
+	std::unique_lock<std::mutex> lock(mutex);
+	uint64_t seen_generation = generation - 1;
+	while (true) {
+		wake.wait(lock, [&]() { return quit || generation != seen_generation; });
+		if (quit)
+			return;
+		seen_generation = generation;
+		if (thread_index >= num_job_threads)
+			continue;
+
+		lock.unlock();
+		function(thread_index);
+		lock.lock();
+		if (--num_running == 0)
+			done.notify_all();
+	}
+}
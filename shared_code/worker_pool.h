@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+	Threads that are kept alive between renders, so that a process rendering many images (server mode, batches,
+	progressive rounds) does not start new ones for each. The threads are created when first needed. Thread locals of
+	the render threads (scratch buffers, counters) live as long as the pool, so reset what must start from zero.
+*/
+struct WorkerPool {
+	~WorkerPool();
+
+	// Runs function(thread_index) for thread_index in [0, num_threads) on the pool threads. Returns right away.
+	void start(uint32_t num_threads, const std::function<void(uint32_t)> &function);
+
+	// Returns when all threads are done with the function given to start
+	void wait();
+
+private:
+	void worker(uint32_t thread_index);
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	std::function<void(uint32_t)> function;
+	uint32_t num_job_threads = 0; // Threads with a lower index run the function
+	uint32_t num_running = 0;
+	uint64_t generation = 0; // Incremented by start, the threads wait for it to change
+	bool quit = false;
+};